@@ -2,43 +2,79 @@
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 // Windows Header Files
 #include <windows.h>
+#include <immintrin.h>
 
 #include <thread>
 #include <vector>
-#include <list>
-#include <mutex>
-#include <condition_variable>
 #include <memory>
 #include <atomic>
-#include <functional>
+#include <cstdint>
 #include <iostream>
 
-
-
+#include "platform.h"
+
+//
+// A fixed pool of threads, running the same task on all of them: task(thread_idx, num_threads).
+//
+// The task is type-erased once per run into a context pointer and a call thunk - nothing is copied or allocated,
+// the callable stays where the caller has it. The threads pick up the runs in order by their sequence number,
+// spinning for a little while before parking on the atomic (a futex / WaitOnAddress), so back-to-back short runs
+// do not go through the scheduler at all; the caller waits for completion the same way.
+//
+// GridStart() queues a run without waiting for it: one run may be queued while the previous one drains, the threads
+// that finish early go on to the next one straight away. GridStart / GridWait / GridRun are for a single caller thread.
+//
+// Optionally thread i is pinned to the processor pins[i] (see platform::pin_order()), NodeOf() telling its NUMA node.
+// SetBackground() drops the threads to background priority, for sharing the machine with latency sensitive services -
+// the tile_scheduler then also adapts the number of threads at work to the CPU they get.
+//
 class ThreadGrid
 {
+    using Invoker = void (*)(void*, int, int);
+
+    struct Job
+    {
+        void* context{ nullptr };
+        Invoker invoke{ nullptr };
+    };
+
+    // pause iterations to spin before parking, a few microseconds; none on a single core, where spinning only
+    // keeps the thread we wait for off the CPU
+    static constexpr int SpinIterations = 1024;
+    static constexpr int YieldInterval = 64;
+
     int numThreads;
+    int spinIterations;
 
     std::vector<std::thread> threads;
-    std::vector<std::mutex> threadIsActive;
+    std::vector<platform::cpu> pins;
+    int numNodes{ 1 };
+    bool background{ false };
 
-    std::atomic_bool terminate{ false };
+    // run k uses jobs[k % 2] and pending[k % 2], so run k + 2 can only be started once run k is done
+    Job jobs[2];
+    alignas(64) std::atomic<int> pending[2];
 
-    std::function<void(int, int)> task;
-    std::mutex taskLock;
-    std::vector<bool> hasTask;
-    int numActiveThreads;
-    std::condition_variable taskAwailableCond;
-    std::condition_variable taskDoneCond;
+    alignas(64) std::atomic<uint64_t> published{ 0 };   // runs started so far
+    alignas(64) std::atomic<uint64_t> completed{ 0 };   // runs done so far
+
+    std::atomic_bool terminate{ false };
 
 public:
-    ThreadGrid(int n)
+    ThreadGrid(int n, std::vector<platform::cpu> pinTo = {})
         : numThreads(n)
+        , spinIterations(std::thread::hardware_concurrency() > 1 ? SpinIterations : 0)
         , threads(n)
-        , threadIsActive(n)
-        , hasTask(n)
-		, numActiveThreads{0}
+        , pins(std::move(pinTo))
     {
+        pending[0] = 0;
+        pending[1] = 0;
+
+        // more threads than processors to pin to: the rest float
+        pins.resize(std::min<size_t>(pins.size(), n));
+        for (const auto& pin : pins)
+            numNodes = std::max(numNodes, pin.node + 1);
+
         for (int i = 0; i < n; ++i)
         {
             threads[i] = std::thread(&ThreadGrid::Thread, this, i);
@@ -47,11 +83,12 @@ public:
 
     ~ThreadGrid()
     {
+        GridWait();
+
+        // the threads only look at 'terminate' when woken by a new run
         terminate = true;
-        {
-            std::lock_guard<std::mutex> m(taskLock);
-            taskAwailableCond.notify_all();
-        }
+        published.fetch_add(1);
+        published.notify_all();
 
         for (auto& thread : threads)
         {
@@ -60,60 +97,122 @@ public:
         }
     }
 
-    void GridRun(std::function<void(int, int)>&& item) noexcept
+    int NumThreads() const noexcept
+    {
+        return numThreads;
+    }
+
+    // the NUMA nodes of the pinned threads are 0 .. NumNodes() - 1, each with a thread on it
+    int NumNodes() const noexcept
+    {
+        return numNodes;
+    }
+
+    bool SetBackground() noexcept
+    {
+        std::atomic_bool ok{ true };
+        GridRun(
+            [&](int, int)
+            {
+                if (!platform::set_background_priority())
+                    ok = false;
+            });
+
+        background = true;
+        return ok;
+    }
+
+    bool IsBackground() const noexcept
+    {
+        return background;
+    }
+
+    // the NUMA node of thread threadIdx, 0 if it is not pinned
+    int NodeOf(int threadIdx) const noexcept
+    {
+        return threadIdx < static_cast<int>(pins.size()) ? pins[threadIdx].node : 0;
+    }
+
+    // Runs task(thread_idx, num_threads) on every thread, returns when all are done
+    template <typename TTask>
+    void GridRun(TTask&& task) noexcept
+    {
+        GridStart(task);
+        GridWait();
+    }
+
+    // Queues task(thread_idx, num_threads), which must stay alive until the run is done - see GridWait().
+    // Waits for the run before the previous one to finish first, as its slot is reused.
+    template <typename TTask>
+    void GridStart(TTask& task) noexcept
     {
-		try 
-		{
-			std::unique_lock<std::mutex> m(taskLock);
-
-			std::fill(std::begin(hasTask), std::end(hasTask), true);
-			numActiveThreads = numThreads;
-
-			task = std::move(item);
-
-			// this will wake waiting threads, but only when we unlcok the taskLock -
-			// i.e. when we do wait ourselves below
-			taskAwailableCond.notify_all();
-
-			// Wait for the theads to finish
-			taskDoneCond.wait(m, [&] {return numActiveThreads == 0; });
-
-			// Finally - ensure we clean up the task closure
-			task = std::function<void(int, int)>();
-		}
-		catch (...)
-		{
-			std::cerr << "unhandled exception in GridRun" << std::endl;
-			std::terminate();
-		}
+        const uint64_t run = published.load();
+
+        if (run >= 2)
+            WaitFor(run - 1);
+
+        jobs[run % 2] = { const_cast<void*>(static_cast<const void*>(&task)), [](void* context, int threadIdx, int n) { (*static_cast<TTask*>(context))(threadIdx, n); } };
+        pending[run % 2].store(numThreads);
+
+        published.store(run + 1);
+        published.notify_all();
+    }
+
+    // Waits for all the runs started so far
+    void GridWait() noexcept
+    {
+        WaitFor(published.load());
     }
 
 private:
+    void WaitFor(uint64_t runs) noexcept
+    {
+        Await(completed, runs);
+    }
+
+    // spins, then parks, until 'value' reaches 'target' (or the grid is terminating)
+    void Await(std::atomic<uint64_t>& value, uint64_t target) noexcept
+    {
+        for (int i = 0; i < spinIterations; ++i)
+        {
+            if (value.load(std::memory_order_acquire) >= target)
+                return;
+
+            // more threads than cores: let the others run
+            if (i % YieldInterval == YieldInterval - 1)
+                std::this_thread::yield();
+            else
+                _mm_pause();
+        }
+
+        for (uint64_t v = value.load(); v < target; v = value.load())
+            value.wait(v);
+    }
+
     void Thread(int threadIdx)
     {
         _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
         _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
-        while (!terminate)
+        if (threadIdx < static_cast<int>(pins.size()) && !platform::pin_current_thread(pins[threadIdx]))
+            std::cerr << "failed to pin thread " << threadIdx << " to processor " << pins[threadIdx].number << std::endl;
+
+        for (uint64_t run = 0; ; ++run)
         {
-            std::function<void(int, int)> item;
+            Await(published, run + 1);
 
-            {
-                std::unique_lock<std::mutex> m(taskLock);
-                taskAwailableCond.wait(m, [&] {return hasTask[threadIdx] || terminate; });
-                if (!hasTask[threadIdx])
-                    continue;
-                item = task;
-            }
+            if (terminate)
+                break;
 
-            // we have the task - run it
-            item(threadIdx, numThreads);
+            const Job& job = jobs[run % 2];
+            job.invoke(job.context, threadIdx, numThreads);
 
-            // Mark ourselves as done, and if we are the last thread - notify the waitinig "GridRun"
-            std::unique_lock<std::mutex> m(taskLock);
-            hasTask[threadIdx] = false;
-            if (--numActiveThreads == 0)
-                taskDoneCond.notify_all();
+            // the last one out marks the run as done - the runs complete in order, as every thread does them in order
+            if (pending[run % 2].fetch_sub(1) == 1)
+            {
+                completed.store(run + 1);
+                completed.notify_all();
+            }
         }
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+
+#include "ThreadGrid.h"
+#include "output_grid.h"
+
+//
+// Adaptive sampling of the output plane: diff_value() is evaluated exactly on a coarse lattice of the
+// representative part of the output grid first (each evaluation fills the mirrored outputs as usual). Every lattice cell is then
+// tested by evaluating its edge midpoints and centre exactly and comparing them against the bilinear
+// interpolation of the cell corners. Cells where the error of any spectral plane exceeds the threshold are
+// split in 4 and tested again, the rest are filled in by interpolation.
+//
+// The threshold is in units of the 8-bit output, i.e. relative to the exposure 'max' the PNG is normalised to,
+// so the smooth halo far from the core ends up interpolated, while the diffraction spikes are refined down
+// to the single pixels.
+//
+template <typename TAperture>
+class adaptive_sampler
+{
+	using pixel = typename TAperture::pixel;
+
+	// corners are inclusive; the pixels a cell fills by interpolation are the half-open [x0, x1) x [y0, y1),
+	// extended to x1 / y1 at the far edges of the quadrant - that way the accepted cells never overlap
+	struct cell
+	{
+		int x0;
+		int y0;
+		int x1;
+		int y1;
+	};
+
+	TAperture& ap;
+	const output_grid& out_grid;
+	typename TAperture::raw& out;
+
+	int quadrant_width;	// of the representative part of the grid - the top-left quadrant for the full frame
+	int quadrant_height;
+
+	double to_output_levels; // raw intensity -> 8-bit output levels
+	double threshold;
+
+	std::vector<uint8_t> exact; // per quadrant pixel
+
+public:
+	size_t num_exact{ 0 };
+
+	adaptive_sampler(TAperture& ap, const output_grid& out_grid, typename TAperture::raw& out, float max, float threshold)
+		: ap{ ap }
+		, out_grid{ out_grid }
+		, out{ out }
+		, quadrant_width{ out_grid.rep_width }
+		, quadrant_height{ out_grid.rep_height }
+		, to_output_levels{ 255.0 / max }
+		, threshold{ threshold }
+		, exact(static_cast<size_t>(out_grid.rep_width) * out_grid.rep_height)
+	{
+	}
+
+	void run(ThreadGrid& grid, int step)
+	{
+		const auto start = std::chrono::system_clock::now();
+
+		std::vector<int> xs = lattice(quadrant_width, step);
+		std::vector<int> ys = lattice(quadrant_height, step);
+
+		std::vector<std::pair<int, int>> points;
+		for (int y : ys)
+		{
+			for (int x : xs)
+				queue(x, y, points);
+		}
+		evaluate(grid, points);
+
+		std::vector<cell> active;
+		for (size_t j = 0; j + 1 < ys.size(); ++j)
+		{
+			for (size_t i = 0; i + 1 < xs.size(); ++i)
+				active.push_back({ xs[i], ys[j], xs[i + 1], ys[j + 1] });
+		}
+
+		// degenerate lattices (a quadrant 1px wide or high) have no cells, the lattice covers it all
+		std::vector<cell> accepted;
+
+		for (int level = 0; !active.empty(); ++level)
+		{
+			points.clear();
+			for (const auto& c : active)
+			{
+				if (!splittable(c))
+					continue;
+
+				int mx = (c.x0 + c.x1) / 2;
+				int my = (c.y0 + c.y1) / 2;
+
+				queue(mx, c.y0, points);
+				queue(mx, c.y1, points);
+				queue(c.x0, my, points);
+				queue(c.x1, my, points);
+				queue(mx, my, points);
+			}
+			evaluate(grid, points);
+
+			std::vector<cell> next;
+			for (const auto& c : active)
+			{
+				if (splittable(c) && cell_error(c) > threshold)
+					split(c, next);
+				else
+					accepted.push_back(c);
+			}
+
+			std::cout << "adaptive level " << level << ": " << active.size() << " cells tested, "
+				<< points.size() << " pixels evaluated, " << next.size() << " cells to refine" << std::endl;
+
+			active = std::move(next);
+		}
+
+		std::atomic_size_t next_cell{ 0 };
+
+		grid.GridRun(
+			[&](int, int)
+			{
+				for (size_t i = next_cell++; i < accepted.size(); i = next_cell++)
+					interpolate(accepted[i]);
+			});
+
+		const auto end = std::chrono::system_clock::now();
+
+		std::cout << "exactly evaluated: " << num_exact << " of " << exact.size() << " quadrant pixels ("
+			<< 100.0 * num_exact / std::max<size_t>(1, exact.size()) << "%)" << std::endl;
+		std::cout << "run duration: " << std::chrono::system_clock::to_time_t(end) - std::chrono::system_clock::to_time_t(start) << " seconds" << std::endl;
+	}
+
+private:
+	// 0, step, 2 * step, ... and the last pixel
+	static std::vector<int> lattice(int size, int step)
+	{
+		std::vector<int> ret;
+		for (int i = 0; i < size; i += step)
+			ret.push_back(i);
+		if (ret.back() != size - 1)
+			ret.push_back(size - 1);
+		return ret;
+	}
+
+	static bool splittable(const cell& c)
+	{
+		return c.x1 - c.x0 > 1 || c.y1 - c.y0 > 1;
+	}
+
+	static void split(const cell& c, std::vector<cell>& cells)
+	{
+		int mx = (c.x0 + c.x1) / 2;
+		int my = (c.y0 + c.y1) / 2;
+
+		std::vector<int> xs{ c.x0 };
+		if (mx != c.x0)
+			xs.push_back(mx);
+		xs.push_back(c.x1);
+
+		std::vector<int> ys{ c.y0 };
+		if (my != c.y0)
+			ys.push_back(my);
+		ys.push_back(c.y1);
+
+		for (size_t j = 0; j + 1 < ys.size(); ++j)
+		{
+			for (size_t i = 0; i + 1 < xs.size(); ++i)
+				cells.push_back({ xs[i], ys[j], xs[i + 1], ys[j + 1] });
+		}
+	}
+
+	size_t quadrant_offs(int x, int y) const
+	{
+		return static_cast<size_t>(y) * quadrant_width + x;
+	}
+
+	void queue(int x, int y, std::vector<std::pair<int, int>>& points)
+	{
+		auto& flag = exact[quadrant_offs(x, y)];
+		if (flag)
+			return;
+
+		flag = 1;
+		points.push_back({ x, y });
+	}
+
+	void evaluate(ThreadGrid& grid, const std::vector<std::pair<int, int>>& points)
+	{
+		std::atomic_size_t next_point{ 0 };
+
+		grid.GridRun(
+			[&](int, int)
+			{
+				for (size_t i = next_point++; i < points.size(); i = next_point++)
+				{
+					render_grid_pixel(ap, out_grid, out, points[i].first, points[i].second);
+				}
+			});
+
+		num_exact += points.size();
+	}
+
+	// bilinear interpolation of the cell corners at (x, y), for the mirrored image m and spectral plane i; 
+	// the mirrored images are only equal for symmetric apertures, so each is interpolated on its own
+	double interpolated(const cell& c, int x, int y, int m, size_t i) const
+	{
+		double tx = c.x1 != c.x0 ? static_cast<double>(x - c.x0) / (c.x1 - c.x0) : 0.0;
+		double ty = c.y1 != c.y0 ? static_cast<double>(y - c.y0) / (c.y1 - c.y0) : 0.0;
+
+		return (1.0 - tx) * (1.0 - ty) * out[out_grid.image_offs(c.x0, c.y0, m)][i]
+			+ tx * (1.0 - ty) * out[out_grid.image_offs(c.x1, c.y0, m)][i]
+			+ (1.0 - tx) * ty * out[out_grid.image_offs(c.x0, c.y1, m)][i]
+			+ tx * ty * out[out_grid.image_offs(c.x1, c.y1, m)][i];
+	}
+
+	// max error over the test points, mirrored images and spectral planes, in output levels
+	double cell_error(const cell& c) const
+	{
+		int mx = (c.x0 + c.x1) / 2;
+		int my = (c.y0 + c.y1) / 2;
+
+		const std::pair<int, int> tests[] = { { mx, c.y0 }, { mx, c.y1 }, { c.x0, my }, { c.x1, my }, { mx, my } };
+
+		double err = 0.0;
+		for (const auto& t : tests)
+		{
+			for (int m = 0; m < 4; ++m)
+			{
+				if (!out_grid.has_image(t.first, t.second, m))
+					continue;
+
+				const pixel& v = out[out_grid.image_offs(t.first, t.second, m)];
+				for (size_t i = 0; i < v.size(); ++i)
+					err = std::max(err, std::abs(v[i] - interpolated(c, t.first, t.second, m, i)));
+			}
+		}
+
+		return err * to_output_levels;
+	}
+
+	void interpolate(const cell& c)
+	{
+		int x_end = c.x1 == quadrant_width - 1 ? c.x1 + 1 : c.x1;
+		int y_end = c.y1 == quadrant_height - 1 ? c.y1 + 1 : c.y1;
+
+		for (int y = c.y0; y < y_end; ++y)
+		{
+			for (int x = c.x0; x < x_end; ++x)
+			{
+				if (exact[quadrant_offs(x, y)])
+					continue;
+
+				for (int m = 0; m < 4; ++m)
+				{
+					if (!out_grid.has_image(x, y, m))
+						continue;
+
+					pixel& v = out[out_grid.image_offs(x, y, m)];
+					for (size_t i = 0; i < v.size(); ++i)
+						v[i] = interpolated(c, x, y, m, i);
+				}
+			}
+		}
+	}
+};
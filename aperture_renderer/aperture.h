@@ -51,6 +51,13 @@
 #pragma once
 #include <vector>
 #include <array>
+#include <complex>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
 
 #define _USE_MATH_DEFINES // for C++
 #include <cmath>
@@ -58,17 +65,89 @@
 #include "lambda_profile.h"
 
 #include "kahan.h"
+#include "mapped_output.h"
+
+// Leaves the elements of a vector uninitialised (default- rather than value-initialised), so a large buffer is not 
+// touched by the thread that allocates it - it is zeroed by the threads that render into it, see first_touch().
+// Buffers over the --max-memory threshold are mapped from a file, see mapped_output.h.
+template <typename T>
+struct default_init_allocator : std::allocator<T>
+{
+	template <typename U>
+	struct rebind
+	{
+		using other = default_init_allocator<U>;
+	};
+
+	default_init_allocator() = default;
+
+	template <typename U>
+	default_init_allocator(const default_init_allocator<U>&) noexcept
+	{
+	}
+
+	T* allocate(size_t n)
+	{
+		if (void* p = mapped_output::allocate(n * sizeof(T)))
+			return static_cast<T*>(p);
+		return std::allocator<T>::allocate(n);
+	}
+
+	void deallocate(T* p, size_t n) noexcept
+	{
+		if (!mapped_output::deallocate(p))
+			std::allocator<T>::deallocate(p, n);
+	}
+
+	template <typename U>
+	void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value)
+	{
+		::new (static_cast<void*>(p)) U;
+	}
+
+	template <typename U, typename... TArgs>
+	void construct(U* p, TArgs&&... args)
+	{
+		::new (static_cast<void*>(p)) U(std::forward<TArgs>(args)...);
+	}
+};
 
 template <size_t N, typename TFloat, bool skip_r_square>
 struct aperture
 {
 	static constexpr TFloat TWO = 2.0;
+	static constexpr bool skips_r_square = skip_r_square;
 
 	using pixel = std::array<TFloat, N>;
 	using pixel_acc = std::array<kahan::acc<TFloat>, N>;
 
-	// output format
-	using raw = std::vector<pixel>;
+	// output format; not initialised on allocation - see first_touch()
+	using raw = std::vector<pixel, default_init_allocator<pixel>>;
+
+	// complex field (a + i*b) per wavelength, before it is squared into the intensity; 
+	// the field is linear in the intensity_mask, so it can be updated incrementally 
+	using field_pixel = std::array<std::complex<TFloat>, N>;
+	using field = std::vector<field_pixel>;
+
+	// a single changed pixel of the intensity_mask, see mask_changes() 
+	struct mask_change
+	{
+		int x;
+		int y;
+		TFloat delta;
+		TFloat z_sqr;
+	};
+
+	// A sub-pixel sample of a partially covered (edge) pixel, see edge_order below. weight[m] is the light of 
+	// the sample mirrored around the centre as m says (bit 0 - in x, bit 1 - in y), so that, just as in diff_field(),
+	// a single distance serves all the 4 mirrored outputs
+	struct edge_sample
+	{
+		TFloat x;
+		TFloat y;
+		TFloat z_sqr;
+		std::array<TFloat, 4> weight;
+	};
 
 	// i = y * Width + x
 	std::vector<TFloat> intensity_mask;
@@ -79,6 +158,15 @@ struct aperture
 	int width;
 	int height;
 
+	TFloat R;
+	float lambda;
+	float clr_step;
+
+	// > 1: the edge pixels are integrated over edge_order x edge_order sub-samples (edge_samples, their intensity_mask
+	// entries are zeroed; the set is closed under the mirroring), and all the pixels over their area, see add_edge_field()
+	int edge_order;
+	std::vector<edge_sample> edge_samples;
+
 	int ap_skip_x{ 0 };
 	int ap_skip_y{ 0 };
 
@@ -90,14 +178,30 @@ struct aperture
 	// it affects the curvature of the light wavefront. 
 	// The screen is the plane with z==0. 
 
+	// edge_order == 1: the image is thresholded, every pixel is a single point sample. 
+	// edge_order > 1: the image is taken as the coverage of each pixel (anti-aliased edges), and the partially covered
+	// pixels are integrated over edge_order x edge_order sub-samples instead, see split_edge_pixels() and add_edge_field()
 	aperture(std::vector<unsigned char> img,
-		int width, int height, TFloat R, float lambda, float clr_step, TFloat unfocus_factor)
-		: width{ width }
+		int width, int height, TFloat R, float lambda, float clr_step, TFloat unfocus_factor, int edge_order = 1)
+		: aperture{ edge_order > 1 ? coverage_mask(img, width, height) : threshold_mask(img, width, height), 
+			width, height, R, lambda, clr_step, unfocus_factor, edge_order }
+	{
+	}
+
+	// Same as above, but from a ready mask of the light passing through each pixel (1.0 for a fully open one), 
+	// e.g. a downsampled one
+	aperture(std::vector<TFloat> mask,
+		int width, int height, TFloat R, float lambda, float clr_step, TFloat unfocus_factor, int edge_order = 1)
+		: intensity_mask{ std::move(mask) }
+		, width{ width }
 		, height{ height }
+		, R{ R }
+		, lambda{ lambda }
+		, clr_step{ clr_step }
+		, edge_order{ edge_order }
 		, total_light_per_pixel { 0.0 }
 		, unfocus_factor{ unfocus_factor  }
 	{
-		intensity_mask.resize(width* height);
 		z_sqr_values.resize(width* height);
 
 		// 0.5 factor is subtracted, as the centre is supposedly in between the middle two pixels, 
@@ -106,21 +210,16 @@ struct aperture
 		TFloat cx = width / TWO - 0.5f;
 		TFloat cy = height / TWO - 0.5f;
 
+		if (edge_order > 1)
+			split_edge_pixels(edge_order, cx, cy);
+
 		// Loop through the images pixels to reset color.
 		for (int y = 0; y < height; y++)
 		{
 			for (int x = 0; x < width; x++)
 			{
-				auto img_offs = 4 * (y * width + x);
 				auto dst_offs = y * width + x;
 
-				TFloat r = img[img_offs];
-				TFloat g = img[img_offs + 1];
-				TFloat b = img[img_offs + 2];
-
-				TFloat v = (r + g + b) / 3.0f / 255.0f;
-
-				intensity_mask[dst_offs] = v > 0.5f ? 1.0 : 0.0;
 				z_sqr_values[dst_offs] = 
 					R * R 
 					- std::pow(x - cx, TWO)
@@ -147,13 +246,28 @@ struct aperture
 		}
 
 
+		for (auto& sample : edge_samples)
+		{
+			if (sample.z_sqr < 0)
+				sample.weight = {};
+
+			total_light_per_pixel += sample.weight[0];
+
+			if constexpr (!skip_r_square)
+			{
+				for (auto& w : sample.weight)
+					w *= R * R;
+			}
+		}
+
+		// the rows / columns are skipped together with their mirrored counterparts, so all of them have to be empty
 		for (int y = 0; y < height/2; y++)
 		{
 			TFloat sum_all{ 0.0 };
 			for (int x = 0; x < width; x++)
 			{
 				sum_all += intensity_mask[y * width + x];
-				sum_all += intensity_mask[y * width + (width-x-1)];
+				sum_all += intensity_mask[(height-y-1) * width + x];
 			}
 			if (sum_all != 0.0)
 				break;
@@ -166,7 +280,7 @@ struct aperture
 			for (int y = 0; y < height; y++)
 			{
 				sum_all += intensity_mask[y * width + x];
-				sum_all += intensity_mask[(height-y-1) * width + x];
+				sum_all += intensity_mask[y * width + (width-x-1)];
 			}
 			if (sum_all != 0.0)
 				break;
@@ -181,7 +295,234 @@ struct aperture
 		}
 	}
 
-	void diff_value(int x, int y, pixel& out, pixel& out_mx, pixel& out_my, pixel& out_mx_my) noexcept
+	// The RGBA image to the 0 / 1 mask: pixels brighter than 50% are open 
+	static std::vector<TFloat> threshold_mask(const std::vector<unsigned char>& img, int width, int height)
+	{
+		std::vector<TFloat> mask(static_cast<size_t>(width) * height);
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				auto img_offs = 4 * (static_cast<size_t>(y) * width + x);
+
+				TFloat r = img[img_offs];
+				TFloat g = img[img_offs + 1];
+				TFloat b = img[img_offs + 2];
+
+				TFloat v = (r + g + b) / 3.0f / 255.0f;
+
+				mask[static_cast<size_t>(y) * width + x] = v > 0.5f ? 1.0 : 0.0;
+			}
+		}
+
+		return mask;
+	}
+
+	// The RGBA image to the fraction of each pixel that is open 
+	static std::vector<TFloat> coverage_mask(const std::vector<unsigned char>& img, int width, int height)
+	{
+		std::vector<TFloat> mask(width * height);
+
+		for (size_t i = 0; i < mask.size(); i++)
+		{
+			TFloat r = img[4 * i];
+			TFloat g = img[4 * i + 1];
+			TFloat b = img[4 * i + 2];
+
+			mask[i] = (r + g + b) / 3.0f / 255.0f;
+		}
+
+		return mask;
+	}
+
+	// Replaces every partially covered pixel (0 < coverage < 1) by order x order sub-samples in edge_samples. 
+	// A single point sample per pixel puts all of its light at the centre - on the edges that is off by up to half 
+	// a pixel, and that error only goes away with finer rasters at quartic cost. Instead, the edge is taken as 
+	// a straight line across the pixel, facing the way the coverage grows (the Sobel gradient), and placed so that 
+	// the open side has the pixel's coverage; each sub-sample gets the light of its part of the open side.
+	// The interior stays a single sample per pixel.
+	void split_edge_pixels(int order, TFloat cx, TFloat cy)
+	{
+		auto coverage_of = [&](int xx, int yy) -> TFloat
+		{
+			xx = std::clamp(xx, 0, width - 1);
+			yy = std::clamp(yy, 0, height - 1);
+			return std::clamp<TFloat>(intensity_mask[yy * width + xx], 0, 1);
+		};
+
+		// the open side is found on a grid of points this much finer than the sub-samples
+		const int fine = order * 8;
+
+		std::vector<std::pair<TFloat, int>> projections(fine * fine);
+		std::vector<TFloat> shares(order * order);
+
+		auto sub_pos = [&](int sub) { return (sub + TFloat(0.5)) / order - TFloat(0.5); };
+
+		// sub-sample (sx, sy) of pixel (x, y) is (x * order + sx, y * order + sy), so the mirrored image of 
+		// sub-sample X is (width * order - 1 - X), which is what makes the set easy to close under the mirroring
+		std::map<std::pair<int, int>, TFloat> samples;
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				TFloat coverage = intensity_mask[y * width + x];
+				if (coverage <= 0 || coverage >= 1)
+					continue;
+
+				TFloat gx = coverage_of(x + 1, y - 1) + 2 * coverage_of(x + 1, y) + coverage_of(x + 1, y + 1)
+					- coverage_of(x - 1, y - 1) - 2 * coverage_of(x - 1, y) - coverage_of(x - 1, y + 1);
+				TFloat gy = coverage_of(x - 1, y + 1) + 2 * coverage_of(x, y + 1) + coverage_of(x + 1, y + 1)
+					- coverage_of(x - 1, y - 1) - 2 * coverage_of(x, y - 1) - coverage_of(x + 1, y - 1);
+
+				// the fine points with the largest projections on the gradient are the open ones
+				for (int fy = 0; fy < fine; fy++)
+				{
+					for (int fx = 0; fx < fine; fx++)
+					{
+						TFloat u = (fx + TFloat(0.5)) / fine - TFloat(0.5);
+						TFloat v = (fy + TFloat(0.5)) / fine - TFloat(0.5);
+						projections[fy * fine + fx] = { u * gx + v * gy, fy * fine + fx };
+					}
+				}
+
+				const size_t num_open = std::max<size_t>(1, static_cast<size_t>(std::lround(coverage * fine * fine)));
+
+				std::fill(shares.begin(), shares.end(), TFloat(0.0));
+
+				if (gx == 0 && gy == 0)
+				{
+					// nothing to tell where the edge is, e.g. a uniformly grey area
+					std::fill(shares.begin(), shares.end(), TFloat(1.0) / (order * order));
+				}
+				else
+				{
+					std::nth_element(projections.begin(), projections.begin() + (num_open - 1), projections.end(),
+						[](const auto& a, const auto& b) { return a.first > b.first; });
+
+					for (size_t k = 0; k < num_open; k++)
+					{
+						int fx = projections[k].second % fine;
+						int fy = projections[k].second / fine;
+						shares[(fy * order / fine) * order + fx * order / fine] += TFloat(1.0) / num_open;
+					}
+				}
+
+				for (int sy = 0; sy < order; sy++)
+				{
+					for (int sx = 0; sx < order; sx++)
+						samples[{ x * order + sx, y * order + sy }] = coverage * shares[sy * order + sx];
+				}
+			}
+		}
+
+		for (auto& p : samples)
+			intensity_mask[(p.first.second / order) * width + p.first.first / order] = 0.0;
+
+		const int sub_width = width * order;
+		const int sub_height = height * order;
+
+		auto weight_of = [&](int X, int Y) -> TFloat
+		{
+			auto it = samples.find({ X, Y });
+			return it != samples.end() ? it->second : 0.0;
+		};
+
+		std::set<std::pair<int, int>> closed;
+		for (auto& p : samples)
+		{
+			int X = p.first.first;
+			int Y = p.first.second;
+			closed.insert({ X, Y });
+			closed.insert({ sub_width - 1 - X, Y });
+			closed.insert({ X, sub_height - 1 - Y });
+			closed.insert({ sub_width - 1 - X, sub_height - 1 - Y });
+		}
+
+		for (auto& p : closed)
+		{
+			int X = p.first;
+			int Y = p.second;
+
+			edge_sample sample;
+			sample.x = sub_pos(X);
+			sample.y = sub_pos(Y);
+			sample.weight = {
+				weight_of(X, Y),
+				weight_of(sub_width - 1 - X, Y),
+				weight_of(X, sub_height - 1 - Y),
+				weight_of(sub_width - 1 - X, sub_height - 1 - Y)
+			};
+
+			if (sample.weight == std::array<TFloat, 4>{})
+				continue;
+
+			sample.z_sqr = R * R - std::pow(sample.x - cx, TWO) - std::pow(sample.y - cy, TWO);
+
+			if (std::abs(unfocus_factor) > 0.0001 && sample.z_sqr >= 0)
+			{
+				TFloat z = std::sqrt(sample.z_sqr) + unfocus_factor;
+				sample.z_sqr = z * z;
+			}
+
+			edge_samples.push_back(sample);
+		}
+	}
+
+	// (x, y) is the point of the sensor plane, in the aperture's pixels - pixel centres are at whole numbers, but any 
+	// point can be sampled. out_mx, out_my, out_mx_my get the values at (x, y) mirrored around the aperture centre.
+	void diff_value(TFloat x, TFloat y, pixel& out, pixel& out_mx, pixel& out_my, pixel& out_mx_my) noexcept
+	{
+		field_pixel f, f_mx, f_my, f_mx_my;
+
+		diff_field(x, y, f, f_mx, f_my, f_mx_my);
+
+		intensity(f, out);
+		intensity(f_mx, out_mx);
+		intensity(f_my, out_my);
+		intensity(f_mx_my, out_mx_my);
+	}
+
+	static void intensity(const field_pixel& f, pixel& out) noexcept
+	{
+		static constexpr TFloat PI = static_cast<TFloat>(M_PI);
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			out[i] = PI * std::norm(f[i]);
+		}
+	}
+
+	void diff_field(TFloat x, TFloat y, field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
+	{
+		sum_rows<true>(x, y, ap_skip_y, height - ap_skip_y, 0, N, out, out_mx, out_my, out_mx_my);
+
+		if (edge_order > 1)
+			add_edge_field(x, y, out, out_mx, out_my, out_mx_my);
+	}
+
+	// A part of diff_field(), for splitting the sum of a single output pixel over several threads (see split_k.h): 
+	// the sum over the aperture rows [ay_begin, ay_end) of [ap_skip_y, height - ap_skip_y), wavelengths [i_begin, i_end) 
+	// only - the rest of 'out' is left as it is. The parts add up to diff_field() but for the edge samples, which 
+	// are not linear in the parts - finish_field() adds those to the sum.
+	void diff_field_part(TFloat x, TFloat y, int ay_begin, int ay_end, int i_begin, int i_end,
+		field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
+	{
+		sum_rows<false>(x, y, ay_begin, ay_end, i_begin, i_end, out, out_mx, out_my, out_mx_my);
+	}
+
+	void finish_field(TFloat x, TFloat y, field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
+	{
+		if (edge_order > 1)
+			add_edge_field(x, y, out, out_mx, out_my, out_mx_my);
+	}
+
+	// The point sample sum of diff_field() over the aperture rows [ay_begin, ay_end), wavelengths [i_begin, i_end) - 
+	// or all of them, with the loop bounds known at compile time, for the full sum
+	template <bool all_wavelengths>
+	void sum_rows(TFloat x, TFloat y, int ay_begin, int ay_end, int i_begin, int i_end,
+		field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
 	{
 		pixel_acc accum_a{ 0 };
 		pixel_acc accum_b{ 0 };
@@ -195,10 +536,7 @@ struct aperture
 		pixel_acc accum_a_mx_my{ 0 };
 		pixel_acc accum_b_mx_my{ 0 };
 
-		int mx = width - 1 - x;
-		int my = height - 1 - y;
-
-		for (int ay = ap_skip_y; ay < height - ap_skip_y; ++ay)
+		for (int ay = ay_begin; ay < ay_end; ++ay)
 		{
 			for (int ax = ap_skip_x; ax < width - ap_skip_x; ++ax)
 			{
@@ -236,7 +574,7 @@ struct aperture
 				// this factor has almost zero impact on the performance, but kind of brings simulation to the 'exact match' 
 				const TFloat inv_l_sqr = skip_r_square ? 1.0 : (1.0 / l_sqr); 
 
-				for (int i = 0; i < N; ++i)
+				for (int i = all_wavelengths ? 0 : i_begin; i < (all_wavelengths ? static_cast<int>(N) : i_end); ++i)
 				{
 					TFloat d_tv = l * lambda_profiles[i].two_pi_inverse_lambda;
 					TFloat c = inv_l_sqr * std::cos(d_tv);
@@ -254,14 +592,144 @@ struct aperture
 			}
 		}
 
-		for (int i = 0; i < N; ++i)
+		for (int i = all_wavelengths ? 0 : i_begin; i < (all_wavelengths ? static_cast<int>(N) : i_end); ++i)
+		{
+			out[i] = { accum_a[i], accum_b[i] };
+			out_mx[i] = { accum_a_mx[i], accum_b_mx[i] };
+			out_my[i] = { accum_a_my[i], accum_b_my[i] };
+			out_mx_my[i] = { accum_a_mx_my[i], accum_b_mx_my[i] };
+		}
+	}
+
+	// The integral of exp(i * k * l) over a square of 'size' x 'size' pixels around an aperture point, relative to 
+	// the point sample, per wavelength. The lens (z_sqr_values) leaves the phase nearly linear across the aperture, 
+	// with the slope of (cx - x) / l in x (same in y), so the square acts as sinc(k * slope * size / 2) in x times 
+	// the same in y - a real factor, and the same for all the mirrored outputs. Matters once the phase turns by 
+	// a good part of a radian per pixel, which is where coarse rasters lose their accuracy away from the edges.
+	std::array<TFloat, N> footprint(TFloat x, TFloat y, TFloat size) const noexcept
+	{
+		const TFloat dx = width / TWO - 0.5f - x;
+		const TFloat dy = height / TWO - 0.5f - y;
+		const TFloat z = std::abs(unfocus_factor) > 0.0001 ? R + unfocus_factor : R;
+		const TFloat l = std::sqrt(dx * dx + dy * dy + z * z);
+
+		auto sinc = [](TFloat t) { return t == 0 ? TFloat(1.0) : std::sin(t) / t; };
+
+		std::array<TFloat, N> ret;
+		for (size_t i = 0; i < N; ++i)
+		{
+			const TFloat k = lambda_profiles[i].two_pi_inverse_lambda * size / (2 * l);
+			ret[i] = sinc(k * dx) * sinc(k * dy);
+		}
+		return ret;
+	}
+
+	// The area quadrature of edge_order > 1: the single samples of the interior pixels (already in 'out') are 
+	// integrated over the pixel analytically, and the sub-samples of the edge pixels over their sub-pixels
+	void add_edge_field(TFloat x, TFloat y, field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
+	{
+		std::array<pixel_acc, 4> accum_a{};
+		std::array<pixel_acc, 4> accum_b{};
+
+		for (const auto& sample : edge_samples)
+		{
+			TFloat l_sqr = std::pow(sample.x - x, TWO) + std::pow(sample.y - y, TWO) + sample.z_sqr;
+			TFloat l = std::sqrt(l_sqr);
+
+			const TFloat inv_l_sqr = skip_r_square ? 1.0 : (1.0 / l_sqr);
+
+			for (size_t i = 0; i < N; ++i)
+			{
+				TFloat d_tv = l * lambda_profiles[i].two_pi_inverse_lambda;
+				TFloat c = inv_l_sqr * std::cos(d_tv);
+				TFloat s = inv_l_sqr * std::sin(d_tv);
+
+				for (int m = 0; m < 4; ++m)
+				{
+					accum_a[m][i] += c * sample.weight[m];
+					accum_b[m][i] += s * sample.weight[m];
+				}
+			}
+		}
+
+		const auto pixel_factor = footprint(x, y, 1);
+		const auto sub_pixel_factor = footprint(x, y, TFloat(1.0) / edge_order);
+
+		field_pixel* outs[4] = { &out, &out_mx, &out_my, &out_mx_my };
+
+		for (int m = 0; m < 4; ++m)
+		{
+			for (size_t i = 0; i < N; ++i)
+			{
+				(*outs[m])[i] = pixel_factor[i] * (*outs[m])[i]
+					+ sub_pixel_factor[i] * std::complex<TFloat>{ accum_a[m][i], accum_b[m][i] };
+			}
+		}
+	}
+
+	// Lists the pixels where our intensity_mask differs from the 'previous' one (which must be of the same 
+	// size and built with the same R / unfocus_factor, so z_sqr_values are the same) 
+	std::vector<mask_change> mask_changes(const std::vector<TFloat>& previous) const
+	{
+		std::vector<mask_change> ret;
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int offs = y * width + x;
+				TFloat delta = intensity_mask[offs] - previous[offs];
+				if (delta != 0)
+					ret.push_back({ x, y, delta, z_sqr_values[offs] });
+			}
+		}
+
+		return ret;
+	}
+
+	// Adds the contribution of the changed pixels to the already computed field. 
+	// Since the field is linear in the intensity_mask, 
+	//	field(new_mask) = field(old_mask) + field(new_mask - old_mask), 
+	// so only the changed pixels have to be summed over. The symmetry trick of diff_field() does not apply 
+	// here (the changes are not symmetric in general), so each mirrored output gets its own distance. 
+	void diff_field_delta(TFloat x, TFloat y, const std::vector<mask_change>& changes,
+		field_pixel& out, field_pixel& out_mx, field_pixel& out_my, field_pixel& out_mx_my) noexcept
+	{
+		std::array<pixel_acc, 4> accum_a{};
+		std::array<pixel_acc, 4> accum_b{};
+
+		const TFloat mx = width - 1 - x;
+		const TFloat my = height - 1 - y;
+
+		for (const auto& change : changes)
 		{
-			static constexpr TFloat PI = static_cast<TFloat>(M_PI);
+			const TFloat dx[2] = { change.x - x, change.x - mx };
+			const TFloat dy[2] = { change.y - y, change.y - my };
 
-			out[i] = PI * (std::pow(accum_a[i], TWO) + std::pow(accum_b[i], TWO)) ;
-			out_mx[i] = PI * (std::pow(accum_a_mx[i], TWO) + std::pow(accum_b_mx[i], TWO));
-			out_my[i] = PI * (std::pow(accum_a_my[i], TWO) + std::pow(accum_b_my[i], TWO));
-			out_mx_my[i] = PI * (std::pow(accum_a_mx_my[i], TWO) + std::pow(accum_b_mx_my[i], TWO));
+			for (int m = 0; m < 4; ++m)
+			{
+				TFloat l_sqr = dx[m & 1] * dx[m & 1] + dy[m >> 1] * dy[m >> 1] + change.z_sqr;
+				TFloat l = std::sqrt(l_sqr);
+
+				const TFloat inv_l_sqr = skip_r_square ? 1.0 : (1.0 / l_sqr);
+
+				for (size_t i = 0; i < N; ++i)
+				{
+					TFloat d_tv = l * lambda_profiles[i].two_pi_inverse_lambda;
+					accum_a[m][i] += inv_l_sqr * std::cos(d_tv) * change.delta;
+					accum_b[m][i] += inv_l_sqr * std::sin(d_tv) * change.delta;
+				}
+			}
+		}
+
+		field_pixel* outs[4] = { &out, &out_mx, &out_my, &out_mx_my };
+
+		for (int m = 0; m < 4; ++m)
+		{
+			for (size_t i = 0; i < N; ++i)
+			{
+				(*outs[m])[i] += std::complex<TFloat>{ accum_a[m][i], accum_b[m][i] };
+			}
 		}
 	}
 };
@@ -1,5 +1,6 @@
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 // Windows Header Files
+#include <winsock2.h>	// before windows.h, see net.h
 #include <windows.h>
 #include <assert.h>
 
@@ -8,17 +9,48 @@
 #include <iostream>
 #include <vector>
 #include <array>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#include <functional>
 
 #include "lodepng.h"
 #include "ThreadGrid.h"
 #include "aperture.h"
-#include "wavelength_to_rgb.h"
+#include "colour_mapping.h"
+#include "field_cube.h"
+#include "adaptive_sampling.h"
+#include "progressive.h"
+#include "preview.h"
+#include "output_grid.h"
+#include "tile_scheduler.h"
+#include "split_k.h"
+#include "numa.h"
+#include "star_field.h"
+#include "checkpoint.h"
+#include "shard.h"
+#include "distributed.h"
+#include "batch.h"
+#include "render_daemon.h"
+#include "png_stream.h"
+#include "spectrum_storage.h"
+#include "spectral_cube.h"
 
 
 constexpr int NUM_COLORS = 16; //  64
 constexpr float CLR_STEP = 1.04427378242741f;  // 1.010889286051699530632830539475;
 constexpr float DEFAULT_R = 1000.0f;
 constexpr float DEFAULT_LAMBDA = .75f; // wavelength! not a functional prog lambda
+constexpr int WATCH_POLL_INTERVAL_MS = 500;
+constexpr int DEFAULT_ADAPTIVE_STEP = 16;
+constexpr double DEFAULT_SNAPSHOT_INTERVAL = 60.0; // seconds
+constexpr double DEFAULT_CHECKPOINT_INTERVAL = 300.0; // seconds
+constexpr double DEFAULT_TILE_TIMEOUT = 600.0; // seconds
+constexpr int WORKER_CONNECT_ATTEMPTS = 60; // a second apart
+constexpr int DEFAULT_PREVIEW_SAMPLES = 64;
+constexpr size_t DEFAULT_DAEMON_CACHE_MB = 1024;
+constexpr size_t BATCH_WAVE_BYTES = size_t(1) << 30; // of the outputs of the jobs of a --batch rendered together
 
 using apr = aperture_double<NUM_COLORS>;
 
@@ -37,23 +69,1493 @@ void report_progress(int value, int total)
 }
 
 
+struct options
+{
+	std::string input;
+	std::string output;
+	float R{ DEFAULT_R };
+	float lambda{ DEFAULT_LAMBDA };
+	float unfocus_factor{ 0.0f };
+
+	std::string field_file; // --field: where to persist the complex field for incremental re-renders
+	std::string cube_file;	// --cube: where to write the complex field of the render
+	std::string spectral_cube_file;	// --spectral-cube: where to write the intensities of the render, see spectral_cube.h
+	bool watch{ false };	// --watch: keep re-rendering whenever the input changes
+
+	float adaptive_threshold{ 0.0f }; // --adaptive: max interpolation error, in 8-bit output levels; 0 - render every pixel
+	int adaptive_step{ DEFAULT_ADAPTIVE_STEP };
+
+	bool progressive{ false };	// --progressive: coarse-to-fine pixel order, with periodic snapshots
+	std::string snapshot_file;	// --snapshot: where the snapshots go, the output file by default
+	double snapshot_interval{ DEFAULT_SNAPSHOT_INTERVAL };
+	double quality{ 0.0 };		// --quality: stop refining once a level changes the image less than that (output levels)
+	double time_budget{ 0.0 };	// --time-budget: seconds to render for (coarse-to-fine), 0 - no limit
+
+	std::string checkpoint_file;	// --checkpoint: where to keep the finished tiles, so the render can be resumed
+	double checkpoint_interval{ DEFAULT_CHECKPOINT_INTERVAL };
+	bool resume{ false };		// --resume: continue from the checkpoint, if there is one
+
+	int shard{ 0 };				// --shard: render only this part of the tiles (of num_shards) into the output, see shard.h
+	int num_shards{ 1 };
+
+	int serve_port{ 0 };		// --serve: hand the tiles out to --worker processes connecting to this port, see distributed.h
+	std::string serve_host;		// the interface it listens on, empty - all of them
+	double tile_timeout{ DEFAULT_TILE_TIMEOUT };
+	std::string worker_address;	// --worker: render the tiles of the coordinator at host:port
+
+	std::string batch_file;		// --batch: render the jobs of this manifest, see batch.h
+
+	std::string daemon_socket;	// --daemon: serve render requests on this local socket, see render_daemon.h
+	size_t cache_memory_mb{ DEFAULT_DAEMON_CACHE_MB };
+
+	int preview_factor{ 1 };	// --preview: downsample the aperture by that much, for a quick look
+	int preview_samples{ DEFAULT_PREVIEW_SAMPLES };
+
+	bool has_roi{ false };		// --roi: render only this rectangle of the full frame (in the input's pixels)
+	double roi[4]{ 0.0, 0.0, 0.0, 0.0 }; // x, y, w, h
+	double zoom{ 1.0 };			// --zoom: output pixels per input pixel
+	std::string roi_mask_file;	// --roi-mask: only render the output pixels that are not black in this image
+
+	float gain{ 1.0f };			// --gain: brighten the output by that much
+	colour_space colours{ colour_space::spectrum };	// --colour-mapping: how the spectrum becomes RGB
+	int bit_depth{ 8 };			// --bit-depth: of the output PNGs, 8 or 16
+	bool keep_spectrum{ false };	// --keep-spectrum: keep the NUM_COLORS intensities of the pixels, see render_plain()
+	spectrum_storage storage{ spectrum_storage::float64 };	// --spectrum-storage: how they are kept, see spectrum_storage.h
+	size_t max_memory_mb{ 0 };	// --max-memory: map the output buffers from files past this, see mapped_output.h; 0 - no limit
+
+	int edge_order{ 1 };		// --edges: sub-samples per side of the partially covered input pixels, 1 - threshold the input
+
+	std::string stars_file;		// --stars: convolve the render with these point sources, a list or an image
+	std::string stars_output;	// --stars-out: where the star field goes
+	int scene_width{ 0 };		// --scene: size of the star field, by default that of the stars image / of the render
+	int scene_height{ 0 };
+
+	bool pin{ false };			// --pin: pin the threads to the cores (physical cores first), replicate the aperture per NUMA node
+	bool pin_smt{ false };		// --pin smt: the SMT siblings too
+
+	int threads{ 0 };			// --threads: the number of worker threads, 0 - the processors we may use
+	bool background{ false };	// --background: low priority, fewer threads at work while starved of CPU
+
+	int split_chunks{ 0 };		// --split-k: aperture row chunks x wavelength groups per pixel, 0 - chosen from the problem size
+	int split_groups{ 0 };
+};
+
+// "v0,v1,...": exactly 'count' comma separated numbers
+bool parse_list(const char* str, double* values, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		char* end;
+		values[i] = std::strtod(str, &end);
+		if (end == str || *end != (i + 1 < count ? ',' : '\0'))
+			return false;
+		str = end + 1;
+	}
+	return true;
+}
+
+// The options that pick a kind of render, or what is done besides it - a bit each, for MODE_RULES
+enum mode_flag : uint32_t
+{
+	MODE_DAEMON = 1u << 0,
+	MODE_WORKER = 1u << 1,
+	MODE_BATCH = 1u << 2,
+	MODE_SERVE = 1u << 3,
+	MODE_SHARD = 1u << 4,
+	MODE_CHECKPOINT = 1u << 5,
+	MODE_RESUME = 1u << 6,
+	MODE_PREVIEW = 1u << 7,
+	MODE_FIELD = 1u << 8,
+	MODE_WATCH = 1u << 9,
+	MODE_CUBE = 1u << 10,
+	MODE_PROGRESSIVE = 1u << 11,
+	MODE_TIME_BUDGET = 1u << 12,
+	MODE_ADAPTIVE = 1u << 13,
+	MODE_SPLIT_K = 1u << 14,
+	MODE_SPECTRAL_CUBE = 1u << 15,
+	MODE_SPECTRUM_STORAGE = 1u << 16,
+	MODE_KEEP_SPECTRUM = 1u << 17,
+	MODE_STARS = 1u << 18,
+	MODE_EDGES = 1u << 19,
+	MODE_ROI = 1u << 20,
+	MODE_GAIN = 1u << 21,
+	MODE_COLOUR_MAPPING = 1u << 22,
+	MODE_BIT_DEPTH = 1u << 23,
+	MODE_ALL = (1u << 24) - 1,
+
+	// what main() picks one of, in this order
+	MODE_KINDS = MODE_PREVIEW | MODE_FIELD | MODE_WATCH | MODE_CUBE | MODE_SERVE | MODE_PROGRESSIVE | MODE_TIME_BUDGET
+		| MODE_ADAPTIVE | MODE_SPLIT_K,
+};
+
+struct mode_rule
+{
+	uint32_t flag;
+	const char* name;
+	bool (*is_set)(const options& opts);
+	uint32_t excludes;	// the flags it does not go with - either way round, see check_modes()
+	const char* note;	// why, if it takes saying
+};
+
+const mode_rule MODE_RULES[] = {
+	{ MODE_DAEMON, "--daemon", [](const options& o) { return !o.daemon_socket.empty(); },
+		MODE_ALL & ~(MODE_EDGES | MODE_COLOUR_MAPPING | MODE_BIT_DEPTH), "it takes what to render from the requests" },
+	{ MODE_WORKER, "--worker", [](const options& o) { return !o.worker_address.empty(); },
+		MODE_ALL, "it gets everything but the thread options from the coordinator" },
+	{ MODE_BATCH, "--batch", [](const options& o) { return !o.batch_file.empty(); },
+		MODE_ALL & ~(MODE_ROI | MODE_GAIN | MODE_COLOUR_MAPPING | MODE_BIT_DEPTH | MODE_EDGES),
+		"it takes the inputs and outputs from the manifest" },
+	{ MODE_SERVE, "--serve", [](const options& o) { return o.serve_port > 0; },
+		MODE_KINDS, "it is only supported for the plain render" },
+	{ MODE_SHARD, "--shard", [](const options& o) { return o.num_shards > 1; },
+		(MODE_KINDS & ~MODE_SERVE) | MODE_CHECKPOINT | MODE_STARS, "it writes its tiles to the output file, checkpointed" },
+	{ MODE_CHECKPOINT, "--checkpoint", [](const options& o) { return !o.checkpoint_file.empty(); },
+		MODE_KINDS & ~MODE_SERVE, "it is only supported for the plain render" },
+	{ MODE_RESUME, "--resume", [](const options& o) { return o.resume; }, 0, nullptr },
+	{ MODE_PREVIEW, "--preview", [](const options& o) { return o.preview_factor > 1; }, MODE_KINDS, nullptr },
+	{ MODE_FIELD, "--field", [](const options& o) { return !o.field_file.empty(); }, MODE_KINDS & ~MODE_WATCH, nullptr },
+	{ MODE_WATCH, "--watch", [](const options& o) { return o.watch; }, MODE_KINDS & ~MODE_FIELD, nullptr },
+	{ MODE_CUBE, "--cube", [](const options& o) { return !o.cube_file.empty(); }, MODE_KINDS, nullptr },
+	{ MODE_PROGRESSIVE, "--progressive", [](const options& o) { return o.progressive && o.time_budget <= 0.0; }, MODE_KINDS, nullptr },
+	{ MODE_TIME_BUDGET, "--time-budget", [](const options& o) { return o.time_budget > 0.0; }, MODE_KINDS,
+		"it renders coarse-to-fine, as --progressive" },
+	{ MODE_ADAPTIVE, "--adaptive", [](const options& o) { return o.adaptive_threshold > 0.0f; }, MODE_KINDS, nullptr },
+	{ MODE_SPLIT_K, "--split-k", [](const options& o) { return o.split_chunks > 0; }, MODE_KINDS, nullptr },
+	{ MODE_SPECTRAL_CUBE, "--spectral-cube", [](const options& o) { return !o.spectral_cube_file.empty(); },
+		MODE_SHARD | MODE_PREVIEW | MODE_FIELD | MODE_WATCH | MODE_CUBE, nullptr },
+	{ MODE_SPECTRUM_STORAGE, "--spectrum-storage", [](const options& o) { return o.storage != spectrum_storage::float64; },
+		MODE_KINDS | MODE_CHECKPOINT | MODE_SHARD | MODE_STARS, "only the plain render keeps the spectrum in anything but doubles" },
+	{ MODE_KEEP_SPECTRUM, "--keep-spectrum", [](const options& o) { return o.keep_spectrum && o.storage == spectrum_storage::float64; }, 0, nullptr },
+	{ MODE_STARS, "--stars", [](const options& o) { return !o.stars_file.empty(); },
+		MODE_PREVIEW | MODE_FIELD | MODE_WATCH | MODE_CUBE, "it needs the rendered PSF in doubles" },
+	{ MODE_EDGES, "--edges", [](const options& o) { return o.edge_order > 1; }, MODE_FIELD | MODE_WATCH, nullptr },
+	{ MODE_ROI, "--roi / --zoom / --roi-mask", [](const options& o) { return o.has_roi || o.zoom != 1.0 || !o.roi_mask_file.empty(); }, 0, nullptr },
+	{ MODE_GAIN, "--gain", [](const options& o) { return o.gain != 1.0f; }, 0, nullptr },
+	{ MODE_COLOUR_MAPPING, "--colour-mapping", [](const options& o) { return o.colours != colour_space::spectrum; }, 0, nullptr },
+	{ MODE_BIT_DEPTH, "--bit-depth", [](const options& o) { return o.bit_depth != 8; }, 0, nullptr },
+};
+
+// Reports the first option given that does not go with another one given, per MODE_RULES; false if there is one
+bool check_modes(const options& opts)
+{
+	uint32_t given = 0;
+	for (const auto& rule : MODE_RULES)
+	{
+		if (rule.is_set(opts))
+			given |= rule.flag;
+	}
+
+	for (const auto& rule : MODE_RULES)
+	{
+		if ((given & rule.flag) == 0)
+			continue;
+
+		uint32_t conflicts = rule.excludes;
+		for (const auto& other : MODE_RULES)
+		{
+			if (other.excludes & rule.flag)
+				conflicts |= other.flag;
+		}
+		conflicts &= given & ~rule.flag;
+		if (conflicts == 0)
+			continue;
+
+		std::vector<const char*> names;
+		for (const auto& other : MODE_RULES)
+		{
+			if (conflicts & other.flag)
+				names.push_back(other.name);
+		}
+
+		std::cerr << rule.name << " is not supported with ";
+		for (size_t i = 0; i < names.size(); ++i)
+			std::cerr << (i == 0 ? "" : i + 1 < names.size() ? ", " : " or ") << names[i];
+		if (rule.note != nullptr)
+			std::cerr << " (" << rule.note << ")";
+		std::cerr << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool parse_options(int argc, char* argv[], options& opts)
+{
+	std::vector<std::string> positional;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--field" && i + 1 < argc)
+		{
+			opts.field_file = argv[++i];
+		}
+		else if (arg == "--cube" && i + 1 < argc)
+		{
+			opts.cube_file = argv[++i];
+		}
+		else if (arg == "--spectral-cube" && i + 1 < argc)
+		{
+			opts.spectral_cube_file = argv[++i];
+		}
+		else if (arg == "--adaptive" && i + 1 < argc)
+		{
+			opts.adaptive_threshold = static_cast<float>(std::atof(argv[++i]));
+		}
+		else if (arg == "--adaptive-step" && i + 1 < argc)
+		{
+			opts.adaptive_step = std::max(2, std::atoi(argv[++i]));
+		}
+		else if (arg == "--progressive")
+		{
+			opts.progressive = true;
+		}
+		else if (arg == "--snapshot" && i + 1 < argc)
+		{
+			opts.snapshot_file = argv[++i];
+		}
+		else if (arg == "--snapshot-interval" && i + 1 < argc)
+		{
+			opts.snapshot_interval = std::atof(argv[++i]);
+		}
+		else if (arg == "--quality" && i + 1 < argc)
+		{
+			opts.quality = std::atof(argv[++i]);
+		}
+		else if (arg == "--time-budget" && i + 1 < argc)
+		{
+			opts.time_budget = std::max(0.0, std::atof(argv[++i]));
+			opts.progressive = true;
+		}
+		else if (arg == "--checkpoint" && i + 1 < argc)
+		{
+			opts.checkpoint_file = argv[++i];
+		}
+		else if (arg == "--checkpoint-interval" && i + 1 < argc)
+		{
+			opts.checkpoint_interval = std::max(1.0, std::atof(argv[++i]));
+		}
+		else if (arg == "--resume")
+		{
+			opts.resume = true;
+		}
+		else if (arg == "--preview" && i + 1 < argc)
+		{
+			opts.preview_factor = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--preview-samples" && i + 1 < argc)
+		{
+			opts.preview_samples = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--roi" && i + 1 < argc)
+		{
+			if (!parse_list(argv[++i], opts.roi, 4) || opts.roi[2] <= 0.0 || opts.roi[3] <= 0.0)
+			{
+				std::cerr << "--roi expects x,y,w,h" << std::endl;
+				return false;
+			}
+			opts.has_roi = true;
+		}
+		else if (arg == "--zoom" && i + 1 < argc)
+		{
+			opts.zoom = std::atof(argv[++i]);
+			if (opts.zoom <= 0.0)
+			{
+				std::cerr << "--zoom must be positive" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--roi-mask" && i + 1 < argc)
+		{
+			opts.roi_mask_file = argv[++i];
+		}
+		else if (arg == "--gain" && i + 1 < argc)
+		{
+			opts.gain = static_cast<float>(std::atof(argv[++i]));
+			if (opts.gain <= 0.0f)
+			{
+				std::cerr << "--gain must be positive" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--colour-mapping" && i + 1 < argc)
+		{
+			if (!parse_colour_space(argv[++i], opts.colours))
+			{
+				std::cerr << "--colour-mapping is spectrum or cie" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--bit-depth" && i + 1 < argc)
+		{
+			opts.bit_depth = std::atoi(argv[++i]);
+			if (opts.bit_depth != 8 && opts.bit_depth != 16)
+			{
+				std::cerr << "--bit-depth is 8 or 16" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--edges" && i + 1 < argc)
+		{
+			opts.edge_order = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--stars" && i + 1 < argc)
+		{
+			opts.stars_file = argv[++i];
+		}
+		else if (arg == "--stars-out" && i + 1 < argc)
+		{
+			opts.stars_output = argv[++i];
+		}
+		else if (arg == "--scene" && i + 1 < argc)
+		{
+			double size[2];
+			if (!parse_list(argv[++i], size, 2) || size[0] < 1 || size[1] < 1)
+			{
+				std::cerr << "--scene expects w,h" << std::endl;
+				return false;
+			}
+			opts.scene_width = static_cast<int>(size[0]);
+			opts.scene_height = static_cast<int>(size[1]);
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			opts.threads = std::atoi(argv[++i]);
+			if (opts.threads < 1)
+			{
+				std::cerr << "--threads must be positive" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--background")
+		{
+			opts.background = true;
+		}
+		else if (arg == "--keep-spectrum")
+		{
+			opts.keep_spectrum = true;
+		}
+		else if (arg == "--spectrum-storage" && i + 1 < argc)
+		{
+			if (!parse_spectrum_storage(argv[++i], opts.storage))
+			{
+				std::cerr << "--spectrum-storage is double, float, half, bf16 or shared-exp" << std::endl;
+				return false;
+			}
+			opts.keep_spectrum = true;
+		}
+		else if (arg == "--pin" && i + 1 < argc)
+		{
+			std::string mode = argv[++i];
+			if (mode != "cores" && mode != "smt")
+			{
+				std::cerr << "--pin expects cores or smt" << std::endl;
+				return false;
+			}
+			opts.pin = true;
+			opts.pin_smt = mode == "smt";
+		}
+		else if (arg == "--split-k" && i + 1 < argc)
+		{
+			double split[2];
+			if (!parse_list(argv[++i], split, 2) || split[0] < 1 || split[1] < 1)
+			{
+				std::cerr << "--split-k expects chunks,groups" << std::endl;
+				return false;
+			}
+			opts.split_chunks = static_cast<int>(split[0]);
+			opts.split_groups = static_cast<int>(split[1]);
+		}
+		else if (arg == "--shard" && i + 1 < argc)
+		{
+			const char* str = argv[++i];
+			char* end;
+			opts.shard = static_cast<int>(std::strtol(str, &end, 10));
+			if (end == str || *end != '/' || (opts.num_shards = static_cast<int>(std::strtol(end + 1, &end, 10)), *end != '\0')
+				|| opts.num_shards < 1 || opts.shard < 0 || opts.shard >= opts.num_shards)
+			{
+				std::cerr << "--shard expects i/n, 0 <= i < n" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--serve" && i + 1 < argc)
+		{
+			const std::string address = argv[++i];
+			const bool ok = address.find(':') != std::string::npos
+				? net::parse_address(address, opts.serve_host, opts.serve_port)
+				: (opts.serve_port = std::atoi(address.c_str())) > 0 && opts.serve_port < 65536;
+			if (!ok)
+			{
+				std::cerr << "--serve expects a port number or host:port" << std::endl;
+				return false;
+			}
+		}
+		else if (arg == "--tile-timeout" && i + 1 < argc)
+		{
+			opts.tile_timeout = std::max(1.0, std::atof(argv[++i]));
+		}
+		else if (arg == "--worker" && i + 1 < argc)
+		{
+			opts.worker_address = argv[++i];
+		}
+		else if (arg == "--batch" && i + 1 < argc)
+		{
+			opts.batch_file = argv[++i];
+		}
+		else if (arg == "--daemon" && i + 1 < argc)
+		{
+			opts.daemon_socket = argv[++i];
+		}
+		else if (arg == "--cache-memory" && i + 1 < argc)
+		{
+			opts.cache_memory_mb = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+		}
+		else if (arg == "--max-memory" && i + 1 < argc)
+		{
+			const int mb = std::atoi(argv[++i]);
+			if (mb < 1)
+			{
+				std::cerr << "--max-memory must be positive" << std::endl;
+				return false;
+			}
+			opts.max_memory_mb = static_cast<size_t>(mb);
+		}
+		else if (arg == "--watch")
+		{
+			opts.watch = true;
+		}
+		else if (arg.rfind("--", 0) == 0)
+		{
+			std::cerr << "Unknown option " << arg << std::endl;
+			return false;
+		}
+		else
+		{
+			positional.push_back(arg);
+		}
+	}
+
+	if (!check_modes(opts))
+		return false;
+
+	// the requests say what to render
+	if (!opts.daemon_socket.empty())
+	{
+		if (!positional.empty())
+		{
+			std::cerr << "--daemon takes what to render from the requests, not from the arguments" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// the jobs of a batch come from the manifest, the options apply to all of them
+	if (!opts.batch_file.empty())
+	{
+		if (!positional.empty())
+		{
+			std::cerr << "--batch takes the inputs and outputs from the manifest, not from the arguments" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// a worker gets everything else from the coordinator
+	if (!opts.worker_address.empty())
+	{
+		std::string host;
+		int port;
+		if (!positional.empty() || !net::parse_address(opts.worker_address, host, port))
+		{
+			std::cerr << "--worker expects host:port, and nothing but --threads / --pin / --background" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	if (positional.size() < 2)
+		return false;
+
+	opts.input = positional[0];
+	opts.output = positional[1];
+
+	if (opts.snapshot_file.empty())
+		opts.snapshot_file = opts.output;
+
+	if (!opts.stars_file.empty() && opts.stars_output.empty())
+	{
+		std::cerr << "--stars needs --stars-out" << std::endl;
+		return false;
+	}
+
+	// a shard is written out as a checkpoint, which is what makes it resumable as well
+	if (opts.num_shards > 1)
+		opts.checkpoint_file = opts.output;
+
+	if (opts.resume && opts.checkpoint_file.empty())
+	{
+		std::cerr << "--resume needs --checkpoint" << std::endl;
+		return false;
+	}
+
+	if (positional.size() >= 3)
+		opts.R = static_cast<float>(std::atof(positional[2].c_str()));
+	if (positional.size() >= 4)
+		opts.lambda = static_cast<float>(std::atof(positional[3].c_str()));
+	if (positional.size() >= 5)
+		opts.unfocus_factor = static_cast<float>(std::atof(positional[4].c_str()));
+
+	return true;
+}
+
+bool load_input(const std::string& input, std::vector<unsigned char>& data, unsigned& width, unsigned& height)
+{
+	if (lodepng::decode(data, width, height, input) != 0)
+	{
+		std::cerr << "Failed to open " << input << std::endl;
+		return false;
+	}
+	if ((width % 2 != 0) || (height % 2 != 0))
+	{
+		std::cerr << "Image width & high must be an even number (as some optimisations are only possible in that case), please align your image first" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Calls fn(x, y, out, out_mx, out_my, out_mx_my) for each representative pixel of the grid (the top-left quadrant 
+// of the full frame): (x, y) is its point of the sensor plane, followed by the pixels of 'out' for it and its 3 mirrored 
+// counterparts - that is the granularity diff_value() works at. Counterparts that are not part of the grid get a scratch pixel.
+// The pixels are handed out in tiles by the tile_scheduler, the per-thread idle time is reported at the end.
+// Returns false if 'cancel' stopped the run, leaving the pixels of the tiles not started as they were. 
+// 'tile_done' (optional) is called by the thread that rendered a tile, once it is done. 'in_bands_of' (optional) has
+// the tiles taken in bands of that many rows, top to bottom, see tile_scheduler.
+template <typename TRaw, typename TFunc>
+bool for_each_grid_pixel(ThreadGrid& grid, const output_grid& g, TRaw& out, TFunc&& fn, const cancel_token* cancel = nullptr,
+	const std::function<void(const tile&)>& tile_done = nullptr, int in_bands_of = 0)
+{
+	using TPixel = typename TRaw::value_type;
+
+	auto tiles = tile_scheduler::make_tiles(g, grid.NumThreads());
+	const int num_tiles = static_cast<int>(tiles.size());
+
+	std::atomic_int progress = 0;
+
+	report_progress(0, num_tiles);
+
+	const auto start = std::chrono::system_clock::now();
+
+	tile_scheduler scheduler;
+	scheduler.in_bands_of = in_bands_of;
+	const bool complete = scheduler.run(grid, std::move(tiles),
+		[&](int thread_idx, const tile& t)
+		{
+			TPixel scratch[4]{};
+			TPixel* o[4];
+
+			for (int v = t.v0; v < t.v1; v++)
+			{
+				for (int u = t.u0; u < t.u1; u++)
+				{
+					if (!g.wanted(u, v))
+						continue;
+
+					for (int m = 0; m < 4; ++m)
+						o[m] = g.has_image(u, v, m) ? &out[g.image_offs(u, v, m)] : &scratch[m];
+
+					fn(g.x_at(u), g.y_at(v), *o[0], *o[1], *o[2], *o[3]);
+				}
+			}
+
+			if (tile_done)
+				tile_done(t);
+
+			++progress;
+			if (thread_idx == 0)
+				report_progress(progress.load(), num_tiles);
+		}, cancel);
+
+	const auto end = std::chrono::system_clock::now();
+
+	std::cout << std::endl;
+	std::cout << "run duration: " << std::chrono::system_clock::to_time_t(end) - std::chrono::system_clock::to_time_t(start) << " seconds" << std::endl;
+
+	scheduler.report(std::cout);
+
+	if (!complete)
+		std::cout << "stopped, " << scheduler.num_skipped() << " of " << num_tiles << " tiles not rendered" << std::endl;
+
+	return complete;
+}
+
+std::vector<float> lambdas_of(const apr& ap)
+{
+	std::vector<float> lambdas;
+	for (const auto& profile : ap.lambda_profiles)
+		lambdas.push_back(profile.lambda);
+	return lambdas;
+}
+
+// The sensor plane grid to render: the full frame unless --roi / --zoom / --roi-mask say otherwise
+bool make_output_grid(const options& opts, unsigned width, unsigned height, output_grid& g)
+{
+	if (opts.has_roi)
+		g = output_grid::roi(width, height, opts.roi[0], opts.roi[1], opts.roi[2], opts.roi[3], opts.zoom);
+	else
+		g = output_grid::roi(width, height, 0.0, 0.0, width, height, opts.zoom);
+
+	if (opts.roi_mask_file.empty())
+		return true;
+
+	std::vector<unsigned char> mask_data;
+	unsigned mask_width;
+	unsigned mask_height;
+
+	if (lodepng::decode(mask_data, mask_width, mask_height, opts.roi_mask_file) != 0)
+	{
+		std::cerr << "Failed to open " << opts.roi_mask_file << std::endl;
+		return false;
+	}
+	if (static_cast<int>(mask_width) != g.width || static_cast<int>(mask_height) != g.height)
+	{
+		std::cerr << "The ROI mask must be of the output size, " << g.width << "x" << g.height << std::endl;
+		return false;
+	}
+
+	g.mask.resize(g.num_pixels());
+	for (size_t i = 0; i < g.mask.size(); ++i)
+		g.mask[i] = (mask_data[4 * i] | mask_data[4 * i + 1] | mask_data[4 * i + 2]) != 0;
+
+	return true;
+}
+
+// The colour mapping of the renders of 'ap', see --colour-mapping; 'gain' brightens the image by that much over
+// the usual exposure, see --gain
+colour_matrix output_colours(const apr& ap, const options& opts, float gain)
+{
+	return colour_matrix{ opts.colours, lambdas_of(ap), exposure_max(ap.total_light_per_pixel) / gain };
+}
+
+// The colour mapping is split over the threads of 'grid', if there is one (not from a task of its own)
+bool encode_png(const colour_matrix& colours, int bit_depth, const apr::raw& out_raw, unsigned width, unsigned height,
+	std::vector<unsigned char>& png, ThreadGrid* grid = nullptr)
+{
+	const size_t num_pixels = static_cast<size_t>(width) * height;
+
+	std::vector<unsigned char> out;
+	if (grid != nullptr)
+	{
+		out = colours.map(*grid, out_raw.data()->data(), num_pixels, bit_depth, 3);
+	}
+	else
+	{
+		out.resize(num_pixels * 3 * bit_depth / 8);
+		colours.map(out_raw.data()->data(), num_pixels, bit_depth, 3, out.data());
+	}
+
+	return lodepng::encode(png, out, width, height, LCT_RGB, bit_depth) == 0;
+}
+
+bool write_png(const std::string& output, const apr& ap, const apr::raw& out_raw, unsigned width, unsigned height, const options& opts,
+	ThreadGrid* grid = nullptr)
+{
+	std::vector<unsigned char> png;
+	if (!encode_png(output_colours(ap, opts, opts.gain), opts.bit_depth, out_raw, width, height, png, grid)
+		|| lodepng::save_file(png, output) != 0)
+	{
+		std::cerr << "Failed to write " << output << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Brings out_field up to date with ap.intensity_mask. If 'incremental' is set, out_field / field_mask hold the 
+// field of a previous render with the same parameters, and only the pixels that changed since are summed over - 
+// unless there are so many of them that a full render is cheaper. 
+void update_field(ThreadGrid& grid, apr& ap, apr::field& out_field, std::vector<double>& field_mask, bool incremental)
+{
+	const int width = ap.width;
+	const int height = ap.height;
+
+	if (incremental)
+	{
+		auto changes = ap.mask_changes(field_mask);
+
+		// diff_field() visits this many aperture pixels per quadrant pixel, diff_field_delta() - 4 per change
+		size_t full_cost = static_cast<size_t>(width - 2 * ap.ap_skip_x) * (height - 2 * ap.ap_skip_y);
+
+		if (changes.empty())
+		{
+			std::cout << "Aperture unchanged, reusing the stored field" << std::endl;
+			return;
+		}
+
+		if (4 * changes.size() < full_cost)
+		{
+			std::cout << "Incremental re-render of " << changes.size() << " changed aperture pixels" << std::endl;
+
+			for_each_grid_pixel(grid, output_grid::full(width, height), out_field,
+				[&](double x, double y, auto& o, auto& o_mx, auto& o_my, auto& o_mx_my)
+				{
+					ap.diff_field_delta(x, y, changes, o, o_mx, o_my, o_mx_my);
+				});
+
+			field_mask = ap.intensity_mask;
+			return;
+		}
+
+		std::cout << changes.size() << " aperture pixels changed, doing a full render instead" << std::endl;
+	}
+
+	out_field.resize(static_cast<size_t>(width) * height);
+
+	for_each_grid_pixel(grid, output_grid::full(width, height), out_field,
+		[&](double x, double y, auto& o, auto& o_mx, auto& o_my, auto& o_mx_my)
+		{
+			ap.diff_field(x, y, o, o_mx, o_my, o_mx_my);
+		});
+
+	field_mask = ap.intensity_mask;
+}
+
+bool write_field_png(ThreadGrid& grid, const std::string& output, const apr& ap, const apr::field& out_field, const options& opts)
+{
+	apr::raw out_raw(out_field.size());
+
+	grid.GridRun(
+		[&](int thread_idx, int num_threads)
+		{
+			for (size_t i = thread_idx; i < out_field.size(); i += num_threads)
+				apr::intensity(out_field[i], out_raw[i]);
+		});
+
+	return write_png(output, ap, out_raw, ap.width, ap.height, opts, &grid);
+}
+
+// --stars: the render is the PSF, the stars are convolved with it
+int render_stars(ThreadGrid& grid, const options& opts, const apr& ap, const apr::raw& psf)
+{
+	std::vector<star> stars;
+	unsigned width = opts.scene_width > 0 ? opts.scene_width : ap.width;
+	unsigned height = opts.scene_height > 0 ? opts.scene_height : ap.height;
+
+	const bool is_image = std::filesystem::path(opts.stars_file).extension() == ".png";
+
+	if (is_image ? !read_star_image(opts.stars_file, stars, width, height) : !read_star_list(opts.stars_file, lambdas_of(ap), stars))
+		return -1;
+
+	const auto start = std::chrono::system_clock::now();
+
+	const auto colours = output_colours(ap, opts, opts.gain);
+	auto rgb = render_star_field(grid, psf.data()->data(), NUM_COLORS, ap.width, ap.height, colours, stars, width, height);
+
+	const auto end = std::chrono::system_clock::now();
+	std::cout << "star field duration: " << std::chrono::system_clock::to_time_t(end) - std::chrono::system_clock::to_time_t(start) << " seconds" << std::endl;
+
+	return write_star_field(grid, opts.stars_output, colours, opts.bit_depth, rgb, width, height) ? 0 : -1;
+}
+
+// --preview mode: the aperture is downsampled, so is the output, and a few pixels are rendered at the full 
+// resolution to tell how far off the preview is 
+int render_preview(ThreadGrid& grid, const options& opts, apr& ap, const std::vector<unsigned char>& data)
+{
+	const int factor = opts.preview_factor;
+	auto g = make_preview_geometry(ap.width, ap.height, factor);
+
+	apr preview_ap{
+		downsample_mask(apr::threshold_mask(data, ap.width, ap.height), ap.width, ap.height, g),
+		g.width,
+		g.height,
+		opts.R / factor,
+		opts.lambda / factor,
+		CLR_STEP,
+		opts.unfocus_factor / factor
+	};
+
+	std::cout << "Preview: aperture downsampled by " << factor << " to " << g.width << "x" << g.height
+		<< ", R: " << preview_ap.R << ", lambda mid: " << preview_ap.lambda << std::endl;
+
+	apr::raw preview_raw(static_cast<size_t>(g.width) * g.height);
+	first_touch(grid, output_grid::full(g.width, g.height), preview_raw);
+
+	for_each_grid_pixel(grid, output_grid::full(g.width, g.height), preview_raw,
+		[&](double x, double y, auto& o, auto& o_mx, auto& o_my, auto& o_mx_my)
+		{
+			preview_ap.diff_value(x, y, o, o_mx, o_my, o_mx_my);
+		});
+
+	if (!write_png(opts.output, preview_ap, preview_raw, g.width, g.height, opts, &grid))
+		return -1;
+
+	std::cout << "Estimating the error from " << opts.preview_samples << " full resolution pixels..." << std::endl;
+
+	const auto start = std::chrono::system_clock::now();
+
+	auto err = estimate_preview_error(grid, ap, preview_raw, g, opts.preview_samples, exposure_max(ap.total_light_per_pixel));
+
+	const auto end = std::chrono::system_clock::now();
+
+	std::cout << "preview error vs full resolution, over " << err.num_samples << " pixels: max " << err.max_error
+		<< ", rms " << err.rms_error << " (8-bit output levels, per wavelength)" << std::endl;
+	std::cout << "error estimate duration: " << std::chrono::system_clock::to_time_t(end) - std::chrono::system_clock::to_time_t(start) << " seconds" << std::endl;
+
+	return 0;
+}
+
+// --field / --watch mode: the complex field is kept (in memory and optionally in a file), so that edits 
+// of the aperture only cost as much as the number of changed pixels 
+int render_incremental(ThreadGrid& grid, const options& opts, apr& ap)
+{
+	apr::field out_field;
+	std::vector<double> field_mask;
+	bool have_field = false;
+
+	if (!opts.field_file.empty() && std::filesystem::exists(opts.field_file))
+	{
+		field_cube_header hdr;
+		std::vector<float> lambdas;
+
+		if (read_field_cube(opts.field_file, hdr, lambdas, out_field, &field_mask)
+			&& field_cube_compatible(hdr, make_field_cube_header(ap, true))
+			&& !field_mask.empty())
+		{
+			std::cout << "Loaded the stored field from " << opts.field_file << std::endl;
+			have_field = true;
+		}
+		else
+		{
+			std::cout << opts.field_file << " does not match the current parameters, ignoring it" << std::endl;
+		}
+	}
+
+	auto render_and_save = [&]() -> bool
+	{
+		update_field(grid, ap, out_field, field_mask, have_field);
+		have_field = true;
+
+		if (!opts.field_file.empty()
+			&& !write_field_cube(opts.field_file, make_field_cube_header(ap, true), lambdas_of(ap), out_field, &field_mask))
+		{
+			return false;
+		}
+
+		if (!opts.cube_file.empty()
+			&& !write_field_cube(opts.cube_file, make_field_cube_header(ap, false), lambdas_of(ap), out_field, nullptr))
+		{
+			return false;
+		}
+
+		return write_field_png(grid, opts.output, ap, out_field, opts);
+	};
+
+	if (!render_and_save())
+		return -1;
+
+	if (!opts.watch)
+		return 0;
+
+	std::cout << "Watching " << opts.input << " for changes, press Ctrl-C to stop" << std::endl;
+
+	std::error_code ec;
+	auto last_write = std::filesystem::last_write_time(opts.input, ec);
+
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_INTERVAL_MS));
+
+		auto write_time = std::filesystem::last_write_time(opts.input, ec);
+		if (ec || write_time == last_write)
+			continue;
+
+		std::vector<unsigned char> data;
+		unsigned width;
+		unsigned height;
+
+		// the editor might still be writing the file - just try again on the next poll
+		if (!load_input(opts.input, data, width, height))
+			continue;
+
+		last_write = write_time;
+
+		std::cout << opts.input << " changed, re-rendering" << std::endl;
+
+		if (static_cast<int>(width) != ap.width || static_cast<int>(height) != ap.height)
+			have_field = false;
+
+		ap = apr{ data, static_cast<int>(width), static_cast<int>(height), opts.R, opts.lambda, CLR_STEP, opts.unfocus_factor };
+
+		if (!render_and_save())
+			return -1;
+	}
+}
+
+// --worker: renders the tiles the coordinator hands out until it has no more
+int run_worker(ThreadGrid& grid, const options& opts)
+{
+	std::string host;
+	int port = 0;
+	if (!net::parse_address(opts.worker_address, host, port))
+	{
+		std::cerr << "--worker expects host:port" << std::endl;
+		return -1;
+	}
+
+	// the coordinator may not be up yet
+	net::connection c;
+	for (int attempt = 0; attempt < WORKER_CONNECT_ATTEMPTS && !c.is_open(); ++attempt)
+	{
+		if (attempt > 0)
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		c = net::connect_to(host, port);
+	}
+	if (!c.is_open())
+	{
+		std::cerr << "Failed to connect to " << opts.worker_address << std::endl;
+		return -1;
+	}
+
+	std::vector<char> payload;
+	const uint32_t version = PROTOCOL_VERSION;
+	const int32_t threads = grid.NumThreads();
+	append(payload, &version, sizeof(version));
+	append(payload, &threads, sizeof(threads));
+
+	message type;
+	render_job job;
+	if (!send_message(c, message::hello, payload) || !recv_message(c, type, payload) || type != message::job || !job.decode(payload))
+	{
+		std::cerr << opts.worker_address << " did not send a job" << std::endl;
+		return -1;
+	}
+
+	const auto& hdr = job.hdr;
+
+	apr ap{
+		job.input,
+		hdr.input_width,
+		hdr.input_height,
+		hdr.R,
+		hdr.lambda,
+		CLR_STEP,
+		hdr.unfocus_factor,
+		hdr.edge_order
+	};
+
+	output_grid g = checkpoint_grid(hdr);
+	g.mask = job.mask;
+
+	// a build with other colours, or other constants, would not render the same thing
+	auto mine = make_checkpoint_header(ap, job.input, g, hdr.shard, hdr.num_shards);
+	mine.mask_hash = hdr.mask_hash;
+	mine.num_wanted = hdr.num_wanted;
+	if (const char* what = checkpoint_mismatch(mine, hdr))
+	{
+		std::cerr << "This build differs from the coordinator's in " << what << std::endl;
+		return -1;
+	}
+
+	std::cout << "Rendering for " << opts.worker_address << ": " << hdr.input_width << "x" << hdr.input_height << " aperture, R "
+		<< hdr.R << ", lambda " << hdr.lambda << ", " << g.width << "x" << g.height << " output" << std::endl;
+
+	std::unique_ptr<node_replicas<apr>> replicas;
+	if (grid.NumNodes() > 1)
+		replicas = std::make_unique<node_replicas<apr>>(grid, ap);
+
+	std::mutex send_lock;
+	size_t num_tiles = 0;
+
+	for (;;)
+	{
+		const int32_t max_tiles = grid.NumThreads();
+		if (!send_message(c, message::request, &max_tiles, sizeof(max_tiles)) || !recv_message(c, type, payload))
+		{
+			std::cerr << "Lost the connection to " << opts.worker_address << std::endl;
+			return -1;
+		}
+
+		if (type == message::done)
+			break;
+
+		if (type == message::wait)
+		{
+			uint32_t ms = 500;
+			payload_reader(payload).read(ms);
+			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+			continue;
+		}
+
+		if (type != message::tiles)
+		{
+			std::cerr << opts.worker_address << " sent an unexpected message" << std::endl;
+			return -1;
+		}
+
+		std::vector<tile> tiles;
+		payload_reader r(payload);
+		for (int32_t rect[4]; r.read(rect); )
+		{
+			tile t{ std::max(0, rect[0]), std::max(0, rect[1]), std::min(g.rep_width, rect[2]), std::min(g.rep_height, rect[3]), 0 };
+			for (int v = t.v0; v < t.v1; ++v)
+			{
+				for (int u = t.u0; u < t.u1; ++u)
+				{
+					if (g.wanted(u, v))
+						++t.cost;
+				}
+			}
+			tiles.push_back(t);
+		}
+
+		std::atomic_bool sent{ true };
+		num_tiles += tiles.size();
+
+		tile_scheduler scheduler;
+		scheduler.run(grid, std::move(tiles),
+			[&](int, const tile& t)
+			{
+				std::vector<apr::pixel> pixels;
+				pixels.reserve(4 * t.cost);
+
+				for (int v = t.v0; v < t.v1; ++v)
+				{
+					for (int u = t.u0; u < t.u1; ++u)
+					{
+						if (!g.wanted(u, v))
+							continue;
+
+						pixels.resize(pixels.size() + 4);
+						apr::pixel* o = &pixels[pixels.size() - 4];
+						(replicas ? replicas->local() : ap).diff_value(g.x_at(u), g.y_at(v), o[0], o[1], o[2], o[3]);
+					}
+				}
+
+				const auto result = encode_tile_result(g, t, pixels);
+
+				std::lock_guard<std::mutex> l(send_lock);
+				if (!send_message(c, message::result, result))
+					sent = false;
+			});
+
+		if (!sent)
+		{
+			std::cerr << "Lost the connection to " << opts.worker_address << std::endl;
+			return -1;
+		}
+	}
+
+	std::cout << "The render is done, " << num_tiles << " tiles of it were rendered here" << std::endl;
+	return 0;
+}
+
+// --batch: renders the jobs of the manifest in one go. The jobs are taken in waves of up to BATCH_WAVE_BYTES of output,
+// and the tiles of all the jobs of a wave are scheduled together, so that the small ones keep all the cores busy too
+// (and the tail of one job is filled with the tiles of the others). A job's output is written by the thread that
+// renders its last tile, while the rest go on.
+int run_batch(ThreadGrid& grid, const options& opts)
+{
+	std::vector<batch_job> jobs;
+	if (!read_manifest(opts.batch_file, batch_job{ "", "", opts.R, opts.lambda, opts.unfocus_factor, 0, 0 }, jobs))
+		return -1;
+
+	aperture_cache<apr> cache{ opts.edge_order };
+	size_t num_failed = 0;
+
+	// everything that can fail before rendering: the inputs, the number of colours, the output grids
+	struct prepared_job
+	{
+		const batch_job* job;
+		std::shared_ptr<aperture_cache<apr>::image> input;
+		output_grid g;
+	};
+	std::vector<prepared_job> ready;
+
+	for (const auto& job : jobs)
+	{
+		auto skip = [&](const std::string& why)
+		{
+			std::cerr << opts.batch_file << ":" << job.line << ": " << why << ", skipped" << std::endl;
+			++num_failed;
+		};
+
+		if (job.colours != 0 && job.colours != NUM_COLORS)
+		{
+			skip("this build renders " + std::to_string(NUM_COLORS) + " colours (see NUM_COLORS), not " + std::to_string(job.colours));
+			continue;
+		}
+
+		auto input = cache.load(job.input);
+		if (!input)
+		{
+			skip("failed to open " + job.input);
+			continue;
+		}
+		if (input->width % 2 != 0 || input->height % 2 != 0)
+		{
+			skip("the width & height of " + job.input + " must be even numbers");
+			continue;
+		}
+
+		output_grid g;
+		if (!make_output_grid(opts, input->width, input->height, g))
+		{
+			skip("no output grid");
+			continue;
+		}
+
+		cache.reserve(*input, job.R, job.lambda, job.unfocus_factor);
+		ready.push_back(prepared_job{ &job, input, std::move(g) });
+	}
+
+	install_interrupt_handlers();
+	auto& cancel = interrupt_token();
+
+	const auto batch_start = std::chrono::steady_clock::now();
+	size_t num_done = 0;
+
+	for (size_t first = 0; first < ready.size() && !cancel.is_cancelled(); )
+	{
+		size_t last = first;
+		for (size_t bytes = 0; last < ready.size(); ++last)
+		{
+			bytes += ready[last].g.num_pixels() * sizeof(apr::pixel);
+			if (last > first && bytes > BATCH_WAVE_BYTES)
+				break;
+		}
+
+		struct running_job
+		{
+			std::shared_ptr<apr> ap;
+			apr::raw out;
+			std::atomic_size_t tiles_left{ 0 };
+			bool written{ false };
+		};
+		std::vector<std::unique_ptr<running_job>> wave;
+		std::vector<tile> tiles;
+
+		for (size_t k = first; k < last; ++k)
+		{
+			const auto& r = ready[k];
+			auto w = std::make_unique<running_job>();
+
+			w->ap = cache.take(*r.input, r.job->R, r.job->lambda, r.job->unfocus_factor,
+				[](const std::vector<unsigned char>& data, int width, int height, float R, float lambda, float unfocus_factor, int edge_order)
+				{
+					return new apr{ data, width, height, R, lambda, CLR_STEP, unfocus_factor, edge_order };
+				});
+
+			w->out.resize(r.g.num_pixels());
+			first_touch(grid, r.g, w->out);
+
+			// the cost of a pixel is about the open part of the aperture it sums over, which differs from job to job
+			const size_t pixel_cost = static_cast<size_t>(w->ap->width - 2 * w->ap->ap_skip_x) * (w->ap->height - 2 * w->ap->ap_skip_y);
+
+			for (auto t : tile_scheduler::make_tiles(r.g, grid.NumThreads()))
+			{
+				t.cost *= pixel_cost;
+				t.job = static_cast<int>(k - first);
+				tiles.push_back(t);
+				++w->tiles_left;
+			}
+
+			wave.push_back(std::move(w));
+		}
+
+		std::cout << "rendering jobs " << first + 1 << "-" << last << " of " << ready.size() << std::endl;
+
+		const int num_tiles = static_cast<int>(tiles.size());
+		std::atomic_int progress = 0;
+		std::mutex console;
+
+		report_progress(0, num_tiles);
+
+		tile_scheduler scheduler;
+		scheduler.run(grid, std::move(tiles),
+			[&](int thread_idx, const tile& t)
+			{
+				const auto& r = ready[first + t.job];
+				auto& w = *wave[t.job];
+
+				for (int v = t.v0; v < t.v1; ++v)
+				{
+					for (int u = t.u0; u < t.u1; ++u)
+					{
+						if (r.g.wanted(u, v))
+							render_grid_pixel(*w.ap, r.g, w.out, u, v);
+					}
+				}
+
+				if (--w.tiles_left == 0)
+				{
+					w.written = write_png(r.job->output, *w.ap, w.out, r.g.width, r.g.height, opts);
+
+					const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+					std::lock_guard<std::mutex> l(console);
+					std::cout << std::endl << r.job->output << (w.written ? " written" : " failed") << " (" << seconds << " s)" << std::endl;
+
+					// the memory goes to the jobs of the next wave
+					w.out = apr::raw{};
+					w.ap.reset();
+				}
+
+				++progress;
+				if (thread_idx == 0)
+					report_progress(progress.load(), num_tiles);
+			}, &cancel);
+
+		std::cout << std::endl;
+		scheduler.report(std::cout);
+
+		for (auto& w : wave)
+		{
+			if (w->written)
+				++num_done;
+			else if (w->tiles_left == 0)
+				++num_failed;
+		}
+
+		first = last;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+
+	std::cout << "batch: " << num_done << " of " << jobs.size() << " jobs rendered in " << seconds << " s; "
+		<< cache.decoded << " inputs decoded (" << cache.decode_hits << " reused), "
+		<< cache.built << " apertures built (" << cache.build_hits << " reused)" << std::endl;
+
+	if (cancel.is_cancelled())
+	{
+		std::cerr << "interrupted, " << jobs.size() - num_done - num_failed << " jobs not rendered" << std::endl;
+		return -1;
+	}
+
+	return num_failed == 0 ? 0 : -1;
+}
+
+// --daemon: renders what the requests on the local socket ask for, keeping the apertures and the tiles in memory
+int run_daemon(ThreadGrid& grid, const options& opts)
+{
+	daemon_request defaults;
+	defaults.R = opts.R;
+	defaults.lambda = opts.lambda;
+	defaults.unfocus_factor = opts.unfocus_factor;
+
+	render_daemon<apr> daemon{ grid, defaults, opts.cache_memory_mb << 20 };
+
+	daemon.make_aperture = [&](const std::vector<unsigned char>& rgba, int width, int height, float R, float lambda, float unfocus_factor)
+	{
+		return new apr{ rgba, width, height, R, lambda, CLR_STEP, unfocus_factor, opts.edge_order };
+	};
+	daemon.encode_png = [&](const apr& ap, const apr::raw& out, int width, int height, float gain, std::vector<unsigned char>& png)
+	{
+		return encode_png(output_colours(ap, opts, gain), opts.bit_depth, out, width, height, png, &grid);
+	};
+
+	install_interrupt_handlers();
+
+	return daemon.serve(opts.daemon_socket, &interrupt_token()) ? 0 : -1;
+}
+
+// Drops the rows [y0, y1) of 'out' from memory if it is mapped from a file, see mapped_output.h
+template <typename TRaw>
+void evict_rows(const TRaw& out, const output_grid& g, int y0, int y1)
+{
+	mapped_output::evict(&out[static_cast<size_t>(y0) * g.width], static_cast<size_t>(y1 - y0) * g.width * sizeof(out[0]));
+}
+
+// What the plain render keeps of a pixel: by default the RGB its spectrum reduces to (see colour_matrix::reduce()),
+// 3 floats instead of NUM_COLORS doubles
+struct rgb_codec
+{
+	using pixel = std::array<float, 3>;
+	static constexpr bool keeps_spectrum = false;
+
+	const colour_matrix& colours;
+
+	void store(const apr::pixel& spectrum, pixel& p) const
+	{
+		colours.reduce(spectrum.data(), p.data());
+	}
+
+	void encode(const pixel* p, size_t num_pixels, int bit_depth, unsigned char* out) const
+	{
+		colours.encode(p->data(), num_pixels, bit_depth, 3, out);
+	}
+};
+
+// ... or with --spectrum-storage the spectrum itself, in one of the formats of spectrum_storage.h: normalised by
+// the full brightness of the output as it is stored, unpacked to doubles again for the colour mapping
+template <typename TPixel>
+struct spectrum_codec
+{
+	using pixel = TPixel;
+	static constexpr bool keeps_spectrum = true;
+
+	const colour_matrix& colours;
+	double scale;
+
+	void store(const apr::pixel& spectrum, pixel& p) const
+	{
+		apr::pixel normalised;
+		for (size_t i = 0; i < normalised.size(); ++i)
+			normalised[i] = spectrum[i] / scale;
+		p.pack(normalised.data());
+	}
+
+	// the raw intensities again
+	void unpack(const pixel* p, size_t num_pixels, apr::pixel* spectra) const
+	{
+		for (size_t i = 0; i < num_pixels; ++i)
+		{
+			p[i].unpack(spectra[i].data());
+			for (auto& v : spectra[i])
+				v *= scale;
+		}
+	}
+
+	void encode(const pixel* p, size_t num_pixels, int bit_depth, unsigned char* out) const
+	{
+		constexpr size_t CHUNK = 256;	// pixels unpacked at a time
+		std::array<apr::pixel, CHUNK> spectra;
+
+		for (size_t i = 0; i < num_pixels; i += CHUNK)
+		{
+			const size_t n = std::min(CHUNK, num_pixels - i);
+			unpack(p + i, n, spectra.data());
+			colours.map(spectra[0].data(), n, bit_depth, 3, out + i * 3 * bit_depth / 8);
+		}
+	}
+};
+
+// The spectral cube of the render (--spectral-cube), started for writing
+bool open_spectral_cube(spectral_cube_writer& cube, const options& opts, const apr& ap, const output_grid& og)
+{
+	return cube.open(opts.spectral_cube_file, make_spectral_cube_header(ap, og, exposure_max(ap.total_light_per_pixel), opts.gain,
+		opts.colours, opts.bit_depth), lambdas_of(ap));
+}
+
+// The plain render, with what 'codec' keeps of every pixel as diff_value() returns it (the sums themselves are
+// in double all along). Whatever needs the spectrum of the pixels in doubles (checkpoints, shards, --stars, ...)
+// renders into apr::raw instead. The --spectral-cube is written band by band with the PNG.
+template <typename TCodec>
+int render_plain(ThreadGrid& grid, const options& opts, apr& ap, const output_grid& og, const std::string& output, const TCodec& codec)
+{
+	using pixel = typename TCodec::pixel;
+	std::vector<pixel, default_init_allocator<pixel>> out(og.num_pixels());
+	first_touch(grid, og, out);
+
+	std::cout << "Output buffer: " << og.num_pixels() * sizeof(pixel) / 1048576.0 << " MB ("
+		<< og.num_pixels() * sizeof(apr::pixel) / 1048576.0 << " MB with the spectrum in doubles)" << std::endl;
+
+	install_interrupt_handlers();
+	auto& cancel = interrupt_token();
+
+	std::unique_ptr<node_replicas<apr>> replicas;
+	if (grid.NumNodes() > 1)
+		replicas = std::make_unique<node_replicas<apr>>(grid, ap);
+
+	const int bit_depth = opts.bit_depth;
+
+	std::unique_ptr<spectral_cube_writer> cube;
+	if (!opts.spectral_cube_file.empty())
+	{
+		cube = std::make_unique<spectral_cube_writer>();
+		if (!open_spectral_cube(*cube, opts, ap, og))
+			return -1;
+	}
+
+	png_band_writer png;
+	png.rows_encoded = [&](int y0, int y1) { evict_rows(out, og, y0, y1); };
+	if (!png.open(output, og, bit_depth,
+		[&](int y0, int y1)
+		{
+			const size_t num_pixels = static_cast<size_t>(y1 - y0) * og.width;
+			const pixel* p = &out[static_cast<size_t>(y0) * og.width];
+			std::vector<unsigned char> rgb(num_pixels * 3 * bit_depth / 8);
+
+			if constexpr (TCodec::keeps_spectrum)
+			{
+				// the band in doubles once, for both
+				if (cube)
+				{
+					std::vector<apr::pixel> spectra(num_pixels);
+					codec.unpack(p, num_pixels, spectra.data());
+					cube->write_rows(y0, y1, spectra.data()->data());
+					codec.colours.map(spectra.data()->data(), num_pixels, bit_depth, 3, rgb.data());
+					return rgb;
+				}
+			}
+
+			codec.encode(p, num_pixels, bit_depth, rgb.data());
+			return rgb;
+		}))
+	{
+		return -1;
+	}
+
+	for_each_grid_pixel(grid, og, out,
+		[&](double x, double y, auto& o, auto& o_mx, auto& o_my, auto& o_mx_my)
+		{
+			apr::pixel spectrum[4];
+			(replicas ? replicas->local() : ap).diff_value(x, y, spectrum[0], spectrum[1], spectrum[2], spectrum[3]);
+
+			codec.store(spectrum[0], o);
+			codec.store(spectrum[1], o_mx);
+			codec.store(spectrum[2], o_my);
+			codec.store(spectrum[3], o_mx_my);
+		}, &cancel, [&](const tile& t) { png.tile_done(t); }, 16);
+
+	if (!png.finish() || (cube && !cube->finish()))
+		return -1;
+
+	if (cancel.is_cancelled())
+	{
+		std::cerr << "interrupted, " << output << " has what was rendered so far" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+// render_plain() with the spectrum kept as --spectrum-storage says, in floats at least for a --spectral-cube
+int render_plain(ThreadGrid& grid, const options& opts, apr& ap, const output_grid& og, const std::string& output)
+{
+	const auto colours = output_colours(ap, opts, opts.gain);
+	const double scale = exposure_max(ap.total_light_per_pixel) / opts.gain;
+
+	const bool float_cube = !opts.spectral_cube_file.empty() && opts.storage == spectrum_storage::float64;
+	switch (float_cube ? spectrum_storage::float32 : opts.storage)
+	{
+	case spectrum_storage::float32:
+		return render_plain(grid, opts, ap, og, output, spectrum_codec<float32_pixel<NUM_COLORS>>{ colours, scale });
+	case spectrum_storage::float16:
+		return render_plain(grid, opts, ap, og, output, spectrum_codec<float16_pixel<NUM_COLORS>>{ colours, scale });
+	case spectrum_storage::bfloat16:
+		return render_plain(grid, opts, ap, og, output, spectrum_codec<bfloat16_pixel<NUM_COLORS>>{ colours, scale });
+	case spectrum_storage::shared_exponent:
+		return render_plain(grid, opts, ap, og, output, spectrum_codec<shared_exponent_pixel<NUM_COLORS>>{ colours, scale });
+	default:
+		return render_plain(grid, opts, ap, og, output, rgb_codec{ colours });
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 	_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
+	// the processors of our affinity mask, capped by the CPU quota of the container / job object
+	double cpu_quota = 0.0;
 #ifdef _DEBUG
 	int numWorkerThreads = 1;
 #else 
-	SYSTEM_INFO sysinfo;
-	::GetSystemInfo(&sysinfo);
-	int numWorkerThreads = sysinfo.dwNumberOfProcessors;
+	int numWorkerThreads = platform::available_cpus(&cpu_quota);
 #endif
 
-	if (argc < 3)
+	options opts;
+
+	if (!parse_options(argc, argv, opts))
 	{
 		std::cerr << "Wrong usage, try:" << std::endl;
-		std::cerr << "aperture_renderer <input.png> <output.png> [<R>] [<lambda>] [<unfocus_factor>]" << std::endl;
+		std::cerr << "aperture_renderer [options] <input.png> <output.png> [<R>] [<lambda>] [<unfocus_factor>]" << std::endl;
 		std::cerr << "default values are: R = " << DEFAULT_R << " (px), lambda = " << DEFAULT_LAMBDA << std::endl;
 		std::cerr << "Unfocus factor is the distance where to put the virtual sensor in relationship to the ideal focal distance" 
 			<< " - negative values - closer, positive - further, unit is the same as lambda - px" << std::endl;
@@ -64,34 +1566,151 @@ int main(int argc, char* argv[])
 		std::cerr << "The resulting spectrum will be visualized as a visible light by mapping to visible light spectrum" << std::endl;
 		std::cerr << "The distance units used a completely arbitrary, they are in pixes of the orignal image," 
 			<< " and thus wavelengths are defined in the same units" << std::endl;
+		std::cerr << "Options:" << std::endl;
+		std::cerr << "  --field <file.cube>  keep the complex field in the given file; if it exists and was rendered with" << std::endl;
+		std::cerr << "                       the same parameters, only the aperture pixels changed since are re-rendered" << std::endl;
+		std::cerr << "                       (note: the field takes " << 2 * sizeof(double) * NUM_COLORS << " bytes per pixel)" << std::endl;
+		std::cerr << "  --preview <factor>   quick look: render the aperture downsampled by <factor> (R, lambda and the unfocus" << std::endl;
+		std::cerr << "                       factor scaled to match) - factor^4 cheaper, the output is 1/factor of the size;" << std::endl;
+		std::cerr << "                       the error is estimated from --preview-samples full resolution pixels, default " << DEFAULT_PREVIEW_SAMPLES << std::endl;
+		std::cerr << "  --watch              keep running and re-render (incrementally) whenever the input changes" << std::endl;
+		std::cerr << "  --cube <file.cube>   also write the complex field (a, b per wavelength) of the render, see aperture_tools" << std::endl;
+		std::cerr << "  --spectral-cube <file.scube>" << std::endl;
+		std::cerr << "                       also write the intensity of every wavelength of the render (as floats, a plane per" << std::endl;
+		std::cerr << "                       wavelength), to re-grade it with 'aperture_tools tonemap' instead of rendering again" << std::endl;
+		std::cerr << "  --adaptive <err>     evaluate the output on a coarse lattice, refining only where the bilinear interpolation" << std::endl;
+		std::cerr << "                       is off by more than <err> levels of the 8-bit output (any wavelength), e.g. 0.5" << std::endl;
+		std::cerr << "  --adaptive-step <n>  initial lattice step of --adaptive, default " << DEFAULT_ADAPTIVE_STEP << std::endl;
+		std::cerr << "  --progressive        render coarse-to-fine, writing a snapshot (missing pixels filled from the coarser" << std::endl;
+		std::cerr << "                       levels) every --snapshot-interval seconds, default " << DEFAULT_SNAPSHOT_INTERVAL << std::endl;
+		std::cerr << "  --snapshot <f.png>   where --progressive writes its snapshots, default - the output file" << std::endl;
+		std::cerr << "  --quality <err>      with --progressive: stop once a level changes the image by less than <err> output" << std::endl;
+		std::cerr << "                       levels (rms), and fill in the rest from the coarser levels" << std::endl;
+		std::cerr << "  --time-budget <s>    render coarse-to-fine (as --progressive) for <s> seconds at most, then fill in the" << std::endl;
+		std::cerr << "                       rest from the coarser levels (the coarsest one is always rendered in full)" << std::endl;
+		std::cerr << "  --checkpoint <file>  append the finished tiles to <file> every --checkpoint-interval seconds (default" << std::endl;
+		std::cerr << "                       " << DEFAULT_CHECKPOINT_INTERVAL << "), and when the render stops (Ctrl-C, SIGTERM)" << std::endl;
+		std::cerr << "  --resume             continue from the --checkpoint, if it exists; it must be of the same input image," << std::endl;
+		std::cerr << "                       parameters and output grid" << std::endl;
+		std::cerr << "  --shard <i/n>        render only the i-th of n cost-balanced parts of the output tiles, writing their raw" << std::endl;
+		std::cerr << "                       values to the output file (checkpointed as by --checkpoint, so --resume works too);" << std::endl;
+		std::cerr << "                       put the n shards together with 'aperture_tools merge'" << std::endl;
+		std::cerr << "  --serve <[host:]port> do not render, hand the output tiles out to the workers connecting to <port>" << std::endl;
+		std::cerr << "                       (at any time), taking back the ones not returned within --tile-timeout seconds" << std::endl;
+		std::cerr << "                       (default " << DEFAULT_TILE_TIMEOUT << ") or of a worker that left; --checkpoint works as usual." << std::endl;
+		std::cerr << "                       On every interface, or only that of <host>; there is no authentication, so keep" << std::endl;
+		std::cerr << "                       it to a trusted network" << std::endl;
+		std::cerr << "  --worker <host:port> render the tiles the coordinator there (--serve) hands out, on --threads threads;" << std::endl;
+		std::cerr << "                       no other arguments, the rest comes from the coordinator" << std::endl;
+		std::cerr << "  --batch <manifest>   render many jobs in one process, sharing the threads, the decoded inputs and the" << std::endl;
+		std::cerr << "                       apertures; a job per line: <input.png> <output.png> [<R> [<lambda> [<unfocus_factor>" << std::endl;
+		std::cerr << "                       [<colours>]]]] ('#' comments, \"...\" paths with spaces); the small jobs are" << std::endl;
+		std::cerr << "                       rendered together; no other arguments but --roi, --zoom, --roi-mask, --gain," << std::endl;
+		std::cerr << "                       --colour-mapping, --bit-depth, --edges and the thread options" << std::endl;
+		std::cerr << "  --daemon <socket>    keep running, rendering what the requests on the local <socket> ask for - any" << std::endl;
+		std::cerr << "                       input, R, lambda, unfocus factor, roi and zoom - as PNG or raw; the apertures and" << std::endl;
+		std::cerr << "                       the rendered tiles are kept in memory, see render_daemon.h and 'aperture_tools ask';" << std::endl;
+		std::cerr << "                       no other arguments but --edges, --colour-mapping, --bit-depth, --cache-memory and" << std::endl;
+		std::cerr << "                       the thread options" << std::endl;
+		std::cerr << "  --cache-memory <MB>  of the tiles --daemon keeps, default " << DEFAULT_DAEMON_CACHE_MB << std::endl;
+		std::cerr << "  --roi <x,y,w,h>      render only the given rectangle of the frame (input pixels, may be fractional)" << std::endl;
+		std::cerr << "  --zoom <z>           output pixels per input pixel (of the frame or the --roi), e.g. 4 to look closer" << std::endl;
+		std::cerr << "  --roi-mask <m.png>   of the output size: only the pixels that are not black there are rendered" << std::endl;
+		std::cerr << "  --stars <file>       convolve the render (as the PSF) with a scene of point sources, written to --stars-out;" << std::endl;
+		std::cerr << "                       either a .png (every non-black pixel is a star of its grey level) or a text file" << std::endl;
+		std::cerr << "                       of 'x y brightness [T | w0 .. w" << NUM_COLORS - 1 << "]' lines - T is a black body temperature (K)," << std::endl;
+		std::cerr << "                       w the weight of each wavelength; brightness 1 is as bright as the render itself" << std::endl;
+		std::cerr << "  --stars-out <f.png>  where the --stars field goes" << std::endl;
+		std::cerr << "  --scene <w,h>        size of the --stars field for a text list, default - the size of the render" << std::endl;
+		std::cerr << "  --gain <g>           brighten the output g times, e.g. f^2 to compare the render of an aperture" << std::endl;
+		std::cerr << "                       downsampled by f (see aperture_tools downsample) against the original one" << std::endl;
+		std::cerr << "  --colour-mapping <m> spectrum (default): the wavelengths spread over a rainbow palette; cie: weighted" << std::endl;
+		std::cerr << "                       by the CIE 1931 colour matching functions, written as sRGB" << std::endl;
+		std::cerr << "  --bit-depth <b>      of the output PNG, 8 (default) or 16" << std::endl;
+		std::cerr << "  --keep-spectrum      keep the intensities of every wavelength in memory until the end; by default a plain" << std::endl;
+		std::cerr << "                       render has them reduced to RGB as each pixel is done, in a 10th of the memory" << std::endl;
+		std::cerr << "  --spectrum-storage <s>" << std::endl;
+		std::cerr << "                       keep them (implies --keep-spectrum) as double (default), float, half, bf16 or" << std::endl;
+		std::cerr << "                       shared-exp: 2, 4, 4 and 3.9 times less memory, see spectrum_storage.h for the error" << std::endl;
+		std::cerr << "  --max-memory <MB>    output buffers over half of that are mapped from temporary files next to the output," << std::endl;
+		std::cerr << "                       the rows dropped from memory as they are written to the PNG, which is streamed" << std::endl;
+		std::cerr << "  --edges <q>          take the input as anti-aliased (grey = partially open) instead of thresholding it:" << std::endl;
+		std::cerr << "                       the partially covered pixels are integrated over q x q sub-samples, all the pixels" << std::endl;
+		std::cerr << "                       over their area; 3 about matches a twice finer raster, see bench_edges.ps1" << std::endl;
+		std::cerr << "  --split-k <c,g>      split the sum of every output pixel into c chunks of the aperture rows x g groups of" << std::endl;
+		std::cerr << "                       the wavelengths, so that small outputs keep all the cores busy; chosen from the" << std::endl;
+		std::cerr << "                       output size and the number of cores by default" << std::endl;
+		std::cerr << "  --pin <cores|smt>    one thread per physical core, pinned to it (smt: on every logical processor,"  << std::endl;
+		std::cerr << "                       the physical cores first); on NUMA machines the aperture is copied to every node" << std::endl;
+		std::cerr << "                       and each node renders (and owns the memory of) a band of the output rows" << std::endl;
+		std::cerr << "  --threads <n>        worker threads; by default the processors of the affinity mask, capped by the" << std::endl;
+		std::cerr << "                       cgroup CPU quota (or the job object CPU rate limit on Windows)" << std::endl;
+		std::cerr << "  --background         run at the lowest priority, and take threads off work while they are starved" << std::endl;
+		std::cerr << "                       of CPU (steal, throttling, other services), adding them back once it is there" << std::endl;
+		std::cerr << "Ctrl-C (or SIGTERM) stops the render and writes out what is done so far, a second one quits right away." << std::endl;
 		return -1;
 	}
 
-	std::string input = argv[1];
-	std::string output = argv[2];
+	const std::string& input = opts.input;
+	const std::string& output = opts.output;
+	const bool worker = !opts.worker_address.empty();
+	const bool batch = !opts.batch_file.empty();
+	const bool daemon = !opts.daemon_socket.empty();
 
-	std::cout << "Input: " << input << std::endl;
-	std::cout << "Output: " << output << std::endl;
+	// half for the output buffers, half for the aperture and the rest
+	if (opts.max_memory_mb > 0)
+		mapped_output::set_threshold((opts.max_memory_mb << 20) / 2, std::filesystem::path(output).parent_path().string());
 
-	float R = argc >= 4 ? static_cast<float>(std::atof(argv[3])) : DEFAULT_R;
-	float lambda = argc >= 5 ? static_cast<float>(std::atof(argv[4])) : DEFAULT_LAMBDA;
-	float unfocus_factor = argc >= 6 ? static_cast<float>(std::atof(argv[5])) : 0.0f;
+	if (!worker && !batch && !daemon)
+	{
+		std::cout << "Input: " << input << std::endl;
+		std::cout << "Output: " << output << std::endl;
+	}
+
+	float R = opts.R;
+	float lambda = opts.lambda;
+	float unfocus_factor = opts.unfocus_factor;
 
 	std::vector<unsigned char> data;
 	unsigned width;
 	unsigned height;
-	if (lodepng::decode(data, width, height, input) != 0)
-	{
-		std::cerr << "Failed to open " << input << std::endl;
+	if (!worker && !batch && !daemon && !load_input(input, data, width, height))
 		return -1;
-	}
-	if ((width % 2 != 0) || (height % 2 != 0))
+
+	std::vector<platform::cpu> pins;
+	if (opts.pin)
 	{
-		std::cerr << "Image width & high must be an even number (as some optimisations are only possible in that case), please align your image first" << std::endl;
-		return -1;
+		pins = platform::pin_order(platform::topology(), opts.pin_smt);
+		if (pins.empty())
+			std::cerr << "could not read the processor topology, not pinning" << std::endl;
+		else
+			numWorkerThreads = std::min(numWorkerThreads, static_cast<int>(pins.size()));
 	}
 
-	ThreadGrid _grid{ numWorkerThreads };
+	if (opts.threads > 0)
+		numWorkerThreads = opts.threads;
+
+	ThreadGrid _grid{ numWorkerThreads, pins };
+
+	std::cout << "threads: " << numWorkerThreads;
+	if (cpu_quota > 0.0)
+		std::cout << " (CPU quota: " << cpu_quota << ")";
+	std::cout << std::endl;
+
+	if (!pins.empty())
+		std::cout << "pinned " << std::min<size_t>(numWorkerThreads, pins.size()) << " threads over " << _grid.NumNodes() << " NUMA node(s)" << std::endl;
+
+	if (opts.background && !_grid.SetBackground())
+		std::cerr << "could not lower the thread priority" << std::endl;
+
+	if (worker)
+		return run_worker(_grid, opts);
+
+	if (batch)
+		return run_batch(_grid, opts);
+
+	if (daemon)
+		return run_daemon(_grid, opts);
 
 	apr ap{
 		data, 
@@ -100,98 +1719,282 @@ int main(int argc, char* argv[])
 		R, 
 		lambda, 
 		CLR_STEP,
-		unfocus_factor 
+		unfocus_factor,
+		opts.edge_order
 	};
 
-	std::array<std::tuple<float, float, float>, NUM_COLORS> wavelenghts_as_rgb;
+	// the rows of the colour mapping of the output
+	auto wavelenghts_as_rgb = palette_of(opts.colours, lambdas_of(ap));
 
-	apr::raw out_raw(width* height);
-
-	float wl_max = std::numeric_limits<float>::min();
-	float wl_min = std::numeric_limits<float>::max();
-
-	for (int i = 0; i < NUM_COLORS; i++)
-	{		
-		wl_max = std::max(wl_max, ap.lambda_profiles[i].lambda);
-		wl_min = std::min(wl_min, ap.lambda_profiles[i].lambda);
+	if (opts.edge_order > 1)
+	{
+		std::cout << "Edges: " << ap.edge_samples.size() << " sub-samples (" << opts.edge_order << "x" << opts.edge_order 
+			<< " per partially covered pixel, mirrored images included)" << std::endl;
 	}
-	
+
 	std::cout << "Input image size: " << width << "x" << height << std::endl;
 	std::cout << "R: " << R << ", lambda mid: " << lambda << std::endl;
 
-	std::cout << "Spectrum: " << std::endl;
+	std::cout << "Spectrum (" << (opts.colours == colour_space::cie ? "CIE, linear sRGB" : "spectrum palette") << "): " << std::endl;
 	for (int i = 0; i < NUM_COLORS; i++)
 	{
 		float wl = ap.lambda_profiles[i].lambda;
-		auto rgb = wavelength_to_rgb(wl , wl_min, wl_max);
-		wavelenghts_as_rgb[i] = rgb;
+		auto rgb = wavelenghts_as_rgb[i];
 		std::cout << "lambda[" << i << "] = " << wl << ", maps to RGB(" << std::get<0>(rgb) << ", " << std::get<1>(rgb) << ", " << std::get<2>(rgb) << ")" << std::endl;
 	}
 
-	std::atomic_int progress = 0;
+	output_grid og;
+	if (!make_output_grid(opts, width, height, og))
+		return -1;
 
-	report_progress(0, height);
+	if (!og.is_full_frame(width, height))
+	{
+		if (opts.preview_factor > 1 || !opts.field_file.empty() || opts.watch || !opts.cube_file.empty())
+		{
+			std::cerr << "--roi / --zoom / --roi-mask are not supported with --preview, --field, --watch or --cube" << std::endl;
+			return -1;
+		}
+		if (!opts.stars_file.empty())
+		{
+			std::cerr << "--stars needs the PSF of the full frame, not a --roi / --zoom / --roi-mask of it" << std::endl;
+			return -1;
+		}
+		if (!og.mask.empty() && (opts.progressive || opts.adaptive_threshold > 0.0f))
+		{
+			std::cerr << "--roi-mask is not supported with --progressive or --adaptive" << std::endl;
+			return -1;
+		}
 
-	const auto start = std::chrono::system_clock::now();
+		std::cout << "Output grid: " << og.width << "x" << og.height << ", pixel pitch " << og.pitch
+			<< ", origin (" << og.x_at(0) << ", " << og.y_at(0) << ")"
+			<< (og.mirror_x || og.mirror_y ? ", symmetric" : "") << std::endl;
+	}
 
-	_grid.GridRun(
-		[&](int thread_idx, int num_threads)
+	if (opts.preview_factor > 1)
+		return render_preview(_grid, opts, ap, data);
+
+	if (!opts.field_file.empty() || opts.watch)
+		return render_incremental(_grid, opts, ap);
+
+	if (!opts.cube_file.empty())
+	{
+		apr::field out_field;
+		std::vector<double> field_mask;
+
+		update_field(_grid, ap, out_field, field_mask, false);
+
+		if (!write_field_cube(opts.cube_file, make_field_cube_header(ap, false), lambdas_of(ap), out_field, nullptr))
+			return -1;
+
+		return write_field_png(_grid, output, ap, out_field, opts) ? 0 : -1;
+	}
+
+	// nothing past the colour mapping needs the spectrum of the pixels in doubles (a --spectral-cube is floats)
+	const bool compact = opts.storage != spectrum_storage::float64 || (!opts.spectral_cube_file.empty() && !opts.keep_spectrum);
+	if ((!opts.keep_spectrum || compact) && opts.checkpoint_file.empty() && !opts.resume && opts.num_shards == 1 && opts.serve_port == 0
+		&& !opts.progressive && opts.adaptive_threshold <= 0.0f && opts.split_chunks == 0 && opts.stars_file.empty()
+		&& (compact || !split_k_plan::choose(ap, og, _grid.NumThreads()).is_split()))
+	{
+		return render_plain(_grid, opts, ap, og, output);
+	}
+
+	apr::raw out_raw(og.num_pixels());
+	first_touch(_grid, og, out_raw);
+
+	// the tiles a previous run finished, and what is left to render
+	const auto ckpt_header = make_checkpoint_header(ap, data, og, opts.shard, opts.num_shards);
+	const output_grid work = opts.num_shards > 1 ? shard_grid(og, opts.shard, opts.num_shards) : og;
+	output_grid todo = work;
+	bool append_checkpoint = false;
+
+	if (opts.resume)
+	{
+		if (std::filesystem::exists(opts.checkpoint_file))
+		{
+			std::vector<uint8_t> done;
+			if (!read_checkpoint(opts.checkpoint_file, ckpt_header, og, out_raw, done))
+				return -1;
+
+			todo = remaining_grid(work, done);
+			append_checkpoint = true;
+		}
+		else
 		{
-			for (int y = thread_idx; y < static_cast<int>(height/2); y += num_threads)
+			std::cout << opts.checkpoint_file << " does not exist, starting from scratch" << std::endl;
+		}
+	}
+
+	std::unique_ptr<checkpoint_writer<apr::raw>> checkpoint;
+	if (!opts.checkpoint_file.empty())
+	{
+		checkpoint = std::make_unique<checkpoint_writer<apr::raw>>(todo, out_raw, opts.checkpoint_file, opts.checkpoint_interval);
+		if (!checkpoint->start(ckpt_header, lambdas_of(ap), append_checkpoint))
+			return -1;
+	}
+
+	auto split = checkpoint ? split_k_plan{} : split_k_plan::choose(ap, og, _grid.NumThreads());
+	if (opts.split_chunks > 0)
+	{
+		split.num_chunks = std::min(opts.split_chunks, ap.height - 2 * ap.ap_skip_y);
+		split.num_groups = std::min(opts.split_groups, NUM_COLORS);
+	}
+
+	// from here on Ctrl-C stops the render, and what is done so far is written out
+	install_interrupt_handlers();
+	auto& cancel = interrupt_token();
+
+	if (opts.time_budget > 0.0)
+	{
+		std::cout << "time budget: " << opts.time_budget << " seconds" << std::endl;
+		cancel.set_deadline(opts.time_budget);
+	}
+
+	std::unique_ptr<png_band_writer> png;
+
+	if (opts.serve_port > 0)
+	{
+		tile_coordinator<apr::raw> coordinator{ todo, out_raw, render_job{ ckpt_header, data, todo.mask }, opts.tile_timeout };
+		coordinator.progress = [](size_t done, size_t total) { report_progress(static_cast<int>(done), static_cast<int>(total)); };
+		if (checkpoint)
+			coordinator.tile_done = [&](const tile& t) { checkpoint->tile_done(t); };
+
+		const bool complete = coordinator.serve(opts.serve_host, opts.serve_port, &cancel);
+
+		if (checkpoint && !checkpoint->finish())
+			return -1;
+		if (!complete && !cancel.is_cancelled())
+			return -1;
+	}
+	else if (opts.progressive)
+	{
+		progressive_renderer<apr> renderer{ ap, og, out_raw, exposure_max(ap.total_light_per_pixel) };
+		renderer.run(_grid, opts.snapshot_interval, opts.quality,
+			[&]()
 			{
-				for (int x = 0; x < static_cast<int>(width/2); x++)
-				{
-					ap.diff_value(x, y, out_raw[y * width + x], 
-						out_raw[y * width + width - x - 1], 
-						out_raw[(height - y - 1) * width + x],
-						out_raw[(height - y - 1) * width + width - x - 1]
-						);
-				}
+				std::cout << "writing snapshot to " << opts.snapshot_file << std::endl;
+				write_png(opts.snapshot_file, ap, out_raw, og.width, og.height, opts, &_grid);
+			}, &cancel);
+	}
+	else if (opts.adaptive_threshold > 0.0f)
+	{
+		adaptive_sampler<apr> sampler{ ap, og, out_raw, exposure_max(ap.total_light_per_pixel), opts.adaptive_threshold };
+		sampler.run(_grid, opts.adaptive_step);
+	}
+	else if (split.is_split())
+	{
+		render_split_k(_grid, ap, og, split, out_raw);
+	}
+	else
+	{
+		// the threads of each NUMA node read the aperture from a copy of their own
+		std::unique_ptr<node_replicas<apr>> replicas;
+		if (_grid.NumNodes() > 1)
+			replicas = std::make_unique<node_replicas<apr>>(_grid, ap);
 
-				++progress;
-				if (thread_idx == 0)
-					report_progress(progress.load(), height / 2);
+		// the PNG is colour mapped and encoded band by band as the rows are finished, see png_stream.h
+		if (opts.num_shards == 1)
+		{
+			const auto colours = output_colours(ap, opts, opts.gain);
+			const int bit_depth = opts.bit_depth;
+
+			png = std::make_unique<png_band_writer>();
+			png->rows_encoded = [&](int y0, int y1) { evict_rows(out_raw, og, y0, y1); };
+			if (!png->open(output, todo, bit_depth,
+				[&, colours, bit_depth](int y0, int y1)
+				{
+					const size_t num_pixels = static_cast<size_t>(y1 - y0) * og.width;
+					std::vector<unsigned char> rgb(num_pixels * 3 * bit_depth / 8);
+					colours.map(out_raw[static_cast<size_t>(y0) * og.width].data(), num_pixels, bit_depth, 3, rgb.data());
+					return rgb;
+				}))
+			{
+				return -1;
 			}
-		});
+		}
 
-	const auto end = std::chrono::system_clock::now();
+		std::function<void(const tile&)> tile_done = [&](const tile& t)
+		{
+			if (checkpoint)
+				checkpoint->tile_done(t);
+			if (png)
+				png->tile_done(t);
+		};
 
-	std::cout << std::endl;
-	std::cout << "run duration: " << std::chrono::system_clock::to_time_t(end) - std::chrono::system_clock::to_time_t(start) << " seconds" << std::endl;
+		const auto start = std::chrono::steady_clock::now();
+
+		for_each_grid_pixel(_grid, todo, out_raw,
+			[&](double x, double y, auto& o, auto& o_mx, auto& o_my, auto& o_mx_my)
+			{
+				(replicas ? replicas->local() : ap).diff_value(x, y, o, o_mx, o_my, o_mx_my);
+			}, &cancel, tile_done, png ? 16 : 0);
 
-	float max = static_cast<float>(64.0f * ap.total_light_per_pixel);
+		if (png && !png->finish())
+			return -1;
 
-	std::vector<unsigned char> out(width * height * 4);
+		if (checkpoint)
+		{
+			const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (!checkpoint->finish())
+				return -1;
+			std::cout << "checkpoint overhead: " << 100.0 * checkpoint->write_seconds() / std::max(elapsed, 1e-9) << "% of the render" << std::endl;
+		}
+	}
 
-	for (size_t y = 0; y < height; ++y)
+	if (opts.num_shards > 1)
 	{
-		for (size_t x = 0; x < width; x++)
+		if (cancel.is_cancelled())
 		{
-			size_t i_offs = y * width + x;
-			size_t o_offs = 4 * i_offs;
+			std::cerr << "interrupted, resume the shard with --resume" << std::endl;
+			return -1;
+		}
 
-			float r = 0;
-			float g = 0;
-			float b = 0;
+		std::cout << "shard " << opts.shard << " of " << opts.num_shards << " written to " << output << std::endl;
+		return 0;
+	}
 
-			for (size_t i = 0; i < NUM_COLORS; ++i)
-			{
-				float v = static_cast<float>(out_raw[i_offs][i] / max); // value for the given WL
-				auto rgb = wavelenghts_as_rgb[i]; // RGB components for the given WL
+	if (!png)
+	{
+		// with a memory limit the output is likely to be too big for the whole PNG to be made in memory
+		if (opts.max_memory_mb > 0)
+		{
+			const auto colours = output_colours(ap, opts, opts.gain);
+			const int bit_depth = opts.bit_depth;
 
-				r += v * std::get<0>(rgb);
-				g += v * std::get<1>(rgb);
-				b += v * std::get<2>(rgb);
+			if (!png_band_writer::write(output, og.width, og.height, bit_depth,
+				[&](int y0, int y1)
+				{
+					const size_t num_pixels = static_cast<size_t>(y1 - y0) * og.width;
+					std::vector<unsigned char> rgb(num_pixels * 3 * bit_depth / 8);
+					colours.map(out_raw[static_cast<size_t>(y0) * og.width].data(), num_pixels, bit_depth, 3, rgb.data());
+					return rgb;
+				},
+				[&](int y0, int y1) { evict_rows(out_raw, og, y0, y1); }))
+			{
+				return -1;
 			}
-
-			out[o_offs + 0] = std::min(255u, static_cast<unsigned>(r * 255.0f));
-			out[o_offs + 1] = std::min(255u, static_cast<unsigned>(g * 255.0f));
-			out[o_offs + 2] = std::min(255u, static_cast<unsigned>(b * 255.0f));
-			out[o_offs + 3] = 255;
 		}
+		else if (!write_png(output, ap, out_raw, og.width, og.height, opts, &_grid))
+		{
+			return -1;
+		}
+	}
+
+	if (!opts.spectral_cube_file.empty())
+	{
+		spectral_cube_writer cube;
+		if (!open_spectral_cube(cube, opts, ap, og) || !cube.write(out_raw.data()->data()))
+			return -1;
+	}
+
+	// a complete (if coarser) image for a time budget, a partial one otherwise
+	if (cancel.is_cancelled())
+	{
+		std::cerr << "interrupted, " << output << " has what was rendered so far" << std::endl;
+		return -1;
 	}
 
-	lodepng::encode(output, out, width, height);
+	if (!opts.stars_file.empty())
+		return render_stars(_grid, opts, ap, out_raw);
 
 	return 0;
 }
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include <cstdint>
+
+#include "lodepng.h"
+#include "checkpoint.h"
+
+//
+// Batch mode (--batch): many renders in one process, from a manifest of one job per line
+//
+//	<input.png> <output.png> [<R> [<lambda> [<unfocus_factor> [<colours>]]]]
+//
+// ('#' starts a comment, paths with spaces go in double quotes). The jobs share the thread pool, the decoded
+// inputs (by the hash of the file) and the apertures built from them (by that and the parameters); the small ones
+// are rendered together, see aperture_renderer.cpp.
+//
+
+struct batch_job
+{
+	std::string input;
+	std::string output;
+	float R;
+	float lambda;
+	float unfocus_factor;
+	int colours;	// 0 - not given
+	int line;		// of the manifest, for the messages
+};
+
+// Splits a manifest line into its fields: whitespace separated, "..." for ones with spaces, '#' to the end a comment
+inline std::vector<std::string> split_manifest_line(const std::string& line)
+{
+	std::vector<std::string> ret;
+
+	for (size_t i = 0; i < line.size(); )
+	{
+		if (std::isspace(static_cast<unsigned char>(line[i])))
+		{
+			++i;
+			continue;
+		}
+		if (line[i] == '#')
+			break;
+
+		std::string field;
+		if (line[i] == '"')
+		{
+			const auto end = line.find('"', i + 1);
+			field = line.substr(i + 1, end == std::string::npos ? std::string::npos : end - i - 1);
+			i = end == std::string::npos ? line.size() : end + 1;
+		}
+		else
+		{
+			while (i < line.size() && !std::isspace(static_cast<unsigned char>(line[i])))
+				field += line[i++];
+		}
+		ret.push_back(field);
+	}
+
+	return ret;
+}
+
+// The jobs of the manifest 'path'; missing parameters default to 'defaults'
+inline bool read_manifest(const std::string& path, const batch_job& defaults, std::vector<batch_job>& jobs)
+{
+	std::ifstream f(path);
+	if (!f)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for (int n = 1; std::getline(f, line); ++n)
+	{
+		const auto fields = split_manifest_line(line);
+		if (fields.empty())
+			continue;
+
+		batch_job job = defaults;
+		job.line = n;
+
+		bool ok = fields.size() >= 2 && fields.size() <= 6;
+		if (ok)
+		{
+			job.input = fields[0];
+			job.output = fields[1];
+
+			float* params[] = { &job.R, &job.lambda, &job.unfocus_factor };
+			for (size_t i = 2; i < fields.size() && ok; ++i)
+			{
+				char* end;
+				const double v = std::strtod(fields[i].c_str(), &end);
+				ok = end != fields[i].c_str() && *end == '\0';
+
+				if (i < 5)
+					*params[i - 2] = static_cast<float>(v);
+				else
+					job.colours = static_cast<int>(v);
+			}
+		}
+
+		if (!ok)
+		{
+			std::cerr << path << ":" << n << ": expected <input.png> <output.png> [<R> [<lambda> [<unfocus_factor> [<colours>]]]]" << std::endl;
+			return false;
+		}
+
+		jobs.push_back(job);
+	}
+
+	return true;
+}
+
+//
+// The inputs and apertures the jobs of a batch share. An aperture is dropped once the last job that uses it
+// has taken it (see reserve() / take()), so a long manifest does not keep them all.
+//
+template <typename TAperture>
+class aperture_cache
+{
+public:
+	struct image
+	{
+		uint64_t hash;	// of the file
+		std::vector<unsigned char> data;
+		unsigned width;
+		unsigned height;
+	};
+
+private:
+	using key = std::tuple<uint64_t, float, float, float>;	// file hash, R, lambda, unfocus factor
+
+	std::map<std::string, std::shared_ptr<image>> by_path;
+	std::map<uint64_t, std::shared_ptr<image>> by_hash;
+	std::map<key, std::shared_ptr<TAperture>> apertures;
+	std::map<key, int> uses;
+
+	int edge_order;
+
+public:
+	size_t decoded{ 0 };		// inputs decoded / found decoded already
+	size_t decode_hits{ 0 };
+	size_t built{ 0 };			// apertures built / reused
+	size_t build_hits{ 0 };
+
+	explicit aperture_cache(int edge_order)
+		: edge_order(edge_order)
+	{
+	}
+
+	// The decoded file, nullptr if it cannot be read
+	std::shared_ptr<image> load(const std::string& path)
+	{
+		const auto known = by_path.find(path);
+		if (known != by_path.end())
+		{
+			++decode_hits;
+			return known->second;
+		}
+
+		std::ifstream f(path, std::ios::binary);
+		std::vector<unsigned char> file{ std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>() };
+		if (!f && !f.eof())
+			return nullptr;
+
+		const uint64_t hash = fnv1a(file.data(), file.size());
+
+		auto& img = by_hash[hash];
+		if (img)
+		{
+			++decode_hits;
+		}
+		else
+		{
+			auto decoded_img = std::make_shared<image>();
+			decoded_img->hash = hash;
+			if (file.empty() || lodepng::decode(decoded_img->data, decoded_img->width, decoded_img->height, file) != 0)
+			{
+				by_hash.erase(hash);
+				return nullptr;
+			}
+			img = decoded_img;
+			++decoded;
+		}
+
+		by_path[path] = img;
+		return img;
+	}
+
+	// A job will take() the aperture of 'img' with these parameters
+	void reserve(const image& img, float R, float lambda, float unfocus_factor)
+	{
+		++uses[key{ img.hash, R, lambda, unfocus_factor }];
+	}
+
+	// The aperture of 'img' with these parameters, built by 'make' unless it is there already
+	template <typename TMake>
+	std::shared_ptr<TAperture> take(const image& img, float R, float lambda, float unfocus_factor, TMake&& make)
+	{
+		const key k{ img.hash, R, lambda, unfocus_factor };
+
+		auto& ap = apertures[k];
+		if (ap)
+		{
+			++build_hits;
+		}
+		else
+		{
+			ap = std::shared_ptr<TAperture>(make(img.data, static_cast<int>(img.width), static_cast<int>(img.height),
+				R, lambda, unfocus_factor, edge_order));
+			++built;
+		}
+
+		auto ret = ap;
+		if (--uses[k] <= 0)
+		{
+			apertures.erase(k);
+			uses.erase(k);
+		}
+		return ret;
+	}
+};
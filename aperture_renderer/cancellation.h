@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+
+//
+// Cooperative cancellation of a render: the loops check stop_requested() between their work items (tiles, pixels)
+// and finish early, leaving whatever was computed so far. A token is stopped either explicitly (cancel(), e.g.
+// from the SIGINT / SIGTERM handler below) or by its deadline passing.
+//
+class cancel_token
+{
+	std::atomic_bool cancelled{ false };
+	std::atomic<int64_t> deadline{ 0 };	// steady_clock ticks, 0 - none
+
+public:
+	void cancel() noexcept
+	{
+		cancelled = true;
+	}
+
+	bool is_cancelled() const noexcept
+	{
+		return cancelled;
+	}
+
+	void set_deadline(double seconds_from_now) noexcept
+	{
+		const auto d = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(seconds_from_now));
+		deadline = d.time_since_epoch().count();
+	}
+
+	bool has_deadline() const noexcept
+	{
+		return deadline != 0;
+	}
+
+	bool deadline_passed() const noexcept
+	{
+		const int64_t d = deadline;
+		return d != 0 && std::chrono::steady_clock::now().time_since_epoch().count() >= d;
+	}
+
+	bool stop_requested() const noexcept
+	{
+		return cancelled || deadline_passed();
+	}
+};
+
+// The token stopped by SIGINT / SIGTERM, once install_interrupt_handlers() is called
+inline cancel_token& interrupt_token()
+{
+	static cancel_token token;
+	return token;
+}
+
+// The first Ctrl-C (or SIGTERM) stops the render at the next tile, so what is done gets written out;
+// the second one ends the process right away
+inline void on_interrupt(int sig)
+{
+	if (interrupt_token().is_cancelled())
+		std::_Exit(128 + sig);
+
+	interrupt_token().cancel();
+
+	// the handler is reset to the default one once called on Windows
+	std::signal(sig, on_interrupt);
+}
+
+inline void install_interrupt_handlers()
+{
+	static_assert(std::atomic_bool::is_always_lock_free, "the signal handler needs a lock free flag");
+
+	// the token is created here, not in the handler
+	interrupt_token();
+
+	std::signal(SIGINT, on_interrupt);
+	std::signal(SIGTERM, on_interrupt);
+}
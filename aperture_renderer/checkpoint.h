@@ -0,0 +1,464 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include "output_grid.h"
+#include "tile_scheduler.h"
+
+//
+// Checkpoints of a long render, so that a preempted (or interrupted) one can be resumed where it stopped.
+// The shards of a render split over several processes (--shard) are written the same way, see shard.h.
+//
+// The file is a log: a header with everything the values depend on (a hash of the input image, the render
+// parameters, the output grid), followed by one record per batch of finished tiles. A record holds the raw
+// values of the pixels it covers, so only the work done since the last checkpoint gets written - it is appended
+// from a thread of its own while the render goes on. A record cut short (the process killed while writing it)
+// fails its checksum and is dropped on resume, together with anything after it.
+//
+// Layout (little endian, as written by the host):
+//
+//	checkpoint_header
+//	float lambdas[num_colors]
+//	records, each:
+//	uint32_t num_pixels
+//	{ int32_t u, v; pixel images[4]; } [num_pixels]	(the representative pixel and its mirrored images)
+//	uint64_t checksum							(fnv1a of the above)
+//
+
+constexpr char CHECKPOINT_MAGIC[8] = { 'A', 'P', 'R', 'C', 'K', 'P', 'T', '1' };
+constexpr uint32_t CHECKPOINT_VERSION = 2;
+
+struct checkpoint_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_colors;
+	uint64_t input_hash;		// of the input image, see fnv1a()
+	int32_t input_width;
+	int32_t input_height;
+	float R;
+	float lambda;
+	float clr_step;
+	float unfocus_factor;
+	int32_t edge_order;
+	uint32_t skip_r_square;
+	int32_t width;				// the output grid
+	int32_t height;
+	double origin_x;
+	double origin_y;
+	double pitch;
+	uint64_t mask_hash;			// of the --roi-mask, 0 - none
+	uint64_t num_wanted;		// representative pixels of the grid to render (all the shards)
+	uint32_t pixel_size;		// bytes per raw pixel
+	int32_t shard;				// which part of the grid, see shard.h
+	int32_t num_shards;
+	uint32_t reserved;
+	double total_light_per_pixel;	// for the exposure of the merged shards
+};
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ull)
+{
+	const auto* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+template <typename TAperture>
+checkpoint_header make_checkpoint_header(const TAperture& ap, const std::vector<unsigned char>& input, const output_grid& g,
+	int shard = 0, int num_shards = 1)
+{
+	checkpoint_header hdr{};
+	std::memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	hdr.version = CHECKPOINT_VERSION;
+	hdr.num_colors = static_cast<uint32_t>(ap.lambda_profiles.size());
+	hdr.input_hash = fnv1a(input.data(), input.size());
+	hdr.input_width = ap.width;
+	hdr.input_height = ap.height;
+	hdr.R = static_cast<float>(ap.R);
+	hdr.lambda = ap.lambda;
+	hdr.clr_step = ap.clr_step;
+	hdr.unfocus_factor = static_cast<float>(ap.unfocus_factor);
+	hdr.edge_order = ap.edge_order;
+	hdr.skip_r_square = TAperture::skips_r_square ? 1 : 0;
+	hdr.width = g.width;
+	hdr.height = g.height;
+	hdr.origin_x = g.origin_x;
+	hdr.origin_y = g.origin_y;
+	hdr.pitch = g.pitch;
+	hdr.mask_hash = g.mask.empty() ? 0 : fnv1a(g.mask.data(), g.mask.size());
+	hdr.pixel_size = static_cast<uint32_t>(sizeof(typename TAperture::pixel));
+	hdr.shard = shard;
+	hdr.num_shards = num_shards;
+	hdr.total_light_per_pixel = static_cast<double>(ap.total_light_per_pixel);
+
+	for (int v = 0; v < g.rep_height; ++v)
+	{
+		for (int u = 0; u < g.rep_width; ++u)
+		{
+			if (g.wanted(u, v))
+				++hdr.num_wanted;
+		}
+	}
+
+	return hdr;
+}
+
+// What a checkpoint written with 'a' would not match of 'b', nullptr if it does
+inline const char* checkpoint_mismatch(const checkpoint_header& a, const checkpoint_header& b)
+{
+	if (a.input_hash != b.input_hash || a.input_width != b.input_width || a.input_height != b.input_height)
+		return "the input image";
+	if (a.num_colors != b.num_colors || a.pixel_size != b.pixel_size || a.skip_r_square != b.skip_r_square)
+		return "the build (colours, pixel type)";
+	if (a.R != b.R || a.lambda != b.lambda || a.clr_step != b.clr_step || a.unfocus_factor != b.unfocus_factor)
+		return "R, lambda or the unfocus factor";
+	if (a.edge_order != b.edge_order)
+		return "--edges";
+	if (a.width != b.width || a.height != b.height || a.origin_x != b.origin_x || a.origin_y != b.origin_y
+		|| a.pitch != b.pitch || a.mask_hash != b.mask_hash)
+	{
+		return "the output grid (--roi, --zoom, --roi-mask)";
+	}
+	if (a.shard != b.shard || a.num_shards != b.num_shards)
+		return "--shard";
+	return nullptr;
+}
+
+// The output grid a checkpoint was rendered on, as far as the layout of the pixels goes (there is no --roi-mask)
+inline output_grid checkpoint_grid(const checkpoint_header& hdr)
+{
+	auto g = output_grid::roi(hdr.input_width, hdr.input_height, hdr.origin_x + 0.5 - 0.5 * hdr.pitch,
+		hdr.origin_y + 0.5 - 0.5 * hdr.pitch, hdr.width * hdr.pitch, hdr.height * hdr.pitch, 1.0 / hdr.pitch);
+	g.origin_x = hdr.origin_x;
+	g.origin_y = hdr.origin_y;
+	return g;
+}
+
+inline bool read_checkpoint_header(std::ifstream& f, const std::string& path, checkpoint_header& hdr, std::vector<float>& lambdas)
+{
+	f.read(reinterpret_cast<char*>(&hdr), sizeof(hdr));
+	if (!f || std::memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != CHECKPOINT_VERSION)
+	{
+		std::cerr << path << " is not a checkpoint file (of this version)" << std::endl;
+		return false;
+	}
+
+	lambdas.resize(hdr.num_colors);
+	f.read(reinterpret_cast<char*>(lambdas.data()), lambdas.size() * sizeof(float));
+	if (!f)
+	{
+		std::cerr << path << " is truncated" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+struct checkpoint_contents
+{
+	size_t num_records{ 0 };
+	size_t num_pixels{ 0 };
+	size_t num_duplicates{ 0 };	// pixels already 'done' before
+	uint64_t good_size{ 0 };		// of the file, up to the end of the last intact record
+};
+
+// Reads the records following the header into 'out' (hdr.pixel_size bytes per pixel, of the grid 'g'), marking
+// the representative pixels they have in 'done' (rep_width x rep_height). Stops at the first record that is not intact.
+inline checkpoint_contents read_checkpoint_records(std::ifstream& f, const checkpoint_header& hdr, const output_grid& g,
+	void* out, std::vector<uint8_t>& done)
+{
+	checkpoint_contents ret;
+	ret.good_size = static_cast<uint64_t>(f.tellg());
+
+	const size_t entry_size = 2 * sizeof(int32_t) + 4 * size_t{ hdr.pixel_size };
+	std::vector<unsigned char> entries;
+
+	for (;;)
+	{
+		uint32_t count;
+		if (!f.read(reinterpret_cast<char*>(&count), sizeof(count)))
+			break;
+
+		// a count garbled by a torn write must not make us allocate the world
+		if (count > done.size())
+			break;
+
+		entries.resize(count * entry_size);
+		uint64_t checksum;
+		if (!f.read(reinterpret_cast<char*>(entries.data()), entries.size()) || !f.read(reinterpret_cast<char*>(&checksum), sizeof(checksum)))
+			break;
+
+		if (checksum != fnv1a(entries.data(), entries.size(), fnv1a(&count, sizeof(count))))
+			break;
+
+		bool valid = true;
+		for (uint32_t i = 0; i < count && valid; ++i)
+		{
+			int32_t uv[2];
+			std::memcpy(uv, &entries[i * entry_size], sizeof(uv));
+			valid = uv[0] >= 0 && uv[0] < g.rep_width && uv[1] >= 0 && uv[1] < g.rep_height;
+		}
+		if (!valid)
+			break;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const unsigned char* e = &entries[i * entry_size];
+			int32_t uv[2];
+			std::memcpy(uv, e, sizeof(uv));
+
+			for (int m = 0; m < 4; ++m)
+			{
+				std::memcpy(static_cast<unsigned char*>(out) + g.image_offs(uv[0], uv[1], m) * hdr.pixel_size,
+					e + sizeof(uv) + m * hdr.pixel_size, hdr.pixel_size);
+			}
+
+			auto& d = done[static_cast<size_t>(uv[1]) * g.rep_width + uv[0]];
+			if (d)
+				++ret.num_duplicates;
+			d = 1;
+		}
+
+		++ret.num_records;
+		ret.num_pixels += count;
+		ret.good_size = static_cast<uint64_t>(f.tellg());
+	}
+
+	return ret;
+}
+
+// Reads the checkpoint 'path' into 'out' (of the grid 'g'), marking the representative pixels it has in 'done'
+// (rep_width x rep_height). The file is truncated after the last intact record, so that it can be appended to.
+// Returns false if it cannot be read or does not match 'expected'.
+template <typename TRaw>
+bool read_checkpoint(const std::string& path, const checkpoint_header& expected, const output_grid& g, TRaw& out,
+	std::vector<uint8_t>& done)
+{
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	checkpoint_header hdr;
+	std::vector<float> lambdas;
+	if (!read_checkpoint_header(f, path, hdr, lambdas))
+		return false;
+
+	if (const char* what = checkpoint_mismatch(hdr, expected))
+	{
+		std::cerr << path << " was rendered with different " << what << ", not resuming from it" << std::endl;
+		return false;
+	}
+
+	done.assign(static_cast<size_t>(g.rep_width) * g.rep_height, 0);
+	const auto contents = read_checkpoint_records(f, hdr, g, out.data(), done);
+	f.close();
+
+	std::error_code ec;
+	if (std::filesystem::file_size(path, ec) != contents.good_size && !ec)
+	{
+		std::cout << path << ": dropping an incomplete record at the end" << std::endl;
+		std::filesystem::resize_file(path, contents.good_size, ec);
+		if (ec)
+		{
+			std::cerr << "Failed to truncate " << path << ": " << ec.message() << std::endl;
+			return false;
+		}
+	}
+
+	std::cout << "Resuming from " << path << ": " << contents.num_pixels << " pixels in " << contents.num_records << " checkpoints" << std::endl;
+	return true;
+}
+
+// The grid 'g' without the representative pixels that are 'done' (see read_checkpoint())
+inline output_grid remaining_grid(const output_grid& g, const std::vector<uint8_t>& done)
+{
+	output_grid ret = g;
+	ret.mask.assign(g.num_pixels(), 0);
+
+	for (int v = 0; v < g.rep_height; ++v)
+	{
+		for (int u = 0; u < g.rep_width; ++u)
+		{
+			if (g.wanted(u, v) && !done[static_cast<size_t>(v) * g.rep_width + u])
+				ret.mask[g.image_offs(u, v, 0)] = 1;
+		}
+	}
+
+	return ret;
+}
+
+//
+// Appends the tiles reported by tile_done() to the checkpoint every 'interval' seconds, from a thread of its own.
+// The pixels of a tile are only read once it is reported, i.e. once no thread writes them anymore.
+//
+template <typename TRaw>
+class checkpoint_writer
+{
+	using pixel = typename TRaw::value_type;
+
+	const output_grid& g;
+	const TRaw& out;
+	std::string path;
+	double interval;
+
+	std::ofstream f;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::vector<tile> pending;
+	bool stopping{ false };
+	bool failed{ false };
+	std::thread writer;
+
+	size_t num_writes{ 0 };
+	size_t bytes{ 0 };
+	double seconds{ 0.0 };
+
+public:
+	checkpoint_writer(const output_grid& g, const TRaw& out, const std::string& path, double interval)
+		: g(g), out(out), path(path), interval(interval)
+	{
+	}
+
+	~checkpoint_writer()
+	{
+		finish();
+	}
+
+	// Starts a new checkpoint with 'hdr' and 'lambdas', or - with 'append' - continues the one read_checkpoint() read
+	bool start(const checkpoint_header& hdr, const std::vector<float>& lambdas, bool append)
+	{
+		f.open(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+		if (!f)
+		{
+			std::cerr << "Failed to open " << path << " for writing" << std::endl;
+			return false;
+		}
+
+		if (!append)
+		{
+			f.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+			f.write(reinterpret_cast<const char*>(lambdas.data()), lambdas.size() * sizeof(float)).flush();
+		}
+
+		writer = std::thread([this]() { run(); });
+		return static_cast<bool>(f);
+	}
+
+	// called by the render threads, as they finish a tile
+	void tile_done(const tile& t)
+	{
+		std::lock_guard<std::mutex> l(lock);
+		pending.push_back(t);
+	}
+
+	// Writes whatever is still pending and stops the thread; false if any checkpoint failed
+	bool finish()
+	{
+		if (writer.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> l(lock);
+				stopping = true;
+			}
+			wake.notify_one();
+			writer.join();
+
+			std::cout << "checkpoints: " << num_writes << " written to " << path << ", " << bytes / (1024.0 * 1024.0) << " MB, "
+				<< seconds << " seconds" << std::endl;
+		}
+
+		return !failed;
+	}
+
+	// time spent writing, for the overhead
+	double write_seconds() const
+	{
+		return seconds;
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> l(lock);
+
+		for (;;)
+		{
+			wake.wait_for(l, std::chrono::duration<double>(interval), [this]() { return stopping; });
+
+			std::vector<tile> tiles;
+			tiles.swap(pending);
+			const bool last = stopping;
+
+			l.unlock();
+			if (!tiles.empty())
+				write(tiles);
+			l.lock();
+
+			if (last)
+				break;
+		}
+	}
+
+	void write(const std::vector<tile>& tiles)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		std::vector<char> record(sizeof(uint32_t));
+		uint32_t count = 0;
+
+		for (const auto& t : tiles)
+		{
+			for (int v = t.v0; v < t.v1; ++v)
+			{
+				for (int u = t.u0; u < t.u1; ++u)
+				{
+					if (!g.wanted(u, v))
+						continue;
+
+					const int32_t uv[2] = { u, v };
+					append(record, uv, sizeof(uv));
+					for (int m = 0; m < 4; ++m)
+						append(record, &out[g.image_offs(u, v, m)], sizeof(pixel));
+					++count;
+				}
+			}
+		}
+
+		std::memcpy(record.data(), &count, sizeof(count));
+		const uint64_t checksum = fnv1a(record.data() + sizeof(count), record.size() - sizeof(count), fnv1a(&count, sizeof(count)));
+		append(record, &checksum, sizeof(checksum));
+
+		f.write(record.data(), record.size()).flush();
+		if (!f && !failed)
+		{
+			std::cerr << "Failed to write the checkpoint to " << path << std::endl;
+			failed = true;
+		}
+
+		++num_writes;
+		bytes += record.size();
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static void append(std::vector<char>& record, const void* data, size_t size)
+	{
+		const auto* p = static_cast<const char*>(data);
+		record.insert(record.end(), p, p + size);
+	}
+};
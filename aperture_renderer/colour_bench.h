@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <algorithm>
+
+#include "ThreadGrid.h"
+#include "colour_mapping.h"
+
+//
+// Benchmark of the colour mapping of a size x size render of 16 wavelengths: colour_matrix on one thread and
+// split over the threads, 8 and 16 bits, against the previous per-pixel loop (kept below as it was: every
+// intensity divided by the max, the palette looked up per wavelength, RGBA out).
+//
+
+namespace colour_bench
+{
+	constexpr size_t NUM_COLORS = 16;
+
+	inline std::vector<unsigned char> legacy_colour_map(const double* raw, size_t num_colors, const rgb_palette& wavelenghts_as_rgb,
+		float max, unsigned width, unsigned height)
+	{
+		std::vector<unsigned char> out(static_cast<size_t>(width) * height * 4);
+
+		for (size_t y = 0; y < height; ++y)
+		{
+			for (size_t x = 0; x < width; x++)
+			{
+				size_t i_offs = y * width + x;
+				size_t o_offs = 4 * i_offs;
+
+				float r = 0;
+				float g = 0;
+				float b = 0;
+
+				for (size_t i = 0; i < num_colors; ++i)
+				{
+					float v = static_cast<float>(raw[i_offs * num_colors + i] / max); // value for the given WL
+					auto rgb = wavelenghts_as_rgb[i]; // RGB components for the given WL
+
+					r += v * std::get<0>(rgb);
+					g += v * std::get<1>(rgb);
+					b += v * std::get<2>(rgb);
+				}
+
+				out[o_offs + 0] = std::min(255u, static_cast<unsigned>(r * 255.0f));
+				out[o_offs + 1] = std::min(255u, static_cast<unsigned>(g * 255.0f));
+				out[o_offs + 2] = std::min(255u, static_cast<unsigned>(b * 255.0f));
+				out[o_offs + 3] = 255;
+			}
+		}
+
+		return out;
+	}
+
+	// milliseconds of 'run', best of 'repeats'
+	template <typename TRun>
+	double time_ms(int repeats, TRun&& run)
+	{
+		double best = 1e30;
+		for (int r = 0; r < repeats; ++r)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			run();
+			best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		return best;
+	}
+
+	// Returns false if the matrix does not give what the previous loop does (give or take the rounding)
+	inline bool run(int size, int num_threads, std::ostream& os)
+	{
+		constexpr int repeats = 5;
+		const size_t num_pixels = static_cast<size_t>(size) * size;
+
+		// the lambdas of a render at 500 nm, intensities up to a few times the max as the centre of a render has them
+		std::vector<float> lambdas(NUM_COLORS);
+		for (size_t i = 0; i < NUM_COLORS; ++i)
+			lambdas[i] = static_cast<float>(500.0 * std::pow(1.03, static_cast<double>(NUM_COLORS / 2) - i));
+
+		const float max = 1000.0f;
+		std::vector<double> raw(num_pixels * NUM_COLORS);
+		std::mt19937_64 rng{ 42 };
+		std::exponential_distribution<double> intensity{ 1.0 / 150.0 };
+		for (auto& v : raw)
+			v = intensity(rng);
+
+		const auto palette = spectrum_as_rgb(lambdas);
+		const colour_matrix spectrum{ palette, max };
+		const colour_matrix cie{ colour_space::cie, lambdas, max };
+
+		std::vector<unsigned char> legacy;
+		const double legacy_ms = time_ms(repeats,
+			[&]() { legacy = legacy_colour_map(raw.data(), NUM_COLORS, palette, max, size, size); });
+
+		std::vector<unsigned char> rgba(num_pixels * 4);
+		const double serial_ms = time_ms(repeats,
+			[&]() { spectrum.map(raw.data(), num_pixels, 8, 4, rgba.data()); });
+
+		ThreadGrid grid{ num_threads };
+		std::vector<unsigned char> out;
+		const double rgb8_ms = time_ms(repeats, [&]() { out = spectrum.map(grid, raw.data(), num_pixels, 8, 3); });
+		const double rgb16_ms = time_ms(repeats, [&]() { out = spectrum.map(grid, raw.data(), num_pixels, 16, 3); });
+		const double cie8_ms = time_ms(repeats, [&]() { out = cie.map(grid, raw.data(), num_pixels, 8, 3); });
+		const double cie16_ms = time_ms(repeats, [&]() { out = cie.map(grid, raw.data(), num_pixels, 16, 3); });
+
+		os << size << "x" << size << " pixels of " << NUM_COLORS << " wavelengths, " << num_threads << " threads, best of " << repeats << ":" << std::endl;
+		os << "  previous loop:            " << legacy_ms << " ms" << std::endl;
+		os << "  matrix, 1 thread:         " << serial_ms << " ms (" << legacy_ms / serial_ms << "x)" << std::endl;
+		os << "  matrix, 8 bit RGB:        " << rgb8_ms << " ms (" << legacy_ms / rgb8_ms << "x)" << std::endl;
+		os << "  matrix, 16 bit RGB:       " << rgb16_ms << " ms" << std::endl;
+		os << "  CIE to sRGB, 8 bit RGB:   " << cie8_ms << " ms" << std::endl;
+		os << "  CIE to sRGB, 16 bit RGB:  " << cie16_ms << " ms" << std::endl;
+
+		int max_diff = 0;
+		for (size_t i = 0; i < rgba.size(); ++i)
+			max_diff = std::max(max_diff, std::abs(rgba[i] - legacy[i]));
+		if (max_diff > 1)
+		{
+			std::cerr << "the matrix is off the previous loop by up to " << max_diff << std::endl;
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "ThreadGrid.h"
+#include "wavelength_to_rgb.h"
+
+using rgb_palette = std::vector<std::tuple<float, float, float>>;
+
+// Normalisation of the raw intensities: the value that maps to the full brightness
+inline float exposure_max(double total_light_per_pixel)
+{
+	return static_cast<float>(64.0f * total_light_per_pixel);
+}
+
+// RGB colour for each of the rendered wavelengths, spreading the range of lambdas over the visible spectrum
+inline rgb_palette spectrum_as_rgb(const std::vector<float>& lambdas)
+{
+	rgb_palette wavelenghts_as_rgb(lambdas.size());
+
+	float wl_max = std::numeric_limits<float>::min();
+	float wl_min = std::numeric_limits<float>::max();
+
+	for (float wl : lambdas)
+	{
+		wl_max = std::max(wl_max, wl);
+		wl_min = std::min(wl_min, wl);
+	}
+
+	for (size_t i = 0; i < lambdas.size(); i++)
+	{
+		wavelenghts_as_rgb[i] = wavelength_to_rgb(lambdas[i], wl_min, wl_max);
+	}
+
+	return wavelenghts_as_rgb;
+}
+
+// The visible wavelength (nm) that the lambda 'wl' of the rendered range [wl_min, wl_max] stands for: the range
+// spread over 380 - 688 nm, as wavelength_to_rgb() spreads it (the 380 - 780 nm of its formula, squeezed by 1.3);
+// the middle of that for a single lambda. The one place the lambdas become colours by, for every mapping.
+inline double lambda_to_nm(float wl, float wl_min, float wl_max)
+{
+	const double t = wl_max > wl_min ? (static_cast<double>(wl) - wl_min) / (static_cast<double>(wl_max) - wl_min) : 0.5;
+	return 380.0 + 400.0 * t / 1.3;
+}
+
+// How the spectrum becomes RGB, see --colour-mapping
+enum class colour_space
+{
+	spectrum,	// the wavelength_to_rgb() palette
+	cie,		// the CIE 1931 colour matching functions, to sRGB
+};
+
+inline bool parse_colour_space(const std::string& name, colour_space& space)
+{
+	if (name == "spectrum")
+		space = colour_space::spectrum;
+	else if (name == "cie")
+		space = colour_space::cie;
+	else
+		return false;
+	return true;
+}
+
+// The CIE 1931 2 degree colour matching functions at 'nm', the multi-lobe Gaussian fit of Wyman, Sloan & Shirley
+// ("Simple Analytic Approximations to the CIE XYZ Color Matching Functions", JCGT 2013)
+inline std::tuple<double, double, double> cie_xyz(double nm)
+{
+	auto g = [nm](double mu, double sigma_low, double sigma_high)
+	{
+		const double t = (nm - mu) / (nm < mu ? sigma_low : sigma_high);
+		return std::exp(-0.5 * t * t);
+	};
+
+	const double x = 1.056 * g(599.8, 37.9, 31.0) + 0.362 * g(442.0, 16.0, 26.7) - 0.065 * g(501.1, 20.4, 26.2);
+	const double y = 0.821 * g(568.8, 46.9, 40.5) + 0.286 * g(530.9, 16.3, 31.1);
+	const double z = 1.217 * g(437.0, 11.8, 36.0) + 0.681 * g(459.0, 26.0, 13.8);
+	return { x, y, z };
+}
+
+// Linear sRGB for each of the rendered wavelengths: the lambdas at their lambda_to_nm() (as spectrum_as_rgb()
+// has them), weighted by the colour matching functions, XYZ to sRGB (D65). Scaled so a flat
+// spectrum is as bright (in luminance) as it is with spectrum_as_rgb(); the entries may be negative, only the
+// sums are in gamut.
+inline rgb_palette cie_as_rgb(const std::vector<float>& lambdas)
+{
+	rgb_palette ret(lambdas.size());
+	if (lambdas.empty())
+		return ret;
+
+	const float wl_min = *std::min_element(lambdas.begin(), lambdas.end());
+	const float wl_max = *std::max_element(lambdas.begin(), lambdas.end());
+
+	double flat_y = 0;
+	for (size_t i = 0; i < lambdas.size(); ++i)
+	{
+		const auto [x, y, z] = cie_xyz(lambda_to_nm(lambdas[i], wl_min, wl_max));
+
+		ret[i] = {
+			static_cast<float>(3.2406 * x - 1.5372 * y - 0.4986 * z),
+			static_cast<float>(-0.9689 * x + 1.8758 * y + 0.0415 * z),
+			static_cast<float>(0.0557 * x - 0.2040 * y + 1.0570 * z) };
+		flat_y += y;
+	}
+
+	double palette_y = 0;
+	for (const auto& rgb : spectrum_as_rgb(lambdas))
+		palette_y += 0.2126 * std::get<0>(rgb) + 0.7152 * std::get<1>(rgb) + 0.0722 * std::get<2>(rgb);
+
+	const float scale = static_cast<float>(palette_y / flat_y);
+	for (auto& rgb : ret)
+		rgb = { std::get<0>(rgb) * scale, std::get<1>(rgb) * scale, std::get<2>(rgb) * scale };
+
+	return ret;
+}
+
+// The RGB of each of the rendered wavelengths under the mapping 'space': the rows of its colour_matrix, before the
+// exposure
+inline rgb_palette palette_of(colour_space space, const std::vector<float>& lambdas)
+{
+	return space == colour_space::cie ? cie_as_rgb(lambdas) : spectrum_as_rgb(lambdas);
+}
+
+//
+// The colour mapping of the raw intensities as one num_colors x 3 matrix - the RGB of each wavelength with the
+// exposure (the division by the max) folded in - applied to each pixel, then clamped to [0, 1] and, for the CIE
+// mapping, sRGB encoded (or with any gamma, see set_gamma()). 8 or 16 bits per channel (16 big-endian, as PNG has
+// them), RGB or RGBA.
+//
+class colour_matrix
+{
+	size_t num_colors{ 0 };
+	std::vector<double> weights;	// planar: the R of every wavelength, then the G, then the B
+	std::shared_ptr<std::vector<uint16_t>> curve;	// linear 16 bits -> sRGB / gamma encoded, nullptr - no transfer curve
+
+	static std::shared_ptr<std::vector<uint16_t>> srgb_curve()
+	{
+		static const auto curve = []()
+		{
+			auto ret = std::make_shared<std::vector<uint16_t>>(65536);
+			for (size_t i = 0; i < ret->size(); ++i)
+			{
+				const double v = i / 65535.0;
+				const double e = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+				(*ret)[i] = static_cast<uint16_t>(std::lround(e * 65535.0));
+			}
+			return ret;
+		}();
+		return curve;
+	}
+
+	// the clamped [0, 1] values are quantized to 16 bits if they go through the curve or out as such, to 8 bits
+	// otherwise (truncated, as the 8 bit output always was)
+	double quantum(int bit_depth) const
+	{
+		return curve || bit_depth == 16 ? 65535.0 : 255.0;
+	}
+
+	double rounding(int bit_depth) const
+	{
+		return curve || bit_depth == 16 ? 0.5 : 0.0;
+	}
+
+	// the quantized r, g, b -> the output samples
+	void store(const int32_t* q, int bit_depth, int channels, unsigned char* out) const
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			const unsigned e = curve ? (*curve)[q[c]] : static_cast<unsigned>(q[c]);
+			if (bit_depth == 16)
+			{
+				out[2 * c] = static_cast<unsigned char>(e >> 8);
+				out[2 * c + 1] = static_cast<unsigned char>(e);
+			}
+			else
+			{
+				out[c] = static_cast<unsigned char>(curve ? (e * 255 + 32767) / 65535 : e);
+			}
+		}
+
+		if (channels == 4)
+		{
+			out[3 * bit_depth / 8] = 255;
+			if (bit_depth == 16)
+				out[7] = 255;
+		}
+	}
+
+#if defined(__AVX2__)
+	// r, g, b of the pixel 'px' in the lanes 0, 1, 2 - num_colors a multiple of 4
+	__m256d dot4(const double* px) const
+	{
+		const double* wr = weights.data();
+		const double* wg = wr + num_colors;
+		const double* wb = wg + num_colors;
+
+		__m256d r = _mm256_setzero_pd();
+		__m256d g = _mm256_setzero_pd();
+		__m256d b = _mm256_setzero_pd();
+
+		for (size_t i = 0; i < num_colors; i += 4)
+		{
+			const __m256d v = _mm256_loadu_pd(px + i);
+			r = _mm256_fmadd_pd(v, _mm256_loadu_pd(wr + i), r);
+			g = _mm256_fmadd_pd(v, _mm256_loadu_pd(wg + i), g);
+			b = _mm256_fmadd_pd(v, _mm256_loadu_pd(wb + i), b);
+		}
+
+		// the horizontal sums
+		const __m256d rg = _mm256_hadd_pd(r, g);
+		const __m256d bb = _mm256_hadd_pd(b, b);
+		return _mm256_add_pd(_mm256_permute2f128_pd(rg, bb, 0x20), _mm256_permute2f128_pd(rg, bb, 0x31));
+	}
+#endif
+
+	// r, g, b of the pixel 'px'
+	void dot(const double* px, double* rgb) const
+	{
+#if defined(__AVX2__)
+		if (num_colors % 4 == 0)
+		{
+			alignas(32) double sum[4];
+			_mm256_store_pd(sum, dot4(px));
+			std::copy_n(sum, 3, rgb);
+			return;
+		}
+#endif
+		const double* wr = weights.data();
+		const double* wg = wr + num_colors;
+		const double* wb = wg + num_colors;
+
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		for (size_t i = 0; i < num_colors; ++i)
+		{
+			rgb[0] += px[i] * wr[i];
+			rgb[1] += px[i] * wg[i];
+			rgb[2] += px[i] * wb[i];
+		}
+	}
+
+	static int32_t quantize(double v, double quantum, double rounding)
+	{
+		return static_cast<int32_t>((v > 0.0 ? std::min(v, 1.0) : 0.0) * quantum + rounding);	// NaN to 0 too
+	}
+
+public:
+	colour_matrix() = default;
+
+	// 'max' is the raw intensity of the full brightness, see exposure_max()
+	colour_matrix(const rgb_palette& palette, float max, bool srgb_encoded = false)
+		: num_colors(palette.size())
+		, weights(3 * palette.size())
+	{
+		for (size_t i = 0; i < num_colors; ++i)
+		{
+			weights[i] = std::get<0>(palette[i]) / static_cast<double>(max);
+			weights[num_colors + i] = std::get<1>(palette[i]) / static_cast<double>(max);
+			weights[2 * num_colors + i] = std::get<2>(palette[i]) / static_cast<double>(max);
+		}
+		if (srgb_encoded)
+			curve = srgb_curve();
+	}
+
+	colour_matrix(colour_space space, const std::vector<float>& lambdas, float max)
+		: colour_matrix(palette_of(space, lambdas), max, space == colour_space::cie)
+	{
+	}
+
+	// Encodes the output with a power law of 1 / 'gamma' instead of the sRGB curve (or none); 0 - leave it as it is
+	void set_gamma(double gamma)
+	{
+		if (gamma <= 0.0)
+			return;
+
+		curve = std::make_shared<std::vector<uint16_t>>(65536);
+		for (size_t i = 0; i < curve->size(); ++i)
+			(*curve)[i] = static_cast<uint16_t>(std::lround(std::pow(i / 65535.0, 1.0 / gamma) * 65535.0));
+	}
+
+	// The 'num_pixels' pixels of 'raw' (num_colors intensities each, the layout of aperture::raw) to 'out',
+	// channels * bit_depth / 8 bytes per pixel
+	void map(const double* raw, size_t num_pixels, int bit_depth, int channels, unsigned char* out) const
+	{
+		const size_t pixel_bytes = static_cast<size_t>(channels) * bit_depth / 8;
+		const double quantum = this->quantum(bit_depth);
+		const double rounding = this->rounding(bit_depth);
+
+#if defined(__AVX2__)
+		if (num_colors % 4 == 0)
+		{
+			const __m256d zero = _mm256_setzero_pd();
+			const __m256d one = _mm256_set1_pd(1.0);
+			const __m256d scale = _mm256_set1_pd(quantum);
+			const __m256d bias = _mm256_set1_pd(rounding);
+
+			for (size_t p = 0; p < num_pixels; ++p)
+			{
+				// max() first, it takes a NaN to 0
+				const __m256d clamped = _mm256_min_pd(_mm256_max_pd(dot4(raw + p * num_colors), zero), one);
+				alignas(16) int32_t q[4];
+				_mm_store_si128(reinterpret_cast<__m128i*>(q), _mm256_cvttpd_epi32(_mm256_fmadd_pd(clamped, scale, bias)));
+				store(q, bit_depth, channels, out + p * pixel_bytes);
+			}
+			return;
+		}
+#endif
+
+		for (size_t p = 0; p < num_pixels; ++p)
+		{
+			double rgb[3];
+			dot(raw + p * num_colors, rgb);
+
+			const int32_t q[3] = { quantize(rgb[0], quantum, rounding), quantize(rgb[1], quantum, rounding), quantize(rgb[2], quantum, rounding) };
+			store(q, bit_depth, channels, out + p * pixel_bytes);
+		}
+	}
+
+	// The linear RGB of one pixel of num_colors intensities (1 - the full brightness), as map() has it before the
+	// clamping, for renders that keep that much only (see encode())
+	void reduce(const double* px, float* rgb) const
+	{
+		double sum[3];
+		dot(px, sum);
+		for (int c = 0; c < 3; ++c)
+			rgb[c] = static_cast<float>(sum[c]);
+	}
+
+	// The linear RGB of the intensity 'v' of wavelength 'i' alone, added to 'rgb': reduce() a wavelength at a time,
+	// for renders that only have one spectral plane at hand (see render_star_field())
+	void accumulate(size_t i, double v, float* rgb) const
+	{
+		rgb[0] += static_cast<float>(v * weights[i]);
+		rgb[1] += static_cast<float>(v * weights[num_colors + i]);
+		rgb[2] += static_cast<float>(v * weights[2 * num_colors + i]);
+	}
+
+	// The 'num_pixels' pixels of reduce() in 'rgb' (3 floats each) to 'out', as map() writes them
+	void encode(const float* rgb, size_t num_pixels, int bit_depth, int channels, unsigned char* out) const
+	{
+		const size_t pixel_bytes = static_cast<size_t>(channels) * bit_depth / 8;
+		const double quantum = this->quantum(bit_depth);
+		const double rounding = this->rounding(bit_depth);
+
+		for (size_t p = 0; p < num_pixels; ++p)
+		{
+			const float* px = rgb + 3 * p;
+			const int32_t q[3] = { quantize(px[0], quantum, rounding), quantize(px[1], quantum, rounding), quantize(px[2], quantum, rounding) };
+			store(q, bit_depth, channels, out + p * pixel_bytes);
+		}
+	}
+
+	// map() with the pixels split over the threads of 'grid'
+	std::vector<unsigned char> map(ThreadGrid& grid, const double* raw, size_t num_pixels, int bit_depth, int channels) const
+	{
+		const size_t pixel_bytes = static_cast<size_t>(channels) * bit_depth / 8;
+		std::vector<unsigned char> out(num_pixels * pixel_bytes);
+
+		grid.GridRun(
+			[&](int thread_idx, int num_threads)
+			{
+				const size_t p0 = num_pixels * thread_idx / num_threads;
+				const size_t p1 = num_pixels * (thread_idx + 1) / num_threads;
+				map(raw + p0 * num_colors, p1 - p0, bit_depth, channels, out.data() + p0 * pixel_bytes);
+			});
+
+		return out;
+	}
+};
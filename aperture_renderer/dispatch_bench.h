@@ -0,0 +1,199 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "ThreadGrid.h"
+
+//
+// Microbenchmark of the ThreadGrid dispatch: the round trip of a run with an (almost) empty task, against the
+// previous implementation (kept below as it was: a std::function copied per thread under a mutex, two condition
+// variables), for GridRun() back to back and for GridStart() queueing the next run while one drains.
+//
+
+class LegacyThreadGrid
+{
+    int numThreads;
+
+    std::vector<std::thread> threads;
+    std::vector<std::mutex> threadIsActive;
+
+    std::atomic_bool terminate{ false };
+
+    std::function<void(int, int)> task;
+    std::mutex taskLock;
+    std::vector<bool> hasTask;
+    int numActiveThreads;
+    std::condition_variable taskAwailableCond;
+    std::condition_variable taskDoneCond;
+
+public:
+    LegacyThreadGrid(int n)
+        : numThreads(n)
+        , threads(n)
+        , threadIsActive(n)
+        , hasTask(n)
+		, numActiveThreads{0}
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            threads[i] = std::thread(&LegacyThreadGrid::Thread, this, i);
+        }
+    }
+
+    ~LegacyThreadGrid()
+    {
+        terminate = true;
+        {
+            std::lock_guard<std::mutex> m(taskLock);
+            taskAwailableCond.notify_all();
+        }
+
+        for (auto& thread : threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    int NumThreads() const noexcept
+    {
+        return numThreads;
+    }
+
+    void GridRun(std::function<void(int, int)>&& item) noexcept
+    {
+		try 
+		{
+			std::unique_lock<std::mutex> m(taskLock);
+
+			std::fill(std::begin(hasTask), std::end(hasTask), true);
+			numActiveThreads = numThreads;
+
+			task = std::move(item);
+
+			// this will wake waiting threads, but only when we unlcok the taskLock -
+			// i.e. when we do wait ourselves below
+			taskAwailableCond.notify_all();
+
+			// Wait for the theads to finish
+			taskDoneCond.wait(m, [&] {return numActiveThreads == 0; });
+
+			// Finally - ensure we clean up the task closure
+			task = std::function<void(int, int)>();
+		}
+		catch (...)
+		{
+			std::cerr << "unhandled exception in GridRun" << std::endl;
+			std::terminate();
+		}
+    }
+
+private:
+    void Thread(int threadIdx)
+    {
+        _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+        _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+        while (!terminate)
+        {
+            std::function<void(int, int)> item;
+
+            {
+                std::unique_lock<std::mutex> m(taskLock);
+                taskAwailableCond.wait(m, [&] {return hasTask[threadIdx] || terminate; });
+                if (!hasTask[threadIdx])
+                    continue;
+                item = task;
+            }
+
+            // we have the task - run it
+            item(threadIdx, numThreads);
+
+            // Mark ourselves as done, and if we are the last thread - notify the waitinig "GridRun"
+            std::unique_lock<std::mutex> m(taskLock);
+            hasTask[threadIdx] = false;
+            if (--numActiveThreads == 0)
+                taskDoneCond.notify_all();
+        }
+    }
+};
+
+
+namespace dispatch_bench
+{
+	// microseconds per run of 'run' (which does 'runs' of them), best of 'repeats'
+	template <typename TRun>
+	double time_runs(int runs, int repeats, TRun&& run)
+	{
+		double best = 1e30;
+		for (int r = 0; r < repeats; ++r)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			run(runs);
+			const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+			best = std::min(best, us / runs);
+		}
+		return best;
+	}
+
+	// Returns false if a run was lost on the way (the counts do not add up)
+	inline bool run(int num_threads, int runs, std::ostream& os)
+	{
+		constexpr int repeats = 5;
+
+		std::atomic<int64_t> count{ 0 };
+		auto task = [&](int, int) { count.fetch_add(1, std::memory_order_relaxed); };
+
+		double legacy_us;
+		{
+			LegacyThreadGrid grid{ num_threads };
+			legacy_us = time_runs(runs, repeats,
+				[&](int n)
+				{
+					for (int i = 0; i < n; ++i)
+						grid.GridRun(task);
+				});
+		}
+
+		double run_us;
+		double queued_us;
+		{
+			ThreadGrid grid{ num_threads };
+			run_us = time_runs(runs, repeats,
+				[&](int n)
+				{
+					for (int i = 0; i < n; ++i)
+						grid.GridRun(task);
+				});
+
+			queued_us = time_runs(runs, repeats,
+				[&](int n)
+				{
+					for (int i = 0; i < n; ++i)
+						grid.GridStart(task);
+					grid.GridWait();
+				});
+		}
+
+		os << num_threads << " threads, " << runs << " runs, best of " << repeats << ":" << std::endl;
+		os << "  previous GridRun:  " << legacy_us << " us per run" << std::endl;
+		os << "  GridRun:           " << run_us << " us per run (" << legacy_us / run_us << "x)" << std::endl;
+		os << "  GridStart queued:  " << queued_us << " us per run (" << legacy_us / queued_us << "x)" << std::endl;
+
+		const int64_t expected = int64_t{ 3 } * repeats * runs * num_threads;
+		if (count != expected)
+		{
+			std::cerr << "lost runs: " << count << " task calls of " << expected << std::endl;
+			return false;
+		}
+		return true;
+	}
+}
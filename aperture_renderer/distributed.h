@@ -0,0 +1,543 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+
+#include "net.h"
+#include "output_grid.h"
+#include "tile_scheduler.h"
+#include "checkpoint.h"
+#include "cancellation.h"
+
+//
+// Rendering on several machines, with a work queue: the coordinator (--serve) loads the aperture and hands out the
+// output tiles to the worker processes (--worker) that connect to it, at any time during the render; each worker
+// renders them on its threads as usual and sends the raw values back. Tiles a worker does not return within the
+// timeout, or that were with a worker that disconnected, go back to the queue for the next one to ask - whichever
+// copy comes back first is taken.
+//
+// The protocol: messages of a message_header followed by 'size' bytes of payload, in the byte order of the host.
+//
+//	worker		hello	{ uint32_t version; int32_t threads; }
+//	coordinator	job		{ checkpoint_header; uint64_t input size; input (RGBA); uint64_t mask size; mask; } (see render_job)
+//	worker		request	{ int32_t max_tiles; }
+//	coordinator	tiles	{ int32_t u0, v0, u1, v1; } [n]
+//				wait	{ uint32_t milliseconds; }	- everything is handed out, but not all is back yet
+//				done	{}
+//	worker		result	{ int32_t u0, v0, u1, v1; uint32_t n; { int32_t u, v; pixel images[4]; } [n] }, per tile
+//
+// There is no authentication: the coordinator takes nothing bigger than a hello before the hello, and nothing bigger
+// than the result of its largest tile after, so a peer that is not a worker cannot make it allocate much.
+//
+
+constexpr uint32_t PROTOCOL_VERSION = 1;
+constexpr uint64_t MAX_MESSAGE_SIZE = uint64_t{ 1 } << 32;
+constexpr uint64_t HELLO_SIZE = sizeof(uint32_t) + sizeof(int32_t);
+
+enum class message : uint32_t
+{
+	hello = 1,
+	job,
+	request,
+	tiles,
+	wait,
+	done,
+	result,
+};
+
+struct message_header
+{
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+inline bool send_message(net::connection& c, message type, const void* payload, size_t size)
+{
+	const message_header hdr{ static_cast<uint32_t>(type), 0, size };
+	return c.send_all(&hdr, sizeof(hdr)) && (size == 0 || c.send_all(payload, size));
+}
+
+inline bool send_message(net::connection& c, message type, const std::vector<char>& payload)
+{
+	return send_message(c, type, payload.data(), payload.size());
+}
+
+// false on a payload over 'max_size' bytes too, before any of it is allocated
+inline bool recv_message(net::connection& c, message& type, std::vector<char>& payload, uint64_t max_size = MAX_MESSAGE_SIZE)
+{
+	message_header hdr;
+	if (!c.recv_all(&hdr, sizeof(hdr)) || hdr.size > max_size)
+		return false;
+
+	type = static_cast<message>(hdr.type);
+	payload.resize(hdr.size);
+	return hdr.size == 0 || c.recv_all(payload.data(), payload.size());
+}
+
+// Reading the fields of a payload one after the other
+class payload_reader
+{
+	const std::vector<char>& payload;
+	size_t offs{ 0 };
+
+public:
+	explicit payload_reader(const std::vector<char>& payload)
+		: payload(payload)
+	{
+	}
+
+	bool read(void* data, size_t size)
+	{
+		if (size > payload.size() - offs)
+			return false;
+		std::memcpy(data, payload.data() + offs, size);
+		offs += size;
+		return true;
+	}
+
+	template <typename T>
+	bool read(T& value)
+	{
+		return read(&value, sizeof(value));
+	}
+
+	const char* current() const
+	{
+		return payload.data() + offs;
+	}
+
+	size_t remaining() const
+	{
+		return payload.size() - offs;
+	}
+};
+
+inline void append(std::vector<char>& payload, const void* data, size_t size)
+{
+	const auto* p = static_cast<const char*>(data);
+	payload.insert(payload.end(), p, p + size);
+}
+
+// What the coordinator sends every worker: the parameters and the grid (as in a checkpoint), the input image,
+// and the mask of the pixels to render (see output_grid::mask; empty - all of them)
+struct render_job
+{
+	checkpoint_header hdr;
+	std::vector<unsigned char> input;
+	std::vector<uint8_t> mask;
+
+	std::vector<char> encode() const
+	{
+		std::vector<char> ret;
+		append(ret, &hdr, sizeof(hdr));
+
+		const uint64_t input_size = input.size();
+		append(ret, &input_size, sizeof(input_size));
+		append(ret, input.data(), input.size());
+
+		const uint64_t mask_size = mask.size();
+		append(ret, &mask_size, sizeof(mask_size));
+		append(ret, mask.data(), mask.size());
+		return ret;
+	}
+
+	bool decode(const std::vector<char>& payload)
+	{
+		payload_reader r(payload);
+
+		uint64_t input_size;
+		if (!r.read(hdr) || !r.read(input_size) || input_size > r.remaining())
+			return false;
+		input.resize(input_size);
+		r.read(input.data(), input.size());
+
+		uint64_t mask_size;
+		if (!r.read(mask_size) || mask_size > r.remaining())
+			return false;
+		mask.resize(mask_size);
+		r.read(mask.data(), mask.size());
+
+		return std::memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) == 0 && hdr.version == CHECKPOINT_VERSION
+			&& input.size() == static_cast<size_t>(hdr.input_width) * hdr.input_height * 4
+			&& (mask.empty() || mask.size() == static_cast<size_t>(hdr.width) * hdr.height);
+	}
+};
+
+//
+// The coordinator's side: serves the tiles of 'g' to the workers until all of them are back in 'out'.
+//
+template <typename TRaw>
+class tile_coordinator
+{
+	using pixel = typename TRaw::value_type;
+
+	struct tile_state
+	{
+		tile t;
+		int worker{ -1 };	// it is with, -1 - in the queue (or done)
+		bool done{ false };
+		std::chrono::steady_clock::time_point handed_out;
+	};
+
+	struct worker_state
+	{
+		std::string peer;
+		int threads{ 0 };
+		size_t tiles{ 0 };
+		size_t late{ 0 };		// tiles that were done by someone else by the time they came back
+		size_t lost{ 0 };		// tiles taken back, on a timeout or a disconnect
+		std::unique_ptr<net::connection> conn;
+		std::mutex send_lock;
+		std::thread handler;
+	};
+
+	static constexpr double FinishGrace = 5.0;	// seconds for the workers to take the 'done' and leave
+	static constexpr size_t ResultEntrySize = 2 * sizeof(int32_t) + 4 * sizeof(pixel);	// a pixel of a result
+
+	const output_grid& g;
+	TRaw& out;
+	std::vector<char> job;
+	double timeout;
+	uint64_t max_result_size{ 0 };	// of the largest tile, the largest message a worker has to send
+
+	std::mutex lock;
+	std::vector<tile_state> tiles;
+	std::map<std::pair<int, int>, size_t> tile_at;	// (u0, v0) -> index
+	std::deque<size_t> queue;
+	std::vector<std::unique_ptr<worker_state>> workers;
+	std::atomic_size_t num_done{ 0 };
+	std::atomic_int num_connected{ 0 };
+
+public:
+	std::function<void(const tile&)> tile_done;	// called once a tile is in 'out', e.g. for a checkpoint_writer
+	std::function<void(size_t, size_t)> progress;	// (tiles done, of)
+
+	// 'g' is the grid to render (the pixels of 'job.mask'), 'timeout' seconds for a worker to return a tile
+	tile_coordinator(const output_grid& g, TRaw& out, const render_job& job, double timeout)
+		: g(g), out(out), job(job.encode()), timeout(timeout)
+	{
+		// as many tiles as would keep 64 threads busy, the workers take as many as they have threads
+		auto all = tile_scheduler::make_tiles(g, 64);
+		std::stable_sort(all.begin(), all.end(), [](const tile& a, const tile& b) { return a.cost > b.cost; });
+
+		for (const auto& t : all)
+		{
+			tile_at[{ t.u0, t.v0 }] = tiles.size();
+			queue.push_back(tiles.size());
+			tiles.push_back({ t, -1, false, {} });
+
+			const uint64_t count = static_cast<uint64_t>(t.u1 - t.u0) * (t.v1 - t.v0);
+			max_result_size = std::max(max_result_size, 4 * sizeof(int32_t) + sizeof(uint32_t) + count * ResultEntrySize);
+		}
+	}
+
+	// Serves the tiles on 'port' of the interface of 'host' (all of them if empty) until all are done (true), or
+	// 'cancel' is stopped
+	bool serve(const std::string& host, int port, const cancel_token* cancel)
+	{
+		const std::string where = (host.empty() ? "port " : host + " port ") + std::to_string(port);
+
+		net::socket_t listener = net::listen_on(host, port);
+		if (listener == net::invalid_socket)
+		{
+			std::cerr << "Failed to listen on " << where << std::endl;
+			return false;
+		}
+
+		std::cout << "serving " << tiles.size() << " tiles on " << where << ", waiting for workers" << std::endl;
+
+		while (num_done < tiles.size() && !(cancel != nullptr && cancel->stop_requested()))
+		{
+			std::string peer;
+			auto c = net::accept_within(listener, 200, &peer);
+			if (c.is_open())
+			{
+				std::lock_guard<std::mutex> l(lock);
+
+				auto w = std::make_unique<worker_state>();
+				w->peer = peer;
+				w->conn = std::make_unique<net::connection>(std::move(c));
+				++num_connected;
+				w->handler = std::thread(&tile_coordinator::handle, this, static_cast<int>(workers.size()), w.get());
+				workers.push_back(std::move(w));
+			}
+
+			take_back_timed_out();
+
+			if (progress)
+				progress(num_done, tiles.size());
+		}
+
+		net::close_socket(listener);
+
+		// tell the workers to leave, those that are still at a tile (taken back from someone else, or the render
+		// was stopped) have a few seconds to see it
+		{
+			std::lock_guard<std::mutex> l(lock);
+			for (auto& w : workers)
+			{
+				std::lock_guard<std::mutex> s(w->send_lock);
+				send_message(*w->conn, message::done, nullptr, 0);
+				w->conn->finish_sending();
+			}
+		}
+
+		const auto finish_start = std::chrono::steady_clock::now();
+		while (num_connected > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - finish_start).count() < FinishGrace)
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+		{
+			std::lock_guard<std::mutex> l(lock);
+			for (auto& w : workers)
+				w->conn->shutdown();
+		}
+		for (auto& w : workers)
+			w->handler.join();
+
+		if (progress)
+			progress(num_done, tiles.size());
+		std::cout << std::endl;
+
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			const auto& w = *workers[i];
+			std::cout << "worker " << i << " (" << w.peer << ", " << w.threads << " threads): " << w.tiles << " tiles, "
+				<< w.late << " late, " << w.lost << " taken back" << std::endl;
+		}
+
+		return num_done == tiles.size();
+	}
+
+private:
+	void handle(int id, worker_state* w)
+	{
+		auto& c = *w->conn;
+		message type;
+		std::vector<char> payload;
+
+		uint32_t version = 0;
+		int32_t threads = 0;
+		payload_reader hello(payload);
+		if (!recv_message(c, type, payload, HELLO_SIZE) || type != message::hello || !hello.read(version) || !hello.read(threads)
+			|| version != PROTOCOL_VERSION)
+		{
+			std::cerr << std::endl << w->peer << " is not a worker (of this version)" << std::endl;
+			c.shutdown();
+			--num_connected;
+			return;
+		}
+
+		w->threads = threads;
+		std::cout << std::endl << "worker " << id << " joined: " << w->peer << ", " << threads << " threads" << std::endl;
+
+		bool ok;
+		{
+			std::lock_guard<std::mutex> s(w->send_lock);
+			ok = send_message(c, message::job, job);
+		}
+
+		while (ok && recv_message(c, type, payload, std::max<uint64_t>(max_result_size, sizeof(int32_t))))
+		{
+			if (type == message::request)
+			{
+				int32_t max_tiles = 0;
+				payload_reader r(payload);
+				ok = r.read(max_tiles) && reply_to_request(*w, id, std::max(1, max_tiles));
+			}
+			else if (type == message::result)
+			{
+				ok = take_result(payload, *w);
+				if (!ok)
+					std::cerr << std::endl << w->peer << " sent a malformed tile" << std::endl;
+			}
+			else
+			{
+				ok = false;
+			}
+		}
+
+		--num_connected;
+
+		// whatever it had goes to the others
+		std::lock_guard<std::mutex> l(lock);
+		size_t taken_back = 0;
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			if (tiles[i].worker == id && !tiles[i].done)
+			{
+				tiles[i].worker = -1;
+				queue.push_front(i);
+				++taken_back;
+			}
+		}
+		w->lost += taken_back;
+
+		if (num_done < tiles.size())
+		{
+			std::cout << std::endl << "worker " << id << " (" << w->peer << ") left, " << taken_back << " of its tiles back in the queue" << std::endl;
+		}
+	}
+
+	bool reply_to_request(worker_state& w, int id, int max_tiles)
+	{
+		std::vector<char> reply;
+		message type = message::tiles;
+
+		{
+			std::lock_guard<std::mutex> l(lock);
+
+			const auto now = std::chrono::steady_clock::now();
+			while (!queue.empty() && static_cast<int>(reply.size() / (4 * sizeof(int32_t))) < max_tiles)
+			{
+				auto& s = tiles[queue.front()];
+				queue.pop_front();
+
+				// came back from someone else meanwhile
+				if (s.done)
+					continue;
+
+				s.worker = id;
+				s.handed_out = now;
+
+				const int32_t rect[4] = { s.t.u0, s.t.v0, s.t.u1, s.t.v1 };
+				append(reply, rect, sizeof(rect));
+			}
+
+			if (reply.empty())
+			{
+				if (num_done == tiles.size())
+				{
+					type = message::done;
+				}
+				else
+				{
+					type = message::wait;
+					const uint32_t ms = 500;
+					append(reply, &ms, sizeof(ms));
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> s(w.send_lock);
+		return send_message(*w.conn, type, reply);
+	}
+
+	bool take_result(const std::vector<char>& payload, worker_state& w)
+	{
+		payload_reader r(payload);
+
+		int32_t rect[4];
+		uint32_t count;
+		if (!r.read(rect) || !r.read(count))
+			return false;
+
+		const size_t entry_size = ResultEntrySize;
+		if (r.remaining() != count * entry_size)
+			return false;
+
+		const auto it = tile_at.find({ rect[0], rect[1] });
+		if (it == tile_at.end())
+			return false;
+
+		auto& s = tiles[it->second];
+		if (s.t.u1 != rect[2] || s.t.v1 != rect[3])
+			return false;
+
+		// the first copy to come back is it
+		{
+			std::lock_guard<std::mutex> l(lock);
+			if (s.done)
+			{
+				++w.late;
+				return true;
+			}
+			s.done = true;
+			s.worker = -1;
+			++w.tiles;
+		}
+
+		const char* p = r.current();
+		for (uint32_t i = 0; i < count; ++i, p += entry_size)
+		{
+			int32_t uv[2];
+			std::memcpy(uv, p, sizeof(uv));
+			if (uv[0] < s.t.u0 || uv[0] >= s.t.u1 || uv[1] < s.t.v0 || uv[1] >= s.t.v1)
+				continue;
+
+			for (int m = 0; m < 4; ++m)
+			{
+				if (g.has_image(uv[0], uv[1], m))
+					std::memcpy(&out[g.image_offs(uv[0], uv[1], m)], p + sizeof(uv) + m * sizeof(pixel), sizeof(pixel));
+			}
+		}
+
+		if (tile_done)
+			tile_done(s.t);
+
+		++num_done;
+		return true;
+	}
+
+	void take_back_timed_out()
+	{
+		std::lock_guard<std::mutex> l(lock);
+
+		const auto now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			auto& s = tiles[i];
+			if (s.done || s.worker < 0 || std::chrono::duration<double>(now - s.handed_out).count() < timeout)
+				continue;
+
+			std::cout << std::endl << "tile (" << s.t.u0 << ", " << s.t.v0 << ") timed out at worker " << s.worker
+				<< " (" << workers[s.worker]->peer << "), back in the queue" << std::endl;
+
+			++workers[s.worker]->lost;
+			s.worker = -1;
+			queue.push_front(i);
+		}
+	}
+};
+
+// The worker's side of a result: the pixels of 't' (rendered into 'pixels', 4 images per representative pixel
+// of the tile that 'g' wants, in order)
+template <typename TPixel>
+std::vector<char> encode_tile_result(const output_grid& g, const tile& t, const std::vector<TPixel>& pixels)
+{
+	std::vector<char> ret;
+
+	const int32_t rect[4] = { t.u0, t.v0, t.u1, t.v1 };
+	append(ret, rect, sizeof(rect));
+
+	const uint32_t count = static_cast<uint32_t>(pixels.size() / 4);
+	append(ret, &count, sizeof(count));
+
+	size_t i = 0;
+	for (int v = t.v0; v < t.v1; ++v)
+	{
+		for (int u = t.u0; u < t.u1; ++u)
+		{
+			if (!g.wanted(u, v))
+				continue;
+
+			const int32_t uv[2] = { u, v };
+			append(ret, uv, sizeof(uv));
+			append(ret, &pixels[i], 4 * sizeof(TPixel));
+			i += 4;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <array>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//
+// Binary 'cube' file with the complex field (a, b) per wavelength per output pixel, i.e. the
+// values diff_field() produces before they are squared into the intensity.
+//
+// Layout (little endian, as written by the host):
+//
+//	field_cube_header
+//	float lambdas[num_colors]
+//	double field[height][width][num_colors][2]	(a, b pairs)
+//	double mask[height][width]			(only if FIELD_CUBE_HAS_MASK is set)
+//
+// The mask is the intensity_mask the field was computed from; it is what allows the incremental
+// re-render to only sum over the pixels that changed since.
+//
+
+constexpr char FIELD_CUBE_MAGIC[8] = { 'A', 'P', 'R', 'F', 'C', 'U', 'B', 'E' };
+constexpr uint32_t FIELD_CUBE_VERSION = 1;
+
+constexpr uint32_t FIELD_CUBE_HAS_MASK = 1;
+constexpr uint32_t FIELD_CUBE_SKIP_R_SQUARE = 2;
+
+struct field_cube_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_colors;
+	int32_t width;
+	int32_t height;
+	float R;
+	float lambda;
+	float clr_step;
+	float unfocus_factor;
+	double total_light_per_pixel;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+template <typename TAperture>
+field_cube_header make_field_cube_header(const TAperture& ap, bool with_mask)
+{
+	field_cube_header hdr{};
+	std::memcpy(hdr.magic, FIELD_CUBE_MAGIC, sizeof(hdr.magic));
+	hdr.version = FIELD_CUBE_VERSION;
+	hdr.num_colors = static_cast<uint32_t>(ap.lambda_profiles.size());
+	hdr.width = ap.width;
+	hdr.height = ap.height;
+	hdr.R = static_cast<float>(ap.R);
+	hdr.lambda = ap.lambda;
+	hdr.clr_step = ap.clr_step;
+	hdr.unfocus_factor = static_cast<float>(ap.unfocus_factor);
+	hdr.total_light_per_pixel = static_cast<double>(ap.total_light_per_pixel);
+	hdr.flags = (with_mask ? FIELD_CUBE_HAS_MASK : 0) | (TAperture::skips_r_square ? FIELD_CUBE_SKIP_R_SQUARE : 0);
+	return hdr;
+}
+
+// true if a field computed with 'a' can be reused (or incrementally updated) for 'b'
+inline bool field_cube_compatible(const field_cube_header& a, const field_cube_header& b)
+{
+	return a.num_colors == b.num_colors
+		&& a.width == b.width
+		&& a.height == b.height
+		&& a.R == b.R
+		&& a.lambda == b.lambda
+		&& a.clr_step == b.clr_step
+		&& a.unfocus_factor == b.unfocus_factor
+		&& (a.flags & FIELD_CUBE_SKIP_R_SQUARE) == (b.flags & FIELD_CUBE_SKIP_R_SQUARE);
+}
+
+// 'field' is width * height * num_colors complex values, pixel-major; 'mask' (optional) is width * height
+inline bool write_field_cube(const std::string& path, const field_cube_header& hdr, const std::vector<float>& lambdas,
+	const std::complex<double>* field, const double* mask)
+{
+	std::ofstream f(path, std::ios::binary | std::ios::trunc);
+	if (!f)
+	{
+		std::cerr << "Failed to open " << path << " for writing" << std::endl;
+		return false;
+	}
+
+	field_cube_header h = hdr;
+	h.flags = (hdr.flags & ~FIELD_CUBE_HAS_MASK) | (mask != nullptr ? FIELD_CUBE_HAS_MASK : 0);
+
+	const size_t num_pixels = static_cast<size_t>(hdr.width) * hdr.height;
+
+	f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	f.write(reinterpret_cast<const char*>(lambdas.data()), lambdas.size() * sizeof(float));
+	f.write(reinterpret_cast<const char*>(field), num_pixels * hdr.num_colors * sizeof(std::complex<double>));
+
+	if (mask != nullptr)
+		f.write(reinterpret_cast<const char*>(mask), num_pixels * sizeof(double));
+
+	if (!f)
+	{
+		std::cerr << "Failed to write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+template <typename TFieldPixel>
+bool write_field_cube(const std::string& path, const field_cube_header& hdr, const std::vector<float>& lambdas,
+	const std::vector<TFieldPixel>& field, const std::vector<double>* mask)
+{
+	static_assert(sizeof(TFieldPixel) == std::tuple_size<TFieldPixel>::value * sizeof(std::complex<double>), 
+		"field cubes are stored as complex<double>");
+
+	return write_field_cube(path, hdr, lambdas, field.data()->data(), mask != nullptr ? mask->data() : nullptr);
+}
+
+inline bool read_field_cube_header(std::ifstream& f, const std::string& path, field_cube_header& hdr, std::vector<float>& lambdas)
+{
+	f.read(reinterpret_cast<char*>(&hdr), sizeof(hdr));
+	if (!f || std::memcmp(hdr.magic, FIELD_CUBE_MAGIC, sizeof(hdr.magic)) != 0)
+	{
+		std::cerr << path << " is not a field cube file" << std::endl;
+		return false;
+	}
+	if (hdr.version != FIELD_CUBE_VERSION)
+	{
+		std::cerr << path << ": unsupported field cube version " << hdr.version << std::endl;
+		return false;
+	}
+
+	// the sizes against that of the file, before anything is allocated from them
+	f.seekg(0, std::ios::end);
+	const uint64_t bytes = static_cast<uint64_t>(f.tellg()) - sizeof(hdr);
+	f.seekg(sizeof(hdr));
+
+	const uint64_t pixel_bytes = hdr.num_colors * sizeof(std::complex<double>) + (hdr.flags & FIELD_CUBE_HAS_MASK ? sizeof(double) : 0);
+	if (hdr.width <= 0 || hdr.height <= 0 || hdr.num_colors == 0 || hdr.num_colors > bytes / sizeof(float)
+		|| static_cast<uint64_t>(hdr.width) * hdr.height > (bytes - hdr.num_colors * sizeof(float)) / pixel_bytes)
+	{
+		std::cerr << path << " is truncated" << std::endl;
+		return false;
+	}
+
+	lambdas.resize(hdr.num_colors);
+	f.read(reinterpret_cast<char*>(lambdas.data()), lambdas.size() * sizeof(float));
+	return static_cast<bool>(f);
+}
+
+// Reads the field (and the mask, if it is requested and present) following the header
+inline bool read_field_cube_data(std::ifstream& f, const std::string& path, const field_cube_header& hdr,
+	std::complex<double>* field, std::vector<double>* mask)
+{
+	const size_t num_pixels = static_cast<size_t>(hdr.width) * hdr.height;
+
+	f.read(reinterpret_cast<char*>(field), num_pixels * hdr.num_colors * sizeof(std::complex<double>));
+
+	if (mask != nullptr)
+	{
+		mask->clear();
+		if (hdr.flags & FIELD_CUBE_HAS_MASK)
+		{
+			mask->resize(num_pixels);
+			f.read(reinterpret_cast<char*>(mask->data()), mask->size() * sizeof(double));
+		}
+	}
+
+	if (!f)
+	{
+		std::cerr << path << " is truncated" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Reads a cube with any number of colours into a flat width * height * num_colors vector
+inline bool read_field_cube(const std::string& path, field_cube_header& hdr, std::vector<float>& lambdas,
+	std::vector<std::complex<double>>& field, std::vector<double>* mask)
+{
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	if (!read_field_cube_header(f, path, hdr, lambdas))
+		return false;
+
+	field.resize(static_cast<size_t>(hdr.width) * hdr.height * hdr.num_colors);
+	return read_field_cube_data(f, path, hdr, field.data(), mask);
+}
+
+// Reads the field into an aperture::field, which must have a matching number of colours
+template <typename TFieldPixel>
+bool read_field_cube(const std::string& path, field_cube_header& hdr, std::vector<float>& lambdas,
+	std::vector<TFieldPixel>& field, std::vector<double>* mask)
+{
+	static_assert(sizeof(TFieldPixel) == std::tuple_size<TFieldPixel>::value * sizeof(std::complex<double>),
+		"field cubes are stored as complex<double>");
+
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	if (!read_field_cube_header(f, path, hdr, lambdas))
+		return false;
+
+	if (hdr.num_colors != std::tuple_size<TFieldPixel>::value)
+	{
+		std::cerr << path << " has " << hdr.num_colors << " colours, expected " << std::tuple_size<TFieldPixel>::value << std::endl;
+		return false;
+	}
+
+	field.resize(static_cast<size_t>(hdr.width) * hdr.height);
+	return read_field_cube_data(f, path, hdr, field.data()->data(), mask);
+}
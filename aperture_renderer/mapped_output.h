@@ -0,0 +1,190 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdlib>
+#endif
+
+//
+// Out-of-core output buffers (--max-memory): the output buffers (aperture::raw, the RGB of a plain render) that are
+// bigger than the threshold are mapped from a temporary file instead of taken from the heap - a sparse file, so they
+// start zeroed and cost nothing until written. The pages are the file's: the system writes them back and drops them
+// under memory pressure, and evict() drops those of the rows that are done for good (encoded into the PNG already),
+// so what stays resident is the rows in flight rather than the image. Indices into them are size_t throughout.
+//
+namespace mapped_output
+{
+	namespace detail
+	{
+		struct mapping
+		{
+			size_t bytes;
+#ifdef _WIN32
+			HANDLE file;
+			HANDLE section;
+#endif
+		};
+
+		inline std::atomic<size_t> threshold{ SIZE_MAX };
+		inline std::string directory;	// of the temporary files, set before the first one
+		inline std::mutex lock;
+		inline std::map<uintptr_t, mapping> mappings;	// by the start address
+
+		inline size_t page_size()
+		{
+#ifdef _WIN32
+			static const size_t size = []()
+			{
+				SYSTEM_INFO info;
+				::GetSystemInfo(&info);
+				return static_cast<size_t>(info.dwPageSize);
+			}();
+#else
+			static const size_t size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+#endif
+			return size;
+		}
+	}
+
+	// Buffers of more than 'bytes' go to temporary files in 'directory' from now on
+	inline void set_threshold(size_t bytes, const std::string& directory)
+	{
+		std::lock_guard<std::mutex> l(detail::lock);
+		detail::directory = directory.empty() ? "." : directory;
+		detail::threshold = bytes;
+	}
+
+	// A zeroed buffer of 'bytes' mapped from a new temporary file if it is over the threshold, nullptr otherwise
+	// (or if the file cannot be made - the caller takes it from the heap then)
+	inline void* allocate(size_t bytes)
+	{
+		if (bytes <= detail::threshold)
+			return nullptr;
+
+		std::lock_guard<std::mutex> l(detail::lock);
+
+		detail::mapping m{ bytes };
+		void* p = nullptr;
+
+#ifdef _WIN32
+		char path[MAX_PATH];
+		if (::GetTempFileNameA(detail::directory.c_str(), "apr", 0, path) != 0)
+		{
+			m.file = ::CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+			if (m.file != INVALID_HANDLE_VALUE)
+			{
+				// sparse, or the mapping would be backed by zeroes written out up front
+				DWORD returned;
+				::DeviceIoControl(m.file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+
+				m.section = ::CreateFileMappingA(m.file, nullptr, PAGE_READWRITE, static_cast<DWORD>(bytes >> 32),
+					static_cast<DWORD>(bytes), nullptr);
+				if (m.section != nullptr)
+				{
+					p = ::MapViewOfFile(m.section, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+					if (p == nullptr)
+						::CloseHandle(m.section);
+				}
+				if (p == nullptr)
+					::CloseHandle(m.file);
+			}
+		}
+#else
+		std::string path = (std::filesystem::path(detail::directory) / "aperture_output.XXXXXX").string();
+		const int fd = ::mkstemp(path.data());
+		if (fd >= 0)
+		{
+			::unlink(path.c_str());	// gone with the mapping
+			if (::ftruncate(fd, static_cast<off_t>(bytes)) == 0)
+			{
+				p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (p == MAP_FAILED)
+					p = nullptr;
+			}
+			::close(fd);
+		}
+#endif
+
+		if (p == nullptr)
+		{
+			std::cerr << "Failed to map a " << (bytes >> 20) << " MB output file in " << detail::directory << ", keeping it in memory" << std::endl;
+			return nullptr;
+		}
+
+		detail::mappings[reinterpret_cast<uintptr_t>(p)] = m;
+		return p;
+	}
+
+	// Unmaps 'p' if allocate() mapped it, false if it did not
+	inline bool deallocate(void* p)
+	{
+		std::lock_guard<std::mutex> l(detail::lock);
+
+		const auto it = detail::mappings.find(reinterpret_cast<uintptr_t>(p));
+		if (it == detail::mappings.end())
+			return false;
+
+#ifdef _WIN32
+		::UnmapViewOfFile(p);
+		::CloseHandle(it->second.section);
+		::CloseHandle(it->second.file);
+#else
+		::munmap(p, it->second.bytes);
+#endif
+
+		detail::mappings.erase(it);
+		return true;
+	}
+
+	// Is 'p' in a buffer allocate() mapped
+	inline bool is_mapped(const void* p)
+	{
+		std::lock_guard<std::mutex> l(detail::lock);
+
+		const auto a = reinterpret_cast<uintptr_t>(p);
+		auto it = detail::mappings.upper_bound(a);
+		if (it == detail::mappings.begin())
+			return false;
+		--it;
+		return a < it->first + it->second.bytes;
+	}
+
+	// Drops the whole pages of [p, p + bytes) from memory if they are mapped (they are kept in the file, and read
+	// back if they are touched again); nothing for the heap
+	inline void evict(const void* p, size_t bytes)
+	{
+		if (detail::threshold == SIZE_MAX || bytes == 0 || !is_mapped(p))
+			return;
+
+		const size_t page = detail::page_size();
+		const uintptr_t begin = (reinterpret_cast<uintptr_t>(p) + page - 1) / page * page;
+		const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + bytes) / page * page;
+		if (end <= begin)
+			return;
+
+#ifdef _WIN32
+		// not locked, so this takes them out of the working set
+		::VirtualUnlock(reinterpret_cast<void*>(begin), end - begin);
+#else
+		::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+	}
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+//
+// Just enough of TCP for the coordinator / worker mode (see distributed.h): blocking connections that send and
+// receive whole buffers, a listening socket that accepts with a timeout. Winsock and BSD sockets. Local (Unix domain)
+// sockets as well, for the render daemon (see render_daemon.h).
+//
+namespace net
+{
+#ifdef _WIN32
+	using socket_t = SOCKET;
+	constexpr socket_t invalid_socket = INVALID_SOCKET;
+
+	inline void close_socket(socket_t s)
+	{
+		::closesocket(s);
+	}
+
+	inline bool startup()
+	{
+		static const bool ok = []()
+		{
+			WSADATA wsa;
+			return ::WSAStartup(MAKEWORD(2, 2), &wsa) == 0;
+		}();
+		return ok;
+	}
+#else
+	using socket_t = int;
+	constexpr socket_t invalid_socket = -1;
+
+	inline void close_socket(socket_t s)
+	{
+		::close(s);
+	}
+
+	inline bool startup()
+	{
+		return true;
+	}
+#endif
+
+	// A connected socket, closed on destruction
+	class connection
+	{
+		socket_t s{ invalid_socket };
+
+	public:
+		connection() = default;
+
+		explicit connection(socket_t s)
+			: s(s)
+		{
+			// the messages are small and answered right away, no point in delaying them
+			int one = 1;
+			::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+		}
+
+		connection(connection&& other) noexcept
+			: s(other.s)
+		{
+			other.s = invalid_socket;
+		}
+
+		connection& operator=(connection&& other) noexcept
+		{
+			if (this != &other)
+			{
+				close();
+				s = other.s;
+				other.s = invalid_socket;
+			}
+			return *this;
+		}
+
+		connection(const connection&) = delete;
+		connection& operator=(const connection&) = delete;
+
+		~connection()
+		{
+			close();
+		}
+
+		bool is_open() const
+		{
+			return s != invalid_socket;
+		}
+
+		bool send_all(const void* data, size_t size)
+		{
+			const char* p = static_cast<const char*>(data);
+			while (size > 0)
+			{
+				const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+#ifdef _WIN32
+				const int sent = ::send(s, p, chunk, 0);
+#else
+				const auto sent = ::send(s, p, chunk, MSG_NOSIGNAL);
+#endif
+				if (sent <= 0)
+					return false;
+				p += sent;
+				size -= static_cast<size_t>(sent);
+			}
+			return true;
+		}
+
+		bool recv_all(void* data, size_t size)
+		{
+			char* p = static_cast<char*>(data);
+			while (size > 0)
+			{
+				const int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+				const auto received = ::recv(s, p, chunk, 0);
+				if (received <= 0)
+					return false;
+				p += received;
+				size -= static_cast<size_t>(received);
+			}
+			return true;
+		}
+
+		// Receives up to (not including) the next '\n', false once the stream ends first or the line gets too long
+		bool recv_line(std::string& line, size_t max_length = 65536)
+		{
+			line.clear();
+			for (char c; recv_all(&c, 1); )
+			{
+				if (c == '\n')
+					return true;
+				if (line.size() >= max_length)
+					return false;
+				line += c;
+			}
+			return false;
+		}
+
+		// Makes the blocking calls of other threads on the connection fail, without closing it under them
+		void shutdown()
+		{
+			if (s != invalid_socket)
+			{
+#ifdef _WIN32
+				::shutdown(s, SD_BOTH);
+#else
+				::shutdown(s, SHUT_RDWR);
+#endif
+			}
+		}
+
+		// Nothing more is sent, the other side reads the end of the stream once it has what was
+		void finish_sending()
+		{
+			if (s != invalid_socket)
+			{
+#ifdef _WIN32
+				::shutdown(s, SD_SEND);
+#else
+				::shutdown(s, SHUT_WR);
+#endif
+			}
+		}
+
+		void close()
+		{
+			if (s != invalid_socket)
+			{
+				close_socket(s);
+				s = invalid_socket;
+			}
+		}
+	};
+
+	// Listens on 'port' of the interface of 'host' (IPv4 or IPv6), of every IPv4 one if 'host' is empty;
+	// invalid_socket on failure
+	inline socket_t listen_on(const std::string& host, int port)
+	{
+		if (!startup())
+			return invalid_socket;
+
+		addrinfo hints{};
+		hints.ai_family = host.empty() ? AF_INET : AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+		hints.ai_flags = AI_PASSIVE;
+
+		addrinfo* result = nullptr;
+		if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+			return invalid_socket;
+
+		socket_t ret = invalid_socket;
+		for (addrinfo* a = result; a != nullptr && ret == invalid_socket; a = a->ai_next)
+		{
+			socket_t s = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (s == invalid_socket)
+				continue;
+
+			// on Windows SO_REUSEADDR would let another process bind the same port and take the connections
+			int one = 1;
+#ifdef _WIN32
+			::setsockopt(s, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, reinterpret_cast<const char*>(&one), sizeof(one));
+#else
+			::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+#endif
+
+			if (::bind(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0 && ::listen(s, SOMAXCONN) == 0)
+				ret = s;
+			else
+				close_socket(s);
+		}
+
+		::freeaddrinfo(result);
+		return ret;
+	}
+
+	// Listens on the local socket 'path' (a stale socket file left there is removed), invalid_socket on failure
+	inline socket_t listen_local(const std::string& path)
+	{
+		if (!startup())
+			return invalid_socket;
+
+		sockaddr_un addr{};
+		if (path.size() >= sizeof(addr.sun_path))
+			return invalid_socket;
+
+		addr.sun_family = AF_UNIX;
+		std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+		std::error_code ec;
+		if (std::filesystem::is_socket(path, ec))
+			std::filesystem::remove(path, ec);
+
+		socket_t s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == invalid_socket)
+			return invalid_socket;
+
+		if (::bind(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(s, SOMAXCONN) != 0)
+		{
+			close_socket(s);
+			return invalid_socket;
+		}
+		return s;
+	}
+
+	// Connects to the local socket 'path', a connection that is not open on failure
+	inline connection connect_local(const std::string& path)
+	{
+		if (!startup())
+			return connection{};
+
+		sockaddr_un addr{};
+		if (path.size() >= sizeof(addr.sun_path))
+			return connection{};
+
+		addr.sun_family = AF_UNIX;
+		std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+		socket_t s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s == invalid_socket)
+			return connection{};
+
+		if (::connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			close_socket(s);
+			return connection{};
+		}
+		return connection{ s };
+	}
+
+	// The next connection to 'listener', or one that is not open if there was none within 'timeout_ms'
+	inline connection accept_within(socket_t listener, int timeout_ms, std::string* peer = nullptr)
+	{
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(listener, &set);
+
+		timeval tv;
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+		if (::select(static_cast<int>(listener) + 1, &set, nullptr, nullptr, &tv) <= 0)
+			return connection{};
+
+		sockaddr_storage addr{};
+		socklen_t length = sizeof(addr);
+		socket_t s = ::accept(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+		if (s == invalid_socket)
+			return connection{};
+
+		if (peer != nullptr && addr.ss_family == AF_INET)
+		{
+			const auto& in = reinterpret_cast<const sockaddr_in&>(addr);
+			char host[INET_ADDRSTRLEN] = {};
+			::inet_ntop(AF_INET, &in.sin_addr, host, sizeof(host));
+			*peer = std::string(host) + ":" + std::to_string(ntohs(in.sin_port));
+		}
+		else if (peer != nullptr && addr.ss_family == AF_INET6)
+		{
+			const auto& in = reinterpret_cast<const sockaddr_in6&>(addr);
+			char host[INET6_ADDRSTRLEN] = {};
+			::inet_ntop(AF_INET6, &in.sin6_addr, host, sizeof(host));
+			*peer = "[" + std::string(host) + "]:" + std::to_string(ntohs(in.sin6_port));
+		}
+
+		return connection{ s };
+	}
+
+	// Connects to host:port, a connection that is not open on failure
+	inline connection connect_to(const std::string& host, int port)
+	{
+		if (!startup())
+			return connection{};
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		addrinfo* result = nullptr;
+		if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+			return connection{};
+
+		connection ret;
+		for (addrinfo* a = result; a != nullptr && !ret.is_open(); a = a->ai_next)
+		{
+			socket_t s = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (s == invalid_socket)
+				continue;
+
+			if (::connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) == 0)
+				ret = connection{ s };
+			else
+				close_socket(s);
+		}
+
+		::freeaddrinfo(result);
+		return ret;
+	}
+
+	// "host:port" -> host, port; an IPv6 host in brackets, "[::1]:port"
+	inline bool parse_address(const std::string& address, std::string& host, int& port)
+	{
+		const auto colon = address.rfind(':');
+		if (colon == std::string::npos || colon == 0)
+			return false;
+
+		host = address.substr(0, colon);
+		if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+		port = std::atoi(address.c_str() + colon + 1);
+		return port > 0 && port < 65536;
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "ThreadGrid.h"
+#include "output_grid.h"
+#include "platform.h"
+#include "mapped_output.h"
+
+//
+// NUMA placement for a pinned ThreadGrid (see platform::pin_order()). Memory is placed on the node of the thread
+// that first touches it - so the read-only aperture data is copied once per node by a thread of that node, and
+// the output rows are zeroed by the threads of the node whose tiles they are (see band_node()).
+//
+
+// The node the representative row v belongs to: the rows are split in bands, one per node, in proportion to the
+// node's threads. The tile_scheduler deals the tiles the same way, and the mirrored rows go with their representative ones.
+inline int band_node(int v, int rep_height, const ThreadGrid& grid)
+{
+	const int num_threads = grid.NumThreads();
+	const long long slot = static_cast<long long>(v) * num_threads / std::max(1, rep_height);
+
+	long long threads = 0;
+	for (int node = 0; node < grid.NumNodes(); ++node)
+	{
+		for (int i = 0; i < num_threads; ++i)
+		{
+			if (grid.NodeOf(i) == node)
+				++threads;
+		}
+		if (slot < threads)
+			return node;
+	}
+	return grid.NumNodes() - 1;
+}
+
+// A copy of a T per node, made on that node; local() is the one of the calling (pinned) thread
+template <typename T>
+class node_replicas
+{
+	std::vector<std::unique_ptr<T>> replicas;
+
+public:
+	node_replicas(ThreadGrid& grid, const T& original)
+		: replicas(grid.NumNodes())
+	{
+		grid.GridRun(
+			[&](int thread_idx, int)
+			{
+				const int node = grid.NodeOf(thread_idx);
+
+				// the first thread of each node makes its copy
+				for (int i = 0; i < thread_idx; ++i)
+				{
+					if (grid.NodeOf(i) == node)
+						return;
+				}
+
+				replicas[node] = std::make_unique<T>(original);
+			});
+	}
+
+	T& local()
+	{
+		return *replicas[std::min(platform::current_node, static_cast<int>(replicas.size()) - 1)];
+	}
+};
+
+// Zeroes 'out' (of the size of the grid), every row on the node that will render it
+template <typename TRaw>
+void first_touch(ThreadGrid& grid, const output_grid& g, TRaw& out)
+{
+	using pixel = typename TRaw::value_type;
+
+	// a buffer mapped from a file starts zeroed, and touching it would only bring all of it in, see mapped_output.h
+	if (mapped_output::is_mapped(out.data()))
+		return;
+
+	grid.GridRun(
+		[&](int thread_idx, int num_threads)
+		{
+			const int node = grid.NodeOf(thread_idx);
+
+			// this thread's share of its node's threads
+			int index = 0;
+			int count = 0;
+			for (int i = 0; i < num_threads; ++i)
+			{
+				if (grid.NodeOf(i) != node)
+					continue;
+				if (i < thread_idx)
+					++index;
+				++count;
+			}
+
+			for (int y = 0, k = 0; y < g.height; ++y)
+			{
+				// the representative row of y
+				const int v = g.mirror_y && y >= g.rep_height ? g.height - 1 - y : y;
+
+				if (band_node(v, g.rep_height, grid) != node || k++ % count != index)
+					continue;
+
+				std::fill(out.begin() + static_cast<size_t>(y) * g.width, out.begin() + static_cast<size_t>(y + 1) * g.width, pixel{});
+			}
+		});
+}
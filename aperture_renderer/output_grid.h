@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+//
+// The sensor plane points to render: an image of width x height, pixel (u, v) being the point
+// (origin_x + u * pitch, origin_y + v * pitch) in the aperture's pixel coordinates.
+//
+// The aperture is symmetric (z_sqr_values are), so diff_value() at (x, y) also gives the values at the points
+// mirrored around the aperture centre. Whenever the grid is symmetric around the centre in x (or y), only
+// the 'representative' part of it (u < rep_width, v < rep_height) is rendered, and the mirrored images fill the rest.
+// For the default full frame grid that is the top-left quadrant, exactly as before.
+//
+struct output_grid
+{
+	int width;
+	int height;
+
+	double origin_x{ 0.0 };
+	double origin_y{ 0.0 };
+	double pitch{ 1.0 };
+
+	bool mirror_x{ true };
+	bool mirror_y{ true };
+
+	int rep_width;
+	int rep_height;
+
+	// optional, width x height: only the pixels where it is set (or their mirrored images) are rendered
+	std::vector<uint8_t> mask;
+
+	// sensor pixel (x, y) aligned to aperture pixel (x, y), the whole frame
+	static output_grid full(int ap_width, int ap_height)
+	{
+		return roi(ap_width, ap_height, 0.0, 0.0, ap_width, ap_height, 1.0);
+	}
+
+	// the rectangle (x, y, w, h) of the full frame (in the aperture's pixels), 'zoom' output pixels per aperture pixel
+	static output_grid roi(int ap_width, int ap_height, double x, double y, double w, double h, double zoom)
+	{
+		output_grid g;
+		g.width = std::max(1, static_cast<int>(std::lround(w * zoom)));
+		g.height = std::max(1, static_cast<int>(std::lround(h * zoom)));
+		g.pitch = 1.0 / zoom;
+
+		// pixel centres: output pixel u covers [x + u / zoom, x + (u + 1) / zoom) of the full frame
+		g.origin_x = x + 0.5 * g.pitch - 0.5;
+		g.origin_y = y + 0.5 * g.pitch - 0.5;
+
+		const double cx = ap_width / 2.0 - 0.5;
+		const double cy = ap_height / 2.0 - 0.5;
+
+		constexpr double eps = 1e-6;
+		g.mirror_x = std::abs(g.origin_x + (g.width - 1) * g.pitch / 2.0 - cx) < eps;
+		g.mirror_y = std::abs(g.origin_y + (g.height - 1) * g.pitch / 2.0 - cy) < eps;
+
+		g.rep_width = g.mirror_x ? (g.width + 1) / 2 : g.width;
+		g.rep_height = g.mirror_y ? (g.height + 1) / 2 : g.height;
+
+		return g;
+	}
+
+	bool is_full_frame(int ap_width, int ap_height) const
+	{
+		return width == ap_width && height == ap_height && pitch == 1.0
+			&& origin_x == 0.0 && origin_y == 0.0 && mask.empty();
+	}
+
+	size_t num_pixels() const
+	{
+		return static_cast<size_t>(width) * height;
+	}
+
+	double x_at(int u) const
+	{
+		return origin_x + u * pitch;
+	}
+
+	double y_at(int v) const
+	{
+		return origin_y + v * pitch;
+	}
+
+	// Does the mirrored image m (bit 0 - mirrored in x, bit 1 - in y) of the representative pixel (u, v) exist as
+	// a pixel of its own? (It does not for non-symmetric grids, nor for the middle row / column of odd sized ones)
+	bool has_image(int u, int v, int m) const
+	{
+		if ((m & 1) && (!mirror_x || width - u - 1 == u))
+			return false;
+		if ((m & 2) && (!mirror_y || height - v - 1 == v))
+			return false;
+		return true;
+	}
+
+	// Offset of the mirrored image m of (u, v); images that do not exist map to the one they coincide with
+	size_t image_offs(int u, int v, int m) const
+	{
+		int x = (m & 1) && mirror_x ? width - u - 1 : u;
+		int y = (m & 2) && mirror_y ? height - v - 1 : v;
+		return static_cast<size_t>(y) * width + x;
+	}
+
+	// should the representative pixel (u, v) be rendered at all
+	bool wanted(int u, int v) const
+	{
+		if (mask.empty())
+			return true;
+
+		for (int m = 0; m < 4; ++m)
+		{
+			if (has_image(u, v, m) && mask[image_offs(u, v, m)])
+				return true;
+		}
+		return false;
+	}
+};
+
+// Renders the representative pixel (u, v) of the grid into all of its mirrored images
+template <typename TAperture>
+void render_grid_pixel(TAperture& ap, const output_grid& g, typename TAperture::raw& out, int u, int v) noexcept
+{
+	typename TAperture::pixel scratch[4];
+	typename TAperture::pixel* o[4];
+
+	for (int m = 0; m < 4; ++m)
+		o[m] = g.has_image(u, v, m) ? &out[g.image_offs(u, v, m)] : &scratch[m];
+
+	ap.diff_value(g.x_at(u), g.y_at(v), *o[0], *o[1], *o[2], *o[3]);
+}
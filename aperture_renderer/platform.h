@@ -0,0 +1,348 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <tuple>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <filesystem>
+#endif
+
+//
+// What little of the machine the renderer needs to know about: how many processors it may actually use (the
+// affinity mask, and the CPU quota of the container / job object it runs in), the topology of the logical processors
+// (cores, SMT siblings, NUMA nodes), pinning a thread to one of them, its priority and the CPU time it got.
+//
+namespace platform
+{
+	struct cpu
+	{
+		int group;		// processor group (Windows, > 64 logical processors), 0 elsewhere
+		int number;		// within the group
+		int core;		// physical core, numbered from 0
+		int smt_index;	// 0 for the first logical processor of its core, 1 for its SMT sibling, ...
+		int node;		// NUMA node, numbered from 0
+	};
+
+	// the NUMA node the calling thread was pinned to, see pin_current_thread()
+	inline thread_local int current_node = 0;
+
+#ifdef _WIN32
+	// The logical processors the process may run on
+	inline std::vector<cpu> topology()
+	{
+		DWORD length = 0;
+		::GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+
+		std::vector<char> buffer(length);
+		if (!::GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &length))
+			return {};
+
+		std::vector<cpu> ret;
+		std::vector<std::pair<int, GROUP_AFFINITY>> nodes;
+
+		int num_cores = 0;
+		for (DWORD offs = 0; offs < length; )
+		{
+			auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offs);
+
+			if (info->Relationship == RelationProcessorCore)
+			{
+				int smt_index = 0;
+				for (WORD g = 0; g < info->Processor.GroupCount; ++g)
+				{
+					const auto& mask = info->Processor.GroupMask[g];
+					for (int b = 0; b < static_cast<int>(sizeof(KAFFINITY) * 8); ++b)
+					{
+						if (mask.Mask & (KAFFINITY{ 1 } << b))
+							ret.push_back({ mask.Group, b, num_cores, smt_index++, 0 });
+					}
+				}
+				++num_cores;
+			}
+			else if (info->Relationship == RelationNumaNode)
+			{
+				nodes.push_back({ static_cast<int>(info->NumaNode.NodeNumber), info->NumaNode.GroupMask });
+			}
+
+			offs += info->Size;
+		}
+
+		for (auto& c : ret)
+		{
+			for (const auto& n : nodes)
+			{
+				if (n.second.Group == c.group && (n.second.Mask & (KAFFINITY{ 1 } << c.number)))
+					c.node = n.first;
+			}
+		}
+
+		return ret;
+	}
+
+	inline bool pin_current_thread(const cpu& c)
+	{
+		GROUP_AFFINITY affinity{};
+		affinity.Group = static_cast<WORD>(c.group);
+		affinity.Mask = KAFFINITY{ 1 } << c.number;
+
+		if (!::SetThreadGroupAffinity(::GetCurrentThread(), &affinity, nullptr))
+			return false;
+
+		current_node = c.node;
+		return true;
+	}
+
+	// Logical processors of the process affinity mask, capped by the CPU rate limit of the job object (if any)
+	inline int available_cpus(double* quota = nullptr)
+	{
+		int count = static_cast<int>(::GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+
+		DWORD_PTR process_mask;
+		DWORD_PTR system_mask;
+		if (::GetProcessAffinityMask(::GetCurrentProcess(), &process_mask, &system_mask) && process_mask != 0)
+		{
+			// only meaningful within a single processor group
+			int bits = 0;
+			for (DWORD_PTR m = process_mask; m != 0; m &= m - 1)
+				++bits;
+			if (::GetActiveProcessorGroupCount() == 1)
+				count = bits;
+		}
+
+		double limit = 0.0;
+
+		JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate{};
+		if (::QueryInformationJobObject(nullptr, JobObjectCpuRateControlInformation, &rate, sizeof(rate), nullptr)
+			&& (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE) && (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP))
+		{
+			// CpuRate is in 1/100 of a percent of all the processors of the system
+			limit = rate.CpuRate / 10000.0 * ::GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+		}
+
+		if (quota != nullptr)
+			*quota = limit;
+
+		if (limit > 0.0)
+			count = std::min(count, std::max(1, static_cast<int>(std::ceil(limit))));
+		return std::max(1, count);
+	}
+
+	// seconds of CPU time the calling thread got so far
+	inline double thread_cpu_seconds()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!::GetThreadTimes(::GetCurrentThread(), &creation, &exit, &kernel, &user))
+			return 0.0;
+
+		auto seconds = [](const FILETIME& t) { return ((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 1e-7; };
+		return seconds(kernel) + seconds(user);
+	}
+
+	// The calling thread yields to everything else on the machine (CPU, and I/O as well)
+	inline bool set_background_priority()
+	{
+		return ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN) != 0;
+	}
+#else
+	inline int read_int(const std::string& path, int fallback)
+	{
+		std::ifstream f(path);
+		int v;
+		return (f >> v) ? v : fallback;
+	}
+
+	// The logical processors the process may run on (its affinity mask), from /sys
+	inline std::vector<cpu> topology()
+	{
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return {};
+
+		std::map<std::pair<int, int>, int> cores; // (package, core_id) -> core
+		std::vector<cpu> ret;
+
+		for (int n = 0; n < CPU_SETSIZE; ++n)
+		{
+			if (!CPU_ISSET(n, &allowed))
+				continue;
+
+			const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(n);
+			const int package = read_int(dir + "/topology/physical_package_id", 0);
+			const int core_id = read_int(dir + "/topology/core_id", n);
+
+			auto core = cores.emplace(std::make_pair(package, core_id), static_cast<int>(cores.size())).first->second;
+
+			int node = 0;
+			std::error_code ec;
+			for (const auto& entry : std::filesystem::directory_iterator(dir, ec))
+			{
+				const auto name = entry.path().filename().string();
+				if (name.rfind("node", 0) == 0 && name.size() > 4 && std::isdigit(static_cast<unsigned char>(name[4])))
+					node = std::atoi(name.c_str() + 4);
+			}
+
+			int smt_index = 0;
+			for (const auto& c : ret)
+			{
+				if (c.core == core)
+					++smt_index;
+			}
+
+			ret.push_back({ 0, n, core, smt_index, node });
+		}
+
+		return ret;
+	}
+
+	inline bool pin_current_thread(const cpu& c)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(c.number, &set);
+
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			return false;
+
+		current_node = c.node;
+		return true;
+	}
+
+	// The CPU limit of the cgroup the process is in, in processors (quota / period), 0 - none. cgroup v2 (cpu.max of
+	// the group and its parents), or v1 (cpu.cfs_quota_us / cpu.cfs_period_us), under the usual mount points.
+	inline double cgroup_cpu_limit()
+	{
+		std::ifstream f("/proc/self/cgroup");
+		std::string line;
+
+		double limit = 0.0;
+		auto apply = [&](double quota, double period)
+		{
+			if (quota > 0.0 && period > 0.0 && (limit == 0.0 || quota / period < limit))
+				limit = quota / period;
+		};
+
+		while (std::getline(f, line))
+		{
+			// hierarchy-id:controllers:path
+			const auto first = line.find(':');
+			const auto second = line.find(':', first + 1);
+			if (first == std::string::npos || second == std::string::npos)
+				continue;
+
+			const std::string hierarchy = line.substr(0, first);
+			const std::string controllers = line.substr(first + 1, second - first - 1);
+			std::string path = line.substr(second + 1);
+
+			if (hierarchy == "0" && controllers.empty())
+			{
+				for (const char* root : { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" })
+				{
+					// the group and all its parents, each may have a limit of its own
+					for (std::string p = path; ; p = p.substr(0, p.rfind('/')))
+					{
+						std::ifstream max_file(root + (p == "/" ? std::string() : p) + "/cpu.max");
+						std::string quota;
+						double period;
+						if (max_file >> quota >> period && quota != "max")
+							apply(std::atof(quota.c_str()), period);
+
+						if (p.empty() || p == "/")
+							break;
+					}
+				}
+			}
+			else if (("," + controllers + ",").find(",cpu,") != std::string::npos)
+			{
+				for (const char* root : { "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu" })
+				{
+					const std::string dir = root + (path == "/" ? std::string() : path);
+					apply(read_int(dir + "/cpu.cfs_quota_us", -1), read_int(dir + "/cpu.cfs_period_us", 0));
+				}
+			}
+		}
+
+		return limit;
+	}
+
+	// Logical processors of the affinity mask, capped by the cgroup CPU quota (rounded up)
+	inline int available_cpus(double* quota = nullptr)
+	{
+		int count = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+			count = CPU_COUNT(&allowed);
+
+		const double limit = cgroup_cpu_limit();
+		if (quota != nullptr)
+			*quota = limit;
+
+		if (limit > 0.0)
+			count = std::min(count, std::max(1, static_cast<int>(std::ceil(limit))));
+		return std::max(1, count);
+	}
+
+	// seconds of CPU time the calling thread got so far
+	inline double thread_cpu_seconds()
+	{
+		timespec t;
+		if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0)
+			return 0.0;
+		return t.tv_sec + t.tv_nsec * 1e-9;
+	}
+
+	// The calling thread yields to everything else on the machine: nice 19 (per thread on Linux)
+	inline bool set_background_priority()
+	{
+		return setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19) == 0;
+	}
+#endif
+
+	// The processors to pin the threads of a pool to, in order: one per physical core first (spread over the NUMA
+	// nodes node by node), then - with 'smt' - their SMT siblings the same way. The nodes are renumbered densely
+	// from 0, so they can index per-node data.
+	inline std::vector<cpu> pin_order(std::vector<cpu> cpus, bool smt)
+	{
+		if (!smt)
+			cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [](const cpu& c) { return c.smt_index != 0; }), cpus.end());
+
+		std::sort(cpus.begin(), cpus.end(),
+			[](const cpu& a, const cpu& b)
+			{
+				return std::tie(a.smt_index, a.node, a.core, a.group, a.number) < std::tie(b.smt_index, b.node, b.core, b.group, b.number);
+			});
+
+		std::map<int, int> dense;
+		for (const auto& c : cpus)
+			dense.emplace(c.node, 0);
+
+		int i = 0;
+		for (auto& d : dense)
+			d.second = i++;
+
+		for (auto& c : cpus)
+			c.node = dense[c.node];
+
+		return cpus;
+	}
+}
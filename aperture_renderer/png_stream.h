@@ -0,0 +1,894 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+#include "lodepng.h"
+#include "output_grid.h"
+#include "tile_scheduler.h"
+#include "ThreadGrid.h"
+
+//
+// The PNG of a render, written band by band while the render goes on (see png_band_writer).
+//
+// Every band of rows is filtered and deflated on its own, by the thread that finished its last tile, into one
+// dynamic Huffman block of the zlib stream - with an LZ77 window that does not reach back into the previous band.
+// The blocks end at any bit; png_stream joins them in order, with the Adler-32 of the whole put together from those
+// of the bands. A little bigger than what lodepng writes, but there is next to nothing left to do once the last
+// tile is rendered. RGB, 8 or 16 bits per channel.
+//
+
+namespace png_stream_detail
+{
+	// LSB first, as deflate has it
+	struct bit_writer
+	{
+		std::vector<uint8_t> bytes;
+		uint64_t acc{ 0 };
+		int num_bits{ 0 };	// in acc, < 8 between calls
+
+		void put(uint32_t value, int bits)
+		{
+			acc |= static_cast<uint64_t>(value) << num_bits;
+			num_bits += bits;
+			while (num_bits >= 8)
+			{
+				bytes.push_back(static_cast<uint8_t>(acc));
+				acc >>= 8;
+				num_bits -= 8;
+			}
+		}
+
+		// a Huffman code, which deflate packs MSB first
+		void put_code(uint32_t code, int length)
+		{
+			uint32_t reversed = 0;
+			for (int i = 0; i < length; ++i)
+				reversed |= ((code >> i) & 1) << (length - 1 - i);
+			put(reversed, length);
+		}
+
+		void append(const bit_writer& other)
+		{
+			if (num_bits == 0)
+				bytes.insert(bytes.end(), other.bytes.begin(), other.bytes.end());
+			else
+			{
+				for (uint8_t b : other.bytes)
+					put(b, 8);
+			}
+			put(static_cast<uint32_t>(other.acc), other.num_bits);
+		}
+	};
+
+	inline uint32_t adler32(const uint8_t* data, size_t size)
+	{
+		constexpr uint32_t BASE = 65521;
+		constexpr size_t NMAX = 5552;	// the most bytes before the sums have to be reduced
+
+		uint32_t a = 1;
+		uint32_t b = 0;
+		while (size > 0)
+		{
+			const size_t n = std::min(size, NMAX);
+			for (size_t i = 0; i < n; ++i)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= BASE;
+			b %= BASE;
+			data += n;
+			size -= n;
+		}
+		return (b << 16) | a;
+	}
+
+	// The Adler-32 of a + b, from theirs (as zlib's adler32_combine)
+	inline uint32_t adler32_combine(uint32_t adler_a, uint32_t adler_b, size_t size_b)
+	{
+		constexpr uint64_t BASE = 65521;
+
+		const uint64_t rem = size_b % BASE;
+		uint64_t sum1 = adler_a & 0xffff;
+		uint64_t sum2 = (rem * sum1) % BASE;
+		sum1 += (adler_b & 0xffff) + BASE - 1;
+		sum2 += ((adler_a >> 16) & 0xffff) + ((adler_b >> 16) & 0xffff) + BASE - rem;
+
+		if (sum1 >= BASE)
+			sum1 -= BASE;
+		if (sum1 >= BASE)
+			sum1 -= BASE;
+		if (sum2 >= 2 * BASE)
+			sum2 -= 2 * BASE;
+		if (sum2 >= BASE)
+			sum2 -= BASE;
+
+		return static_cast<uint32_t>(sum1 | (sum2 << 16));
+	}
+
+	constexpr int LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	constexpr int LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	constexpr int DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+		4097, 6145, 8193, 12289, 16385, 24577 };
+	constexpr int DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	constexpr int CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	constexpr int WINDOW = 32768;
+	constexpr int HASH_BITS = 15;
+	constexpr int MAX_CHAIN = 32;	// candidates tried per position
+	constexpr int MIN_MATCH = 3;
+	constexpr int MAX_MATCH = 258;
+
+	// a literal (dist 0) or a match
+	struct lz_symbol
+	{
+		uint16_t lit_len;
+		uint16_t dist;
+	};
+
+	inline int length_code(int length)
+	{
+		int i = 28;
+		while (LENGTH_BASE[i] > length)
+			--i;
+		return i;
+	}
+
+	inline int dist_code(int dist)
+	{
+		int i = 29;
+		while (DIST_BASE[i] > dist)
+			--i;
+		return i;
+	}
+
+	// LZ77 over hash chains, with one step of lazy matching: a match is put off for a longer one at the next byte
+	inline std::vector<lz_symbol> lz77(const uint8_t* data, size_t size)
+	{
+		std::vector<lz_symbol> symbols;
+		symbols.reserve(size / 4);
+
+		std::vector<int> head(size_t(1) << HASH_BITS, -1);
+		std::vector<int> prev(WINDOW, -1);
+
+		auto hash = [&](size_t i)
+		{
+			const uint32_t v = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+			return (v * 2654435761u) >> (32 - HASH_BITS);
+		};
+		auto insert = [&](size_t i)
+		{
+			if (i + MIN_MATCH > size)
+				return;
+			const uint32_t h = hash(i);
+			prev[i % WINDOW] = head[h];
+			head[h] = static_cast<int>(i);
+		};
+		// the longest match at i, of at least MIN_MATCH, 0 if there is none
+		auto longest_match = [&](size_t i, int& best_dist)
+		{
+			int best_length = 0;
+			if (i + MIN_MATCH > size)
+				return 0;
+
+			const int max_length = static_cast<int>(std::min<size_t>(MAX_MATCH, size - i));
+			int candidate = head[hash(i)];
+
+			for (int chain = 0; chain < MAX_CHAIN && candidate >= 0 && i - candidate <= WINDOW - 1; ++chain)
+			{
+				const uint8_t* a = data + candidate;
+				const uint8_t* b = data + i;
+				if (a[best_length] == b[best_length])
+				{
+					int length = 0;
+					while (length < max_length && a[length] == b[length])
+						++length;
+
+					if (length > best_length)
+					{
+						best_length = length;
+						best_dist = static_cast<int>(i - candidate);
+						if (length == max_length)
+							break;
+					}
+				}
+
+				const int next = prev[candidate % WINDOW];
+				if (next >= candidate)
+					break;
+				candidate = next;
+			}
+
+			return best_length >= MIN_MATCH ? best_length : 0;
+		};
+
+		int dist = 0;
+		int length = longest_match(0, dist);
+
+		for (size_t i = 0; i < size; )
+		{
+			insert(i);
+
+			int next_dist = 0;
+			const int next_length = length != 0 && length < MAX_MATCH ? longest_match(i + 1, next_dist) : 0;
+
+			if (length == 0 || next_length > length)
+			{
+				symbols.push_back(lz_symbol{ data[i], 0 });
+				++i;
+				if (length != 0)
+				{
+					length = next_length;
+					dist = next_dist;
+				}
+				else
+				{
+					length = longest_match(i, dist);
+				}
+				continue;
+			}
+
+			symbols.push_back(lz_symbol{ static_cast<uint16_t>(length), static_cast<uint16_t>(dist) });
+			for (int k = 1; k < length; ++k)
+				insert(i + k);
+			i += length;
+			length = i < size ? longest_match(i, dist) : 0;
+		}
+
+		return symbols;
+	}
+
+	// Huffman code lengths of at most 'max_length' bits for 'freqs'; at least two codes, as inflate wants complete codes
+	inline std::vector<int> code_lengths(std::vector<size_t> freqs, int max_length)
+	{
+		const int n = static_cast<int>(freqs.size());
+
+		int used = 0;
+		for (size_t f : freqs)
+			used += f != 0;
+		for (int i = 0; i < n && used < 2; ++i)
+		{
+			if (freqs[i] == 0)
+			{
+				freqs[i] = 1;
+				++used;
+			}
+		}
+
+		std::vector<int> lengths(n, 0);
+
+		for (;;)
+		{
+			// the tree: leaves 0..n-1, inner nodes from n on
+			std::vector<std::pair<size_t, int>> heap;	// (weight, node), a min-heap
+			std::vector<int> parent(2 * n, -1);
+			for (int i = 0; i < n; ++i)
+			{
+				if (freqs[i] != 0)
+					heap.emplace_back(freqs[i], i);
+			}
+
+			auto greater = [](const std::pair<size_t, int>& a, const std::pair<size_t, int>& b) { return a > b; };
+			std::make_heap(heap.begin(), heap.end(), greater);
+
+			int next = n;
+			while (heap.size() > 1)
+			{
+				std::pop_heap(heap.begin(), heap.end(), greater);
+				const auto a = heap.back();
+				heap.pop_back();
+				std::pop_heap(heap.begin(), heap.end(), greater);
+				const auto b = heap.back();
+				heap.pop_back();
+
+				parent[a.second] = next;
+				parent[b.second] = next;
+				heap.emplace_back(a.first + b.first, next++);
+				std::push_heap(heap.begin(), heap.end(), greater);
+			}
+
+			int longest = 0;
+			for (int i = 0; i < n; ++i)
+			{
+				lengths[i] = 0;
+				if (freqs[i] == 0)
+					continue;
+				for (int p = parent[i]; p != -1; p = parent[p])
+					++lengths[i];
+				longest = std::max(longest, lengths[i]);
+			}
+
+			if (longest <= max_length)
+				return lengths;
+
+			// too deep: flatten the distribution and try again
+			for (auto& f : freqs)
+			{
+				if (f != 0)
+					f = (f + 1) / 2;
+			}
+		}
+	}
+
+	// Canonical codes of the lengths
+	inline std::vector<uint32_t> canonical_codes(const std::vector<int>& lengths)
+	{
+		int count[16] = {};
+		for (int l : lengths)
+			++count[l];
+		count[0] = 0;
+
+		uint32_t next[16] = {};
+		uint32_t code = 0;
+		for (int bits = 1; bits < 16; ++bits)
+		{
+			code = (code + count[bits - 1]) << 1;
+			next[bits] = code;
+		}
+
+		std::vector<uint32_t> codes(lengths.size(), 0);
+		for (size_t i = 0; i < lengths.size(); ++i)
+		{
+			if (lengths[i] != 0)
+				codes[i] = next[lengths[i]]++;
+		}
+		return codes;
+	}
+
+	// 'data' as one dynamic Huffman block, not the final one
+	inline void deflate_block(const uint8_t* data, size_t size, bit_writer& out)
+	{
+		const auto symbols = lz77(data, size);
+
+		std::vector<size_t> lit_freqs(286, 0);
+		std::vector<size_t> dist_freqs(30, 0);
+		for (const auto& s : symbols)
+		{
+			if (s.dist == 0)
+			{
+				++lit_freqs[s.lit_len];
+			}
+			else
+			{
+				++lit_freqs[257 + length_code(s.lit_len)];
+				++dist_freqs[dist_code(s.dist)];
+			}
+		}
+		lit_freqs[256] = 1;
+
+		const auto lit_lengths = code_lengths(lit_freqs, 15);
+		const auto dist_lengths = code_lengths(dist_freqs, 15);
+		const auto lit_codes = canonical_codes(lit_lengths);
+		const auto dist_codes = canonical_codes(dist_lengths);
+
+		int num_lit = 286;
+		while (num_lit > 257 && lit_lengths[num_lit - 1] == 0)
+			--num_lit;
+		int num_dist = 30;
+		while (num_dist > 1 && dist_lengths[num_dist - 1] == 0)
+			--num_dist;
+
+		// the code lengths of both, run length encoded: (symbol, extra bits)
+		std::vector<int> all(lit_lengths.begin(), lit_lengths.begin() + num_lit);
+		all.insert(all.end(), dist_lengths.begin(), dist_lengths.begin() + num_dist);
+
+		std::vector<std::pair<int, int>> rle;
+		for (size_t i = 0; i < all.size(); )
+		{
+			size_t run = 1;
+			while (i + run < all.size() && all[i + run] == all[i])
+				++run;
+
+			if (all[i] == 0 && run >= 3)
+			{
+				run = std::min<size_t>(run, 138);
+				rle.emplace_back(run >= 11 ? 18 : 17, static_cast<int>(run >= 11 ? run - 11 : run - 3));
+			}
+			else if (all[i] != 0 && run >= 4)
+			{
+				run = std::min<size_t>(run, 7);
+				rle.emplace_back(all[i], 0);
+				rle.emplace_back(16, static_cast<int>(run - 4));
+			}
+			else
+			{
+				run = 1;
+				rle.emplace_back(all[i], 0);
+			}
+			i += run;
+		}
+
+		std::vector<size_t> cl_freqs(19, 0);
+		for (const auto& r : rle)
+			++cl_freqs[r.first];
+		const auto cl_lengths = code_lengths(cl_freqs, 7);
+		const auto cl_codes = canonical_codes(cl_lengths);
+
+		int num_cl = 19;
+		while (num_cl > 4 && cl_lengths[CODE_LENGTH_ORDER[num_cl - 1]] == 0)
+			--num_cl;
+
+		out.put(0, 1);	// not final
+		out.put(2, 2);	// dynamic Huffman
+		out.put(num_lit - 257, 5);
+		out.put(num_dist - 1, 5);
+		out.put(num_cl - 4, 4);
+		for (int i = 0; i < num_cl; ++i)
+			out.put(cl_lengths[CODE_LENGTH_ORDER[i]], 3);
+
+		for (const auto& r : rle)
+		{
+			out.put_code(cl_codes[r.first], cl_lengths[r.first]);
+			if (r.first == 16)
+				out.put(r.second, 2);
+			else if (r.first == 17)
+				out.put(r.second, 3);
+			else if (r.first == 18)
+				out.put(r.second, 7);
+		}
+
+		for (const auto& s : symbols)
+		{
+			if (s.dist == 0)
+			{
+				out.put_code(lit_codes[s.lit_len], lit_lengths[s.lit_len]);
+				continue;
+			}
+
+			const int lc = length_code(s.lit_len);
+			out.put_code(lit_codes[257 + lc], lit_lengths[257 + lc]);
+			out.put(s.lit_len - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+
+			const int dc = dist_code(s.dist);
+			out.put_code(dist_codes[dc], dist_lengths[dc]);
+			out.put(s.dist - DIST_BASE[dc], DIST_EXTRA[dc]);
+		}
+
+		out.put_code(lit_codes[256], lit_lengths[256]);
+	}
+
+	inline uint8_t paeth(int a, int b, int c)
+	{
+		const int p = a + b - c;
+		const int pa = std::abs(p - a);
+		const int pb = std::abs(p - b);
+		const int pc = std::abs(p - c);
+		return static_cast<uint8_t>(pa <= pb && pa <= pc ? a : (pb <= pc ? b : c));
+	}
+
+	// The scanlines of 'rows' (the first one only as the one above, if 'has_above'), 'bpp' bytes per pixel, each with
+	// the filter of the least sum of absolute differences - the usual heuristic
+	inline std::vector<uint8_t> filter_rows(const std::vector<unsigned char>& rows, int width, int bpp, int num_rows, bool has_above)
+	{
+		const size_t stride = static_cast<size_t>(width) * bpp;
+		std::vector<uint8_t> out;
+		out.reserve((stride + 1) * num_rows);
+
+		std::vector<uint8_t> above(stride, 0);
+		std::vector<uint8_t> row(stride);
+		std::vector<uint8_t> candidate(stride);
+		std::vector<uint8_t> best(stride);
+
+		auto copy_row = [&](int r, std::vector<uint8_t>& dst)
+		{
+			std::copy_n(&rows[static_cast<size_t>(r) * stride], stride, dst.begin());
+		};
+
+		int first = 0;
+		if (has_above)
+		{
+			copy_row(0, above);
+			first = 1;
+		}
+
+		for (int r = first; r < first + num_rows; ++r)
+		{
+			copy_row(r, row);
+
+			size_t best_sum = SIZE_MAX;
+			uint8_t best_type = 0;
+
+			for (uint8_t type = 0; type < 5; ++type)
+			{
+				size_t sum = 0;
+				for (size_t i = 0; i < stride; ++i)
+				{
+					const int left = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+					const int up = above[i];
+					const int up_left = i >= static_cast<size_t>(bpp) ? above[i - bpp] : 0;
+
+					uint8_t predicted = 0;
+					switch (type)
+					{
+					case 1: predicted = static_cast<uint8_t>(left); break;
+					case 2: predicted = static_cast<uint8_t>(up); break;
+					case 3: predicted = static_cast<uint8_t>((left + up) / 2); break;
+					case 4: predicted = paeth(left, up, up_left); break;
+					}
+
+					candidate[i] = static_cast<uint8_t>(row[i] - predicted);
+					sum += std::abs(static_cast<int8_t>(candidate[i]));
+				}
+
+				if (sum < best_sum)
+				{
+					best_sum = sum;
+					best_type = type;
+					best.swap(candidate);
+				}
+			}
+
+			out.push_back(best_type);
+			out.insert(out.end(), best.begin(), best.end());
+			above.swap(row);
+		}
+
+		return out;
+	}
+
+	// a band, deflated, with what the zlib trailer needs of it
+	struct compressed_band
+	{
+		bit_writer bits;
+		uint32_t adler;
+		size_t size;	// of the filtered data
+	};
+}
+
+// The chunks of a PNG, the zlib stream of the IDAT ones put together from independently deflated bands (in order)
+class png_stream
+{
+	static constexpr size_t CHUNK_BYTES = size_t(1) << 20;	// of the IDAT chunks, but the last
+
+	std::ofstream file;
+	std::string path;
+	png_stream_detail::bit_writer pending;	// not written yet
+	uint32_t adler{ 1 };
+
+	static void put_be32(std::vector<uint8_t>& v, uint32_t x)
+	{
+		v.push_back(static_cast<uint8_t>(x >> 24));
+		v.push_back(static_cast<uint8_t>(x >> 16));
+		v.push_back(static_cast<uint8_t>(x >> 8));
+		v.push_back(static_cast<uint8_t>(x));
+	}
+
+	void write_chunk(const char* type, const uint8_t* data, size_t size)
+	{
+		std::vector<uint8_t> chunk;
+		chunk.reserve(size + 12);
+		put_be32(chunk, static_cast<uint32_t>(size));
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data, data + size);
+		put_be32(chunk, lodepng_crc32(chunk.data() + 4, size + 4));
+
+		file.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+	}
+
+	// the whole bytes of the stream so far as an IDAT chunk, once there are enough of them (or all of them if 'all')
+	void write_pending(bool all)
+	{
+		if (pending.bytes.empty() || (!all && pending.bytes.size() < CHUNK_BYTES))
+			return;
+
+		write_chunk("IDAT", pending.bytes.data(), pending.bytes.size());
+		pending.bytes.clear();
+	}
+
+public:
+	// 'bit_depth' 8 or 16, RGB
+	bool open(const std::string& output, int width, int height, int bit_depth)
+	{
+		path = output;
+		file.open(output, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+
+		static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+		std::vector<uint8_t> ihdr;
+		put_be32(ihdr, static_cast<uint32_t>(width));
+		put_be32(ihdr, static_cast<uint32_t>(height));
+		ihdr.insert(ihdr.end(), { static_cast<uint8_t>(bit_depth), 2, 0, 0, 0 });	// RGB, deflate, adaptive filtering, not interlaced
+		write_chunk("IHDR", ihdr.data(), ihdr.size());
+
+		// zlib header: deflate with a 32K window, default compression
+		pending.put(0x78, 8);
+		pending.put(0x9c, 8);
+
+		return static_cast<bool>(file);
+	}
+
+	// The next band of the image
+	void append(const png_stream_detail::compressed_band& band)
+	{
+		pending.append(band.bits);
+		adler = png_stream_detail::adler32_combine(adler, band.adler, band.size);
+		write_pending(false);
+	}
+
+	bool finish()
+	{
+		// an empty final block (fixed Huffman, just the end of block), then the Adler-32
+		pending.put(1, 1);
+		pending.put(1, 2);
+		pending.put(0, 7);
+		pending.put(0, (8 - pending.num_bits) % 8);
+
+		for (int shift = 24; shift >= 0; shift -= 8)
+			pending.put((adler >> shift) & 0xff, 8);
+
+		write_pending(true);
+		write_chunk("IEND", nullptr, 0);
+
+		file.close();
+		return !file.fail();
+	}
+};
+
+//
+// Writes the PNG of a render as it goes: tile_done() is told of every tile rendered, and whenever that completes
+// a band of the output rows, the band is colour mapped ('rgb_rows'), filtered and deflated right there - the
+// other threads go on rendering - then appended to the file in order. The exposure is known up front (it depends
+// on the aperture only, see exposure_max()), so nothing has to wait for the whole image.
+//
+// The rows of the grid that have nothing left to render (masked out, or already there from a checkpoint) count as
+// done from the start. With a grid mirrored in y the rows of the bottom half are done with their top half
+// counterparts, so those bands wait for the middle - they are encoded as early, only written later.
+//
+class png_band_writer
+{
+public:
+	// The RGB samples of the output rows [y0, y1), at the bit depth of the file (see colour_matrix::map())
+	using rgb_function = std::function<std::vector<unsigned char>(int y0, int y1)>;
+
+	static constexpr size_t BAND_BYTES = size_t(1) << 18;	// of the filtered rows of a band, about
+
+	// optional: called once the rows [y0, y1) are in the file, and no longer needed in memory (see mapped_output.h)
+	std::function<void(int y0, int y1)> rows_encoded;
+
+private:
+	output_grid g;
+	rgb_function rgb_rows;
+	int pixel_bytes{ 3 };
+	int band_rows{ 0 };
+	int num_bands{ 0 };
+
+	std::unique_ptr<std::atomic_int[]> row_left;	// per representative row: wanted pixels not rendered yet
+	std::unique_ptr<std::atomic_int[]> band_left;	// per band: rows not done yet, the one above it included
+	std::unique_ptr<std::atomic_bool[]> band_encoded;
+
+	png_stream stream;
+	std::mutex lock;
+	std::map<int, png_stream_detail::compressed_band> waiting;	// bands done before those above them
+	int next_band{ 0 };
+
+	std::atomic_int encoded_early{ 0 };
+
+	int wanted_in(int v, int u0, int u1) const
+	{
+		int n = 0;
+		for (int u = u0; u < u1; ++u)
+			n += g.wanted(u, v);
+		return n;
+	}
+
+	void row_done(int v)
+	{
+		output_row_done(v);
+		const int mirrored = g.height - 1 - v;
+		if (g.mirror_y && mirrored != v)
+			output_row_done(mirrored);
+	}
+
+	// a row is one of its band's, and the last one of a band is filtered against by the next band too
+	void output_row_done(int y)
+	{
+		band_done(y / band_rows);
+		if ((y + 1) % band_rows == 0 && y + 1 < g.height)
+			band_done((y + 1) / band_rows);
+	}
+
+	void band_done(int b)
+	{
+		if (--band_left[b] == 0)
+		{
+			encode(b);
+			++encoded_early;
+		}
+	}
+
+	void encode(int b)
+	{
+		if (band_encoded[b].exchange(true))
+			return;
+
+		const int y0 = b * band_rows;
+		const int y1 = std::min(g.height, y0 + band_rows);
+
+		auto band = compress(rgb_rows, g.width, pixel_bytes, y0, y1);
+		if (rows_encoded)
+			rows_encoded(y0, y1);
+
+		std::lock_guard<std::mutex> l(lock);
+		waiting.emplace(b, std::move(band));
+		for (auto it = waiting.find(next_band); it != waiting.end(); it = waiting.find(next_band))
+		{
+			stream.append(it->second);
+			waiting.erase(it);
+			++next_band;
+		}
+	}
+
+	static int rows_per_band(int width, int height, int pixel_bytes)
+	{
+		const size_t row_bytes = static_cast<size_t>(width) * pixel_bytes + 1;
+		return static_cast<int>(std::clamp<size_t>((BAND_BYTES + row_bytes - 1) / row_bytes, 16, std::max(16, height)));
+	}
+
+	// the rows [y0, y1) filtered (against the row above, if there is one) and deflated
+	static png_stream_detail::compressed_band compress(const rgb_function& rgb_rows, int width, int pixel_bytes, int y0, int y1)
+	{
+		const bool has_above = y0 > 0;
+
+		png_stream_detail::compressed_band band;
+		const auto filtered = png_stream_detail::filter_rows(rgb_rows(has_above ? y0 - 1 : y0, y1), width, pixel_bytes, y1 - y0, has_above);
+		png_stream_detail::deflate_block(filtered.data(), filtered.size(), band.bits);
+		band.adler = png_stream_detail::adler32(filtered.data(), filtered.size());
+		band.size = filtered.size();
+		return band;
+	}
+
+public:
+	// Starts 'output' for the grid 'g' - the pixels still to render being those it wants - encoding the bands that
+	// are complete already. 'bit_depth' 8 or 16.
+	bool open(const std::string& output, const output_grid& grid, int bit_depth, rgb_function rgb)
+	{
+		g = grid;
+		rgb_rows = std::move(rgb);
+		pixel_bytes = 3 * bit_depth / 8;
+
+		band_rows = rows_per_band(g.width, g.height, pixel_bytes);
+		num_bands = (g.height + band_rows - 1) / band_rows;
+
+		row_left = std::make_unique<std::atomic_int[]>(g.rep_height);
+		band_left = std::make_unique<std::atomic_int[]>(num_bands);
+		band_encoded = std::make_unique<std::atomic_bool[]>(num_bands);
+
+		for (int b = 0; b < num_bands; ++b)
+		{
+			band_left[b] = std::min(g.height, (b + 1) * band_rows) - b * band_rows + (b > 0 ? 1 : 0);
+			band_encoded[b] = false;
+		}
+
+		if (!stream.open(output, g.width, g.height, bit_depth))
+		{
+			std::cerr << "Failed to write " << output << std::endl;
+			return false;
+		}
+
+		for (int v = 0; v < g.rep_height; ++v)
+		{
+			row_left[v] = wanted_in(v, 0, g.rep_width);
+			if (row_left[v] == 0)
+				row_done(v);
+		}
+		encoded_early = 0;
+
+		return true;
+	}
+
+	// called by the thread that rendered 't'
+	void tile_done(const tile& t)
+	{
+		for (int v = t.v0; v < t.v1; ++v)
+		{
+			const int n = wanted_in(v, t.u0, t.u1);
+			if (n != 0 && (row_left[v] -= n) == 0)
+				row_done(v);
+		}
+	}
+
+	// Encodes the bands not done yet (of a render that was stopped), and closes the file
+	bool finish()
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		for (int b = 0; b < num_bands; ++b)
+			encode(b);
+
+		const bool ok = stream.finish();
+
+		std::cout << "png: " << encoded_early.load() << " of " << num_bands << " bands encoded while rendering, "
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s to finish" << std::endl;
+
+		return ok;
+	}
+
+	// The PNG of a whole image that is there already, band by band on the calling thread - so only a band of the
+	// samples is ever in memory. 'rows_encoded' as the member of that name.
+	static bool write(const std::string& output, int width, int height, int bit_depth, const rgb_function& rgb_rows,
+		const std::function<void(int y0, int y1)>& rows_encoded = nullptr)
+	{
+		png_stream stream;
+		if (!stream.open(output, width, height, bit_depth))
+		{
+			std::cerr << "Failed to write " << output << std::endl;
+			return false;
+		}
+
+		const int pixel_bytes = 3 * bit_depth / 8;
+		const int band_rows = rows_per_band(width, height, pixel_bytes);
+
+		for (int y0 = 0; y0 < height; y0 += band_rows)
+		{
+			const int y1 = std::min(height, y0 + band_rows);
+			stream.append(compress(rgb_rows, width, pixel_bytes, y0, y1));
+			if (rows_encoded)
+				rows_encoded(y0, y1);
+		}
+
+		if (!stream.finish())
+		{
+			std::cerr << "Failed to write " << output << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// write() with the bands made on the threads of 'grid', a few per thread at a time
+	static bool write(ThreadGrid& grid, const std::string& output, int width, int height, int bit_depth, const rgb_function& rgb_rows)
+	{
+		png_stream stream;
+		if (!stream.open(output, width, height, bit_depth))
+		{
+			std::cerr << "Failed to write " << output << std::endl;
+			return false;
+		}
+
+		const int pixel_bytes = 3 * bit_depth / 8;
+		const int band_rows = rows_per_band(width, height, pixel_bytes);
+		const int num_bands = (height + band_rows - 1) / band_rows;
+		const int bands_at_once = 4 * grid.NumThreads();
+
+		std::vector<png_stream_detail::compressed_band> bands(std::min(num_bands, bands_at_once));
+		for (int b0 = 0; b0 < num_bands; b0 += bands_at_once)
+		{
+			const int n = std::min(bands_at_once, num_bands - b0);
+			std::atomic_int next{ 0 };
+
+			grid.GridRun(
+				[&](int, int)
+				{
+					for (int i = next++; i < n; i = next++)
+					{
+						const int y0 = (b0 + i) * band_rows;
+						bands[i] = compress(rgb_rows, width, pixel_bytes, y0, std::min(height, y0 + band_rows));
+					}
+				});
+
+			for (int i = 0; i < n; ++i)
+				stream.append(bands[i]);
+		}
+
+		if (!stream.finish())
+		{
+			std::cerr << "Failed to write " << output << std::endl;
+			return false;
+		}
+		return true;
+	}
+};
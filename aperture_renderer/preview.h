@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "ThreadGrid.h"
+
+//
+// Reduced resolution preview: the cost is (aperture pixels) x (output pixels), so rendering the aperture
+// downsampled by 'factor' - with R, lambda and the unfocus factor scaled down by the same 'factor', which keeps
+// all the phases the same - costs factor^4 less, and gives the same image at 1 / factor of the resolution.
+//
+
+struct preview_geometry
+{
+	int factor;
+	int width;	// of the downsampled aperture / the preview image
+	int height;
+	int pad_x;	// full resolution pixels added on each side, to keep the preview size even
+	int pad_y;
+};
+
+inline preview_geometry make_preview_geometry(int width, int height, int factor)
+{
+	preview_geometry g;
+	g.factor = factor;
+	g.width = 2 * ((width + 2 * factor - 1) / (2 * factor));
+	g.height = 2 * ((height + 2 * factor - 1) / (2 * factor));
+	g.pad_x = (g.width * factor - width) / 2;
+	g.pad_y = (g.height * factor - height) / 2;
+	return g;
+}
+
+// Block-sums the mask: each preview pixel carries all the light of the factor^2 pixels it replaces, so the field
+// (and thus the exposure) stays comparable to the full resolution render. The padding keeps the centre in place.
+template <typename TFloat>
+std::vector<TFloat> downsample_mask(const std::vector<TFloat>& mask, int width, int height, const preview_geometry& g)
+{
+	std::vector<TFloat> ret(static_cast<size_t>(g.width) * g.height);
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			int px = (x + g.pad_x) / g.factor;
+			int py = (y + g.pad_y) / g.factor;
+			ret[static_cast<size_t>(py) * g.width + px] += mask[static_cast<size_t>(y) * width + x];
+		}
+	}
+
+	return ret;
+}
+
+struct preview_error
+{
+	double max_error;	// in 8-bit output levels, over all the wavelengths
+	double rms_error;
+	size_t num_samples;
+};
+
+// Estimates the error of the preview by rendering a sparse, stratified set of quadrant pixels of the full resolution
+// aperture and comparing them against the (bilinearly interpolated) preview at the same spot. The values are clipped
+// the way the PNG is, so the saturated core does not count.
+template <typename TAperture>
+preview_error estimate_preview_error(ThreadGrid& grid, TAperture& full, const typename TAperture::raw& preview_out,
+	const preview_geometry& g, int num_samples, float max)
+{
+	using pixel = typename TAperture::pixel;
+
+	const int width = full.width;
+	const int height = full.height;
+
+	const int cells = std::max(1, static_cast<int>(std::sqrt(static_cast<double>(num_samples))));
+
+	std::mt19937 rng{ 1 };
+	std::vector<std::pair<int, int>> samples;
+	for (int j = 0; j < cells; ++j)
+	{
+		for (int i = 0; i < cells; ++i)
+		{
+			int x0 = i * (width / 2) / cells;
+			int x1 = std::max(x0 + 1, (i + 1) * (width / 2) / cells);
+			int y0 = j * (height / 2) / cells;
+			int y1 = std::max(y0 + 1, (j + 1) * (height / 2) / cells);
+
+			samples.push_back({ x0 + static_cast<int>(rng() % (x1 - x0)), y0 + static_cast<int>(rng() % (y1 - y0)) });
+		}
+	}
+
+	const double to_output_levels = 255.0 / max;
+
+	// value of the preview at the full resolution pixel (x, y), for spectral plane i
+	auto preview_at = [&](int x, int y, size_t i) -> double
+	{
+		double px = std::clamp((x + g.pad_x - (g.factor - 1) / 2.0) / g.factor, 0.0, g.width - 1.0);
+		double py = std::clamp((y + g.pad_y - (g.factor - 1) / 2.0) / g.factor, 0.0, g.height - 1.0);
+
+		int x0 = std::min(static_cast<int>(px), g.width - 2);
+		int y0 = std::min(static_cast<int>(py), g.height - 2);
+		double tx = px - x0;
+		double ty = py - y0;
+
+		auto at = [&](int xx, int yy) { return preview_out[static_cast<size_t>(yy) * g.width + xx][i]; };
+
+		return (1.0 - tx) * (1.0 - ty) * at(x0, y0) + tx * (1.0 - ty) * at(x0 + 1, y0)
+			+ (1.0 - tx) * ty * at(x0, y0 + 1) + tx * ty * at(x0 + 1, y0 + 1);
+	};
+
+	std::vector<double> max_error(grid.NumThreads());
+	std::vector<double> sum_sqr_error(grid.NumThreads());
+	std::atomic_size_t next_sample{ 0 };
+
+	grid.GridRun(
+		[&](int thread_idx, int)
+		{
+			for (size_t s = next_sample++; s < samples.size(); s = next_sample++)
+			{
+				int x = samples[s].first;
+				int y = samples[s].second;
+
+				const int xs[4] = { x, width - x - 1, x, width - x - 1 };
+				const int ys[4] = { y, y, height - y - 1, height - y - 1 };
+
+				pixel exact[4];
+				full.diff_value(x, y, exact[0], exact[1], exact[2], exact[3]);
+
+				for (int m = 0; m < 4; ++m)
+				{
+					for (size_t i = 0; i < exact[m].size(); ++i)
+					{
+						double d = std::min(exact[m][i] * to_output_levels, 255.0)
+							- std::min(preview_at(xs[m], ys[m], i) * to_output_levels, 255.0);
+
+						max_error[thread_idx] = std::max(max_error[thread_idx], std::abs(d));
+						sum_sqr_error[thread_idx] += d * d;
+					}
+				}
+			}
+		});
+
+	preview_error ret{ 0.0, 0.0, samples.size() };
+
+	double sum = 0.0;
+	for (int t = 0; t < grid.NumThreads(); ++t)
+	{
+		ret.max_error = std::max(ret.max_error, max_error[t]);
+		sum += sum_sqr_error[t];
+	}
+	ret.rms_error = std::sqrt(sum / (4.0 * samples.size() * std::tuple_size<pixel>::value));
+
+	return ret;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <utility>
+
+#include "ThreadGrid.h"
+#include "output_grid.h"
+#include "cancellation.h"
+
+//
+// Progressive (coarse-to-fine) rendering of the output: the representative pixels of the grid are visited level by level, level 's'
+// being the pixels at multiples of s (that were not part of a coarser level), from a coarse lattice down to s == 1.
+// Within a level the pixels go in bit-reversed Morton order, so whenever the render is interrupted, the pixels
+// done so far are spread evenly over the image.
+//
+// Every pixel not rendered yet has a rendered 'ancestor' - the pixel (x & ~(s - 1), y & ~(s - 1)) of the finest
+// complete level s - so a complete (if blocky) image can be produced at any point, which is what the snapshots are.
+//
+template <typename TAperture>
+class progressive_renderer
+{
+	using pixel = typename TAperture::pixel;
+
+	TAperture& ap;
+	const output_grid& out_grid;
+	typename TAperture::raw& out;
+
+	int quadrant_width;	// of the representative part of the grid - the top-left quadrant for the full frame
+	int quadrant_height;
+
+	double to_output_levels; // raw intensity -> 8-bit output levels
+
+	std::vector<uint8_t> computed; // per quadrant pixel
+
+public:
+	size_t num_computed{ 0 };
+
+	progressive_renderer(TAperture& ap, const output_grid& out_grid, typename TAperture::raw& out, float max)
+		: ap{ ap }
+		, out_grid{ out_grid }
+		, out{ out }
+		, quadrant_width{ out_grid.rep_width }
+		, quadrant_height{ out_grid.rep_height }
+		, to_output_levels{ 255.0 / max }
+		, computed(static_cast<size_t>(out_grid.rep_width) * out_grid.rep_height)
+	{
+	}
+
+	// Renders level by level, calling 'snapshot' (with the missing pixels filled in) every 'snapshot_interval'
+	// seconds. Stops early once a level changes the image by less than 'quality' output levels (rms over the
+	// newly rendered pixels, against their ancestors), 0 - never, or once 'cancel' is stopped (its deadline passed,
+	// or interrupted) - but not before the coarsest level is done, as the rest is filled in from that.
+	// Returns true if every pixel was rendered exactly; either way 'out' is a complete image afterwards.
+	bool run(ThreadGrid& grid, double snapshot_interval, double quality, const std::function<void()>& snapshot,
+		const cancel_token* cancel = nullptr)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		auto last_snapshot = start;
+
+		const int num_threads = grid.NumThreads();
+
+		int coarsest = 1;
+		while (coarsest * 16 <= std::max(quadrant_width, quadrant_height))
+			coarsest *= 2;
+
+		bool complete = true;
+		bool stopped = false;
+
+		for (int s = coarsest; s >= 1; s /= 2)
+		{
+			auto points = level_points(s, s == coarsest);
+
+			std::vector<double> sum_sqr_change(num_threads);
+
+			size_t batch = num_threads;
+			for (size_t begin = 0; begin < points.size(); )
+			{
+				size_t end = std::min(points.size(), begin + batch);
+
+				const auto batch_start = std::chrono::steady_clock::now();
+
+				std::atomic_size_t next_point{ begin };
+				std::vector<uint8_t> done_flags(end - begin);
+
+				const bool cancellable = cancel != nullptr && s != coarsest;
+
+				grid.GridRun(
+					[&](int thread_idx, int)
+					{
+						for (size_t i = next_point++; i < end; i = next_point++)
+						{
+							if (cancellable && cancel->stop_requested())
+								break;
+
+							sum_sqr_change[thread_idx] += render(points[i].first, points[i].second, s == coarsest ? 0 : 2 * s);
+							done_flags[i - begin] = 1;
+						}
+					});
+
+				size_t done = 0;
+				for (size_t i = begin; i < end; ++i)
+				{
+					if (done_flags[i - begin])
+					{
+						computed[quadrant_offs(points[i].first, points[i].second)] = 1;
+						++done;
+					}
+				}
+
+				num_computed += done;
+
+				if (cancellable && cancel->stop_requested())
+				{
+					stopped = true;
+					break;
+				}
+
+				begin = end;
+
+				const auto now = std::chrono::steady_clock::now();
+
+				// aim for batches of about a second, so the snapshots are not late by much
+				double per_pixel = std::chrono::duration<double>(now - batch_start).count() / done;
+				batch = std::max<size_t>(num_threads, static_cast<size_t>(1.0 / std::max(per_pixel, 1e-6)));
+
+				if (std::chrono::duration<double>(now - last_snapshot).count() >= snapshot_interval && num_computed < computed.size())
+				{
+					fill_from_ancestors();
+					snapshot();
+					last_snapshot = std::chrono::steady_clock::now();
+				}
+			}
+
+			double sum = 0.0;
+			for (double v : sum_sqr_change)
+				sum += v;
+
+			double rms_change = points.empty() ? 0.0 :
+				std::sqrt(sum / (4.0 * points.size() * std::tuple_size<pixel>::value));
+
+			std::cout << "level " << s << ": " << points.size() << " pixels, " << num_computed << " of " << computed.size()
+				<< " done, rms change " << rms_change << " levels, "
+				<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " seconds" << std::endl;
+
+			if (stopped)
+			{
+				std::cout << "stopped, filling in the rest" << std::endl;
+				complete = false;
+				break;
+			}
+
+			if (s != coarsest && s > 1 && quality > 0.0 && rms_change < quality)
+			{
+				std::cout << "quality target of " << quality << " levels reached, filling in the rest" << std::endl;
+				complete = false;
+				break;
+			}
+		}
+
+		fill_from_ancestors();
+
+		return complete;
+	}
+
+	// Fills every pixel that is not rendered yet with the value of its nearest rendered ancestor
+	void fill_from_ancestors()
+	{
+		for (int y = 0; y < quadrant_height; ++y)
+		{
+			for (int x = 0; x < quadrant_width; ++x)
+			{
+				if (computed[quadrant_offs(x, y)])
+					continue;
+
+				for (int s = 2; ; s *= 2)
+				{
+					int ax = x & ~(s - 1);
+					int ay = y & ~(s - 1);
+
+					if (computed[quadrant_offs(ax, ay)])
+					{
+						for (int m = 0; m < 4; ++m)
+						{
+							if (out_grid.has_image(x, y, m))
+								out[out_grid.image_offs(x, y, m)] = out[out_grid.image_offs(ax, ay, m)];
+						}
+						break;
+					}
+
+					// (0, 0) is the first pixel of the coarsest level, nothing to fill from before that
+					if (ax == 0 && ay == 0)
+						break;
+				}
+			}
+		}
+	}
+
+private:
+	size_t quadrant_offs(int x, int y) const
+	{
+		return static_cast<size_t>(y) * quadrant_width + x;
+	}
+
+	static uint64_t morton(uint32_t x, uint32_t y)
+	{
+		uint64_t ret = 0;
+		for (int b = 0; b < 32; ++b)
+		{
+			ret |= static_cast<uint64_t>((x >> b) & 1) << (2 * b);
+			ret |= static_cast<uint64_t>((y >> b) & 1) << (2 * b + 1);
+		}
+		return ret;
+	}
+
+	static uint64_t bit_reverse(uint64_t v)
+	{
+		uint64_t ret = 0;
+		for (int b = 0; b < 64; ++b, v >>= 1)
+			ret = (ret << 1) | (v & 1);
+		return ret;
+	}
+
+	std::vector<std::pair<int, int>> level_points(int s, bool coarsest)
+	{
+		std::vector<std::pair<uint64_t, std::pair<int, int>>> keyed;
+
+		for (int y = 0; y < quadrant_height; y += s)
+		{
+			for (int x = 0; x < quadrant_width; x += s)
+			{
+				// the pixels at multiples of 2s belong to the coarser levels
+				if (!coarsest && (x % (2 * s) == 0) && (y % (2 * s) == 0))
+					continue;
+
+				keyed.push_back({ bit_reverse(morton(x / s, y / s)), { x, y } });
+			}
+		}
+
+		std::sort(keyed.begin(), keyed.end());
+
+		std::vector<std::pair<int, int>> ret;
+		ret.reserve(keyed.size());
+		for (const auto& k : keyed)
+			ret.push_back(k.second);
+		return ret;
+	}
+
+	// Renders the quadrant pixel (x, y), returns the sum of squared differences against the ancestor at 'parent_step'
+	// (which is complete at this point), i.e. how much the pixel changed the image - in output levels, clipped
+	// the way the PNG is, as the changes of the saturated core are not visible anyway
+	double render(int x, int y, int parent_step)
+	{
+		render_grid_pixel(ap, out_grid, out, x, y);
+
+		if (parent_step == 0)
+			return 0.0;
+
+		int ax = x & ~(parent_step - 1);
+		int ay = y & ~(parent_step - 1);
+
+		double sum = 0.0;
+		for (int m = 0; m < 4; ++m)
+		{
+			if (!out_grid.has_image(x, y, m))
+				continue;
+
+			const pixel& v = out[out_grid.image_offs(x, y, m)];
+			const pixel& a = out[out_grid.image_offs(ax, ay, m)];
+			for (size_t i = 0; i < v.size(); ++i)
+			{
+				double d = std::min(v[i] * to_output_levels, 255.0) - std::min(a[i] * to_output_levels, 255.0);
+				sum += d * d;
+			}
+		}
+		return sum;
+	}
+};
@@ -0,0 +1,545 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <tuple>
+#include <memory>
+#include <functional>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#include "lodepng.h"
+#include "ThreadGrid.h"
+#include "tile_scheduler.h"
+#include "cancellation.h"
+#include "checkpoint.h"
+#include "batch.h"
+#include "net.h"
+
+//
+// The render daemon (--daemon): a long running process on a local socket that keeps the apertures and the rendered
+// pixels in memory, so that poking at the parameters only pays for what was not rendered before.
+//
+// A request is a line of text, the reply a line of text and, for a render, the image right after it:
+//
+//	render <input.png> [R=<r>] [lambda=<l>] [unfocus=<u>] [roi=<x,y,w,h>] [zoom=<z>] [gain=<g>] [format=png|raw]
+//		-> "ok <png|raw> <width> <height> <bytes> <cached>/<tiles> tiles", <bytes> of the image
+//	stats	-> "ok <n> tiles (<MB> MB), <k> apertures, <hits> of <lookups> tile lookups hit"
+//	quit	-> "ok", and the daemon exits
+//	anything else, or a failure -> "error <message>"
+//
+// Several requests may be sent over one connection; the connections are served one at a time.
+//
+// The pixels are cached in tiles of the sampling lattice of a zoom - the output pixels of the full frame at that
+// zoom, extended beyond it - so a --roi is snapped to that lattice (to a whole output pixel). A lattice that is
+// symmetric around the aperture centre is folded, as the output_grid is: a tile keeps the mirrored images of its
+// points along the symmetric axes (4 if both are, 1 if neither is), and serves those quadrants. raw is width x height pixels of NUM_COLORS doubles, as aperture::raw.
+//
+
+constexpr int DAEMON_TILE_SIZE = 16;			// lattice points per side of a cached tile
+constexpr int DAEMON_MAX_APERTURES = 4;			// kept built, least recently used dropped
+constexpr size_t DAEMON_MAX_PIXELS = size_t(1) << 24;	// of a single render
+
+struct daemon_request
+{
+	std::string command;
+	std::string input;
+	float R;
+	float lambda;
+	float unfocus_factor;
+	bool has_roi{ false };
+	double roi[4]{ 0.0, 0.0, 0.0, 0.0 };
+	double zoom{ 1.0 };
+	float gain{ 1.0f };
+	bool raw{ false };
+};
+
+// 'line' into 'req' (which has the defaults), the reason in 'error' if it is not a valid request
+inline bool parse_daemon_request(const std::string& line, daemon_request& req, std::string& error)
+{
+	const auto fields = split_manifest_line(line);
+	if (fields.empty())
+	{
+		error = "empty request";
+		return false;
+	}
+
+	req.command = fields[0];
+	if (req.command == "stats" || req.command == "quit")
+	{
+		if (fields.size() == 1)
+			return true;
+
+		error = req.command + " takes no arguments";
+		return false;
+	}
+
+	if (req.command != "render")
+	{
+		error = "unknown request " + req.command;
+		return false;
+	}
+	if (fields.size() < 2)
+	{
+		error = "render needs the input";
+		return false;
+	}
+
+	req.input = fields[1];
+
+	for (size_t i = 2; i < fields.size(); ++i)
+	{
+		const auto eq = fields[i].find('=');
+		const std::string name = fields[i].substr(0, eq);
+		const std::string value = eq == std::string::npos ? std::string{} : fields[i].substr(eq + 1);
+
+		char* end = nullptr;
+		const double v = std::strtod(value.c_str(), &end);
+		const bool number = !value.empty() && *end == '\0';
+
+		if (name == "R" && number)
+			req.R = static_cast<float>(v);
+		else if (name == "lambda" && number && v > 0.0)
+			req.lambda = static_cast<float>(v);
+		else if (name == "unfocus" && number)
+			req.unfocus_factor = static_cast<float>(v);
+		else if (name == "zoom" && number && v > 0.0)
+			req.zoom = v;
+		else if (name == "gain" && number && v > 0.0)
+			req.gain = static_cast<float>(v);
+		else if (name == "format" && (value == "png" || value == "raw"))
+			req.raw = value == "raw";
+		else if (name == "roi")
+		{
+			std::istringstream ss(value);
+			char comma;
+			req.has_roi = static_cast<bool>(ss >> req.roi[0] >> comma >> req.roi[1] >> comma >> req.roi[2] >> comma >> req.roi[3])
+				&& ss.peek() == EOF && req.roi[2] > 0.0 && req.roi[3] > 0.0;
+			if (!req.has_roi)
+			{
+				error = "roi expects x,y,w,h";
+				return false;
+			}
+		}
+		else
+		{
+			error = "bad argument " + fields[i];
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template <typename TAperture>
+class render_daemon
+{
+public:
+	using pixel = typename TAperture::pixel;
+	using raw = typename TAperture::raw;
+
+	// builds the aperture of an RGBA image
+	std::function<TAperture*(const std::vector<unsigned char>& rgba, int width, int height, float R, float lambda, float unfocus_factor)> make_aperture;
+	// encodes a render as a PNG
+	std::function<bool(const TAperture& ap, const raw& out, int width, int height, float gain, std::vector<unsigned char>& png)> encode_png;
+
+private:
+	using aperture_key = std::tuple<uint64_t, float, float, float>;	// input file hash, R, lambda, unfocus factor
+	using tile_key = std::tuple<aperture_key, double, int, int>;	// zoom, tile x, y (folded lattice / DAEMON_TILE_SIZE)
+	using tile_pixels = std::vector<pixel>;	// DAEMON_TILE_SIZE^2 points x images_of() mirrored images
+
+	struct cached_tile
+	{
+		tile_key key;
+		std::shared_ptr<const tile_pixels> pixels;
+	};
+
+	struct cached_aperture
+	{
+		aperture_key key;
+		std::shared_ptr<TAperture> ap;
+	};
+
+	ThreadGrid& grid;
+	const daemon_request defaults;
+
+	std::list<cached_aperture> apertures;	// most recently used first
+
+	std::list<cached_tile> tiles;			// most recently used first
+	std::map<tile_key, typename std::list<cached_tile>::iterator> tile_index;
+	size_t tile_bytes{ 0 };
+	const size_t max_tile_bytes;
+
+	size_t lookups{ 0 };
+	size_t hits{ 0 };
+
+	// a lattice of a zoom, along one axis: point i is at origin + i * pitch (as output_grid::roi() puts them for the
+	// full frame); if it is symmetric around the aperture centre, point i mirrors to 'mirror - i'
+	struct lattice
+	{
+		double origin;
+		double pitch;
+		bool symmetric;
+		long long mirror;
+
+		lattice(int ap_size, double zoom)
+			: pitch(1.0 / zoom)
+		{
+			origin = 0.5 * pitch - 0.5;
+
+			const double points = ap_size * zoom;
+			symmetric = std::abs(points - std::round(points)) < 1e-6;
+			mirror = static_cast<long long>(std::llround(points)) - 1;
+		}
+
+		long long fold(long long i) const
+		{
+			return symmetric ? std::min(i, mirror - i) : i;
+		}
+
+		double at(long long i) const
+		{
+			return origin + i * pitch;
+		}
+	};
+
+	static long long tile_of(long long i)
+	{
+		return i >= 0 ? i / DAEMON_TILE_SIZE : -((-i + DAEMON_TILE_SIZE - 1) / DAEMON_TILE_SIZE);
+	}
+
+	// the mirrored images a tile keeps of each of its points: those along the symmetric lattices only, the others
+	// are never read (fold() does not change a point there)
+	static int images_of(const lattice& lx, const lattice& ly)
+	{
+		return (lx.symmetric ? 2 : 1) * (ly.symmetric ? 2 : 1);
+	}
+
+	// where the image 'm' (1: mirrored in x, 2: in y) of a point is among the images_of() it keeps
+	static int image_index(const lattice& lx, int m)
+	{
+		return lx.symmetric ? m : m >> 1;
+	}
+
+public:
+	// 'defaults' - of R, lambda, the unfocus factor; the tiles take up to 'max_cache_bytes'
+	render_daemon(ThreadGrid& grid, const daemon_request& defaults, size_t max_cache_bytes)
+		: grid(grid), defaults(defaults), max_tile_bytes(max_cache_bytes)
+	{
+	}
+
+	// Serves the requests on the local socket 'path' until a quit request, or 'cancel'; false if it could not listen
+	bool serve(const std::string& path, const cancel_token* cancel)
+	{
+		const net::socket_t listener = net::listen_local(path);
+		if (listener == net::invalid_socket)
+		{
+			std::cerr << "Failed to listen on " << path << std::endl;
+			return false;
+		}
+
+		std::cout << "listening on " << path << std::endl;
+
+		bool quit = false;
+		while (!quit && !(cancel != nullptr && cancel->stop_requested()))
+		{
+			net::connection c = net::accept_within(listener, 500);
+			if (!c.is_open())
+				continue;
+
+			std::string line;
+			while (!quit && c.recv_line(line))
+			{
+				if (!line.empty() && line.back() == '\r')
+					line.pop_back();
+
+				if (!handle(c, line, quit, cancel))
+					break;
+			}
+		}
+
+		net::close_socket(listener);
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+
+		return true;
+	}
+
+private:
+	static bool reply(net::connection& c, const std::string& line, const void* payload = nullptr, size_t size = 0)
+	{
+		const std::string l = line + "\n";
+		return c.send_all(l.data(), l.size()) && (size == 0 || c.send_all(payload, size));
+	}
+
+	// false if the connection is gone
+	bool handle(net::connection& c, const std::string& line, bool& quit, const cancel_token* cancel)
+	{
+		daemon_request req = defaults;
+		std::string error;
+		if (!parse_daemon_request(line, req, error))
+			return reply(c, "error " + error);
+
+		if (req.command == "quit")
+		{
+			quit = true;
+			return reply(c, "ok");
+		}
+
+		if (req.command == "stats")
+		{
+			std::ostringstream ss;
+			ss << "ok " << tiles.size() << " tiles (" << tile_bytes / (1 << 20) << " MB), " << apertures.size() << " apertures, "
+				<< hits << " of " << lookups << " tile lookups hit";
+			return reply(c, ss.str());
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+
+		std::vector<unsigned char> image;
+		int width;
+		int height;
+		size_t num_tiles;
+		size_t num_cached;
+		if (!render(req, image, width, height, num_tiles, num_cached, error, cancel))
+			return reply(c, "error " + error);
+
+		std::cout << "render " << req.input << ": " << width << "x" << height << ", " << num_cached << " of " << num_tiles
+			<< " tiles cached, " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+
+		std::ostringstream ss;
+		ss << "ok " << (req.raw ? "raw " : "png ") << width << " " << height << " " << image.size() << " "
+			<< num_cached << "/" << num_tiles << " tiles";
+		return reply(c, ss.str(), image.data(), image.size());
+	}
+
+	// The aperture of the request, built unless it is among the recent ones
+	std::shared_ptr<TAperture> aperture_of(const daemon_request& req, aperture_key& key, std::string& error)
+	{
+		// read every time: the file may have been edited since
+		std::ifstream f(req.input, std::ios::binary);
+		std::vector<unsigned char> file{ std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>() };
+		if (file.empty())
+		{
+			error = "failed to open " + req.input;
+			return nullptr;
+		}
+
+		key = aperture_key{ fnv1a(file.data(), file.size()), req.R, req.lambda, req.unfocus_factor };
+
+		for (auto it = apertures.begin(); it != apertures.end(); ++it)
+		{
+			if (it->key == key)
+			{
+				apertures.splice(apertures.begin(), apertures, it);
+				return apertures.front().ap;
+			}
+		}
+
+		std::vector<unsigned char> rgba;
+		unsigned width;
+		unsigned height;
+		if (lodepng::decode(rgba, width, height, file) != 0)
+		{
+			error = "failed to decode " + req.input;
+			return nullptr;
+		}
+		if (width % 2 != 0 || height % 2 != 0)
+		{
+			error = "the width & height of " + req.input + " must be even numbers";
+			return nullptr;
+		}
+
+		std::shared_ptr<TAperture> ap{ make_aperture(rgba, static_cast<int>(width), static_cast<int>(height), req.R, req.lambda, req.unfocus_factor) };
+
+		apertures.push_front(cached_aperture{ key, ap });
+		if (apertures.size() > DAEMON_MAX_APERTURES)
+			apertures.pop_back();
+
+		return ap;
+	}
+
+	std::shared_ptr<const tile_pixels> find_tile(const tile_key& key)
+	{
+		++lookups;
+		const auto it = tile_index.find(key);
+		if (it == tile_index.end())
+			return nullptr;
+
+		++hits;
+		tiles.splice(tiles.begin(), tiles, it->second);
+		return it->second->pixels;
+	}
+
+	void add_tile(const tile_key& key, std::shared_ptr<const tile_pixels> pixels)
+	{
+		tile_bytes += pixels->size() * sizeof(pixel);
+		tiles.push_front(cached_tile{ key, std::move(pixels) });
+		tile_index[key] = tiles.begin();
+
+		while (tile_bytes > max_tile_bytes && tiles.size() > 1)
+		{
+			tile_bytes -= tiles.back().pixels->size() * sizeof(pixel);
+			tile_index.erase(tiles.back().key);
+			tiles.pop_back();
+		}
+	}
+
+	bool render(const daemon_request& req, std::vector<unsigned char>& image, int& width, int& height,
+		size_t& num_tiles, size_t& num_cached, std::string& error, const cancel_token* cancel)
+	{
+		aperture_key key;
+		const auto ap = aperture_of(req, key, error);
+		if (!ap)
+			return false;
+
+		const lattice lx{ ap->width, req.zoom };
+		const lattice ly{ ap->height, req.zoom };
+
+		// the region, snapped to the lattice
+		const double x = req.has_roi ? req.roi[0] : 0.0;
+		const double y = req.has_roi ? req.roi[1] : 0.0;
+		const double w = req.has_roi ? req.roi[2] : ap->width;
+		const double h = req.has_roi ? req.roi[3] : ap->height;
+
+		const long long i0 = std::llround(x * req.zoom);
+		const long long j0 = std::llround(y * req.zoom);
+		width = std::max(1, static_cast<int>(std::lround(w * req.zoom)));
+		height = std::max(1, static_cast<int>(std::lround(h * req.zoom)));
+
+		if (static_cast<size_t>(width) * height > DAEMON_MAX_PIXELS)
+		{
+			error = "the render would be " + std::to_string(width) + "x" + std::to_string(height) + ", more than " + std::to_string(DAEMON_MAX_PIXELS) + " pixels";
+			return false;
+		}
+
+		// the tiles it takes: those of the folded rows x columns
+		std::set<long long> tx;
+		std::set<long long> ty;
+		for (int u = 0; u < width; ++u)
+			tx.insert(tile_of(lx.fold(i0 + u)));
+		for (int v = 0; v < height; ++v)
+			ty.insert(tile_of(ly.fold(j0 + v)));
+
+		std::map<std::pair<long long, long long>, std::shared_ptr<const tile_pixels>> needed;
+		std::vector<std::pair<long long, long long>> missing;
+
+		for (long long b : ty)
+		{
+			for (long long a : tx)
+			{
+				auto pixels = find_tile(tile_key{ key, req.zoom, static_cast<int>(a), static_cast<int>(b) });
+				if (!pixels)
+					missing.emplace_back(a, b);
+				needed[{ a, b }] = std::move(pixels);
+			}
+		}
+
+		num_tiles = needed.size();
+		num_cached = num_tiles - missing.size();
+
+		if (!missing.empty() && !render_tiles(*ap, lx, ly, key, req.zoom, missing, needed, cancel))
+		{
+			error = "interrupted";
+			return false;
+		}
+
+		// the output from the tiles, every pixel from the image of its folded point
+		const int images = images_of(lx, ly);
+		raw out(static_cast<size_t>(width) * height);
+		for (int v = 0; v < height; ++v)
+		{
+			const long long j = j0 + v;
+			const long long fj = ly.fold(j);
+			const long long b = tile_of(fj);
+
+			for (int u = 0; u < width; ++u)
+			{
+				const long long i = i0 + u;
+				const long long fi = lx.fold(i);
+				const long long a = tile_of(fi);
+
+				const int m = (fi != i ? 1 : 0) | (fj != j ? 2 : 0);
+				const size_t offs = static_cast<size_t>((fj - b * DAEMON_TILE_SIZE) * DAEMON_TILE_SIZE + (fi - a * DAEMON_TILE_SIZE));
+
+				out[static_cast<size_t>(v) * width + u] = (*needed[{ a, b }])[images * offs + image_index(lx, m)];
+			}
+		}
+
+		if (req.raw)
+		{
+			const auto* bytes = reinterpret_cast<const unsigned char*>(out.data());
+			image.assign(bytes, bytes + out.size() * sizeof(pixel));
+			return true;
+		}
+
+		if (!encode_png(*ap, out, width, height, req.gain, image))
+		{
+			error = "failed to encode the PNG";
+			return false;
+		}
+		return true;
+	}
+
+	// Renders the 'missing' tiles, a row of one per scheduler tile, into 'needed' and the cache
+	bool render_tiles(TAperture& ap, const lattice& lx, const lattice& ly, const aperture_key& key, double zoom,
+		const std::vector<std::pair<long long, long long>>& missing,
+		std::map<std::pair<long long, long long>, std::shared_ptr<const tile_pixels>>& needed, const cancel_token* cancel)
+	{
+		std::vector<std::shared_ptr<tile_pixels>> rendered;
+		std::vector<tile> rows;
+
+		const int images = images_of(lx, ly);
+		for (size_t k = 0; k < missing.size(); ++k)
+		{
+			rendered.push_back(std::make_shared<tile_pixels>(images * DAEMON_TILE_SIZE * DAEMON_TILE_SIZE));
+
+			for (int r = 0; r < DAEMON_TILE_SIZE; ++r)
+			{
+				tile t{ 0, r, DAEMON_TILE_SIZE, r + 1, DAEMON_TILE_SIZE };
+				t.job = static_cast<int>(k);
+				rows.push_back(t);
+			}
+		}
+
+		tile_scheduler scheduler;
+		const bool complete = scheduler.run(grid, std::move(rows),
+			[&](int, const tile& t)
+			{
+				const auto [a, b] = missing[t.job];
+				auto& pixels = *rendered[t.job];
+
+				// the images the tile does not keep go to a scratch pixel
+				pixel scratch[4];
+				for (int u = t.u0; u < t.u1; ++u)
+				{
+					pixel* o = &pixels[images * (static_cast<size_t>(t.v0) * DAEMON_TILE_SIZE + u)];
+					pixel* image[4];
+					for (int m = 0; m < 4; ++m)
+					{
+						const bool kept = (!(m & 1) || lx.symmetric) && (!(m & 2) || ly.symmetric);
+						image[m] = kept ? o + image_index(lx, m) : &scratch[m];
+					}
+					ap.diff_value(lx.at(a * DAEMON_TILE_SIZE + u), ly.at(b * DAEMON_TILE_SIZE + t.v0), *image[0], *image[1], *image[2], *image[3]);
+				}
+			}, cancel);
+
+		if (!complete)
+			return false;
+
+		for (size_t k = 0; k < missing.size(); ++k)
+		{
+			needed[missing[k]] = rendered[k];
+			add_tile(tile_key{ key, zoom, static_cast<int>(missing[k].first), static_cast<int>(missing[k].second) }, rendered[k]);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#include "output_grid.h"
+#include "tile_scheduler.h"
+#include "checkpoint.h"
+
+//
+// Static sharding of a render over several processes (machines): shard i of n renders a fixed subset of the tiles
+// of the output grid and writes their raw values in the checkpoint format (see checkpoint.h) - so a shard can be
+// resumed like any checkpointed render - and merge_shards() puts them back together.
+//
+// The subset only depends on the grid and n: the tiles (see tile_scheduler::make_tiles(), at least 32 per shard so
+// they even out) are dealt longest-processing-time first, each to the shard with the least cost so far.
+//
+
+constexpr int SHARD_TILES_PER_SHARD = 32;
+
+// Which shard each of the 'tiles' goes to
+inline std::vector<int> shard_assignment(const std::vector<tile>& tiles, int num_shards)
+{
+	std::vector<size_t> order(tiles.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return tiles[a].cost > tiles[b].cost; });
+
+	std::vector<size_t> load(num_shards);
+	std::vector<int> ret(tiles.size());
+
+	for (size_t i : order)
+	{
+		const int s = static_cast<int>(std::min_element(load.begin(), load.end()) - load.begin());
+		ret[i] = s;
+		load[s] += tiles[i].cost;
+	}
+
+	return ret;
+}
+
+// The grid 'g' restricted to the pixels of shard 'shard' of 'num_shards'
+inline output_grid shard_grid(const output_grid& g, int shard, int num_shards)
+{
+	// make_tiles() makes at least 4 per thread
+	const auto tiles = tile_scheduler::make_tiles(g, num_shards * SHARD_TILES_PER_SHARD / 4);
+	const auto assignment = shard_assignment(tiles, num_shards);
+
+	output_grid ret = g;
+	ret.mask.assign(g.num_pixels(), 0);
+
+	for (size_t i = 0; i < tiles.size(); ++i)
+	{
+		if (assignment[i] != shard)
+			continue;
+
+		const auto& t = tiles[i];
+		for (int v = t.v0; v < t.v1; ++v)
+		{
+			for (int u = t.u0; u < t.u1; ++u)
+			{
+				if (g.wanted(u, v))
+					ret.mask[g.image_offs(u, v, 0)] = 1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+// Reads the shard files 'paths' into 'raw' (num_colors doubles per pixel of the output grid), checking that they
+// are the shards 0 .. n - 1 of one render and cover every pixel of it
+inline bool merge_shards(const std::vector<std::string>& paths, checkpoint_header& hdr, std::vector<float>& lambdas, std::vector<double>& raw)
+{
+	std::vector<uint8_t> done;
+	std::vector<int> seen;
+	size_t num_pixels = 0;
+	output_grid g;
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		std::ifstream f(paths[i], std::ios::binary);
+		if (!f)
+		{
+			std::cerr << "Failed to open " << paths[i] << std::endl;
+			return false;
+		}
+
+		checkpoint_header h;
+		std::vector<float> l;
+		if (!read_checkpoint_header(f, paths[i], h, l))
+			return false;
+
+		if (i == 0)
+		{
+			hdr = h;
+			lambdas = l;
+
+			if (hdr.pixel_size != hdr.num_colors * sizeof(double))
+			{
+				std::cerr << paths[i] << " does not have double precision pixels" << std::endl;
+				return false;
+			}
+
+			g = checkpoint_grid(hdr);
+			raw.assign(g.num_pixels() * hdr.num_colors, 0.0);
+			done.assign(static_cast<size_t>(g.rep_width) * g.rep_height, 0);
+			seen.assign(std::max(1, hdr.num_shards), 0);
+		}
+		else
+		{
+			// the shards differ in nothing else
+			checkpoint_header other = h;
+			other.shard = hdr.shard;
+			if (const char* what = checkpoint_mismatch(other, hdr))
+			{
+				std::cerr << paths[i] << " and " << paths[0] << " were rendered with different " << what << std::endl;
+				return false;
+			}
+		}
+
+		if (h.shard < 0 || h.shard >= static_cast<int>(seen.size()) || seen[h.shard]++)
+		{
+			std::cerr << paths[i] << ": shard " << h.shard << " of " << h.num_shards << " is out of range, or given twice" << std::endl;
+			return false;
+		}
+
+		const auto contents = read_checkpoint_records(f, h, g, raw.data(), done);
+		std::cout << paths[i] << ": shard " << h.shard << " of " << h.num_shards << ", " << contents.num_pixels << " pixels" << std::endl;
+
+		if (contents.num_duplicates != 0)
+			std::cout << paths[i] << ": " << contents.num_duplicates << " pixels were rendered more than once" << std::endl;
+
+		num_pixels += contents.num_pixels - contents.num_duplicates;
+	}
+
+	for (size_t s = 0; s < seen.size(); ++s)
+	{
+		if (!seen[s])
+		{
+			std::cerr << "shard " << s << " of " << hdr.num_shards << " is missing" << std::endl;
+			return false;
+		}
+	}
+
+	if (num_pixels != hdr.num_wanted)
+	{
+		std::cerr << "the shards have " << num_pixels << " of the " << hdr.num_wanted << " pixels of the render;"
+			<< " resume the unfinished ones (--resume)" << std::endl;
+		return false;
+	}
+
+	return true;
+}
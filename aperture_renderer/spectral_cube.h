@@ -0,0 +1,301 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "colour_mapping.h"
+
+//
+// Spectral cube file (aperture_renderer --spectral-cube): the intensity of every wavelength of every output pixel,
+// for re-grading a render - exposure, colour mapping, gamma - without rendering it again (aperture_tools tonemap).
+//
+// Layout (little endian, as written by the host):
+//
+//	spectral_cube_header
+//	float lambdas[num_colors]
+//	(zeroes up to data_offset, a multiple of SPECTRAL_CUBE_ALIGNMENT)
+//	float intensity[num_colors][height][width]	planar: a plane per wavelength
+//
+// The intensities are the raw ones (those of aperture::raw); full_scale is the intensity of the full brightness
+// at gain 1, see exposure_max(). The gain, colour mapping and bit depth of the render's PNG are recorded as well,
+// as what re-grading it starts from. The data is page aligned, so the file is used mapped as it is.
+//
+
+constexpr char SPECTRAL_CUBE_MAGIC[8] = { 'A', 'P', 'R', 'S', 'C', 'U', 'B', 'E' };
+constexpr uint32_t SPECTRAL_CUBE_VERSION = 2;
+constexpr uint64_t SPECTRAL_CUBE_ALIGNMENT = 65536;	// the allocation granularity of views on Windows, a page elsewhere
+
+struct spectral_cube_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t num_colors;
+	int32_t width;
+	int32_t height;
+	float R;
+	float lambda;
+	float clr_step;
+	float unfocus_factor;
+	double total_light_per_pixel;
+	float full_scale;
+	float gain;					// the --gain, --colour-mapping and --bit-depth of the render
+	uint32_t colours;			// colour_space
+	int32_t bit_depth;
+	double origin_x;			// the output grid in the input's pixels: the centre of pixel (0, 0), the spacing
+	double origin_y;
+	double pitch;
+	uint64_t data_offset;
+};
+
+template <typename TAperture, typename TGrid>
+spectral_cube_header make_spectral_cube_header(const TAperture& ap, const TGrid& g, float full_scale, float gain,
+	colour_space colours, int bit_depth)
+{
+	spectral_cube_header hdr{};
+	std::memcpy(hdr.magic, SPECTRAL_CUBE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SPECTRAL_CUBE_VERSION;
+	hdr.num_colors = static_cast<uint32_t>(ap.lambda_profiles.size());
+	hdr.width = g.width;
+	hdr.height = g.height;
+	hdr.R = static_cast<float>(ap.R);
+	hdr.lambda = ap.lambda;
+	hdr.clr_step = ap.clr_step;
+	hdr.unfocus_factor = static_cast<float>(ap.unfocus_factor);
+	hdr.total_light_per_pixel = static_cast<double>(ap.total_light_per_pixel);
+	hdr.full_scale = full_scale;
+	hdr.gain = gain;
+	hdr.colours = static_cast<uint32_t>(colours);
+	hdr.bit_depth = bit_depth;
+	hdr.origin_x = g.origin_x;
+	hdr.origin_y = g.origin_y;
+	hdr.pitch = g.pitch;
+	hdr.data_offset = (sizeof(spectral_cube_header) + hdr.num_colors * sizeof(float) + SPECTRAL_CUBE_ALIGNMENT - 1)
+		/ SPECTRAL_CUBE_ALIGNMENT * SPECTRAL_CUBE_ALIGNMENT;
+	return hdr;
+}
+
+//
+// Writes a cube as its rows are done: write_rows() takes a band of rows pixel-major (the layout of aperture::raw)
+// and writes its slice of every plane. Rows never written read as zeroes. Safe to call from several threads.
+//
+class spectral_cube_writer
+{
+	std::string path;
+	spectral_cube_header hdr{};
+	std::ofstream f;
+	std::mutex lock;
+	bool failed{ false };
+
+public:
+	bool open(const std::string& path, const spectral_cube_header& hdr, const std::vector<float>& lambdas)
+	{
+		this->path = path;
+		this->hdr = hdr;
+
+		f.open(path, std::ios::binary | std::ios::trunc);
+		if (!f)
+		{
+			std::cerr << "Failed to open " << path << " for writing" << std::endl;
+			return false;
+		}
+
+		f.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+		f.write(reinterpret_cast<const char*>(lambdas.data()), lambdas.size() * sizeof(float));
+
+		// the full size up front (sparse where the file system has it), so that the rows go anywhere
+		const uint64_t bytes = hdr.data_offset + static_cast<uint64_t>(hdr.num_colors) * hdr.width * hdr.height * sizeof(float);
+		f.seekp(static_cast<std::streamoff>(bytes - 1));
+		f.put(0);
+
+		if (!f)
+		{
+			std::cerr << "Failed to write " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// The rows [y0, y1), width * (y1 - y0) pixels of num_colors intensities each
+	bool write_rows(int y0, int y1, const double* raw)
+	{
+		const size_t num_pixels = static_cast<size_t>(y1 - y0) * hdr.width;
+		const size_t plane_pixels = static_cast<size_t>(hdr.width) * hdr.height;
+		std::vector<float> slice(num_pixels);
+
+		for (size_t c = 0; c < hdr.num_colors; ++c)
+		{
+			for (size_t i = 0; i < num_pixels; ++i)
+				slice[i] = static_cast<float>(raw[i * hdr.num_colors + c]);
+
+			std::lock_guard<std::mutex> l(lock);
+			f.seekp(static_cast<std::streamoff>(hdr.data_offset + (c * plane_pixels + static_cast<size_t>(y0) * hdr.width) * sizeof(float)));
+			f.write(reinterpret_cast<const char*>(slice.data()), slice.size() * sizeof(float));
+			failed |= !f;
+		}
+		return !failed;
+	}
+
+	// The whole image at once, a band of rows at a time
+	bool write(const double* raw)
+	{
+		constexpr int BAND_ROWS = 64;
+		for (int y0 = 0; y0 < hdr.height; y0 += BAND_ROWS)
+		{
+			const int y1 = std::min(hdr.height, y0 + BAND_ROWS);
+			if (!write_rows(y0, y1, raw + static_cast<size_t>(y0) * hdr.width * hdr.num_colors))
+				break;
+		}
+		return finish();
+	}
+
+	bool finish()
+	{
+		std::lock_guard<std::mutex> l(lock);
+		f.close();
+		if (failed || !f)
+		{
+			std::cerr << "Failed to write " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+};
+
+//
+// A cube mapped read-only: plane(c) is the height x width intensities of wavelength c, read from the file as
+// they are touched
+//
+class spectral_cube_view
+{
+	const unsigned char* data{ nullptr };
+	size_t bytes{ 0 };
+#ifdef _WIN32
+	HANDLE file{ INVALID_HANDLE_VALUE };
+	HANDLE section{ nullptr };
+#endif
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data != nullptr)
+			::UnmapViewOfFile(data);
+		if (section != nullptr)
+			::CloseHandle(section);
+		if (file != INVALID_HANDLE_VALUE)
+			::CloseHandle(file);
+		section = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr)
+			::munmap(const_cast<unsigned char*>(data), bytes);
+#endif
+		data = nullptr;
+		bytes = 0;
+	}
+
+public:
+	spectral_cube_header hdr{};
+	std::vector<float> lambdas;
+
+	spectral_cube_view() = default;
+	spectral_cube_view(const spectral_cube_view&) = delete;
+	spectral_cube_view& operator=(const spectral_cube_view&) = delete;
+
+	~spectral_cube_view()
+	{
+		close();
+	}
+
+	bool open(const std::string& path)
+	{
+		close();
+
+#ifdef _WIN32
+		file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		LARGE_INTEGER size;
+		if (file != INVALID_HANDLE_VALUE && ::GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		{
+			bytes = static_cast<size_t>(size.QuadPart);
+			section = ::CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (section != nullptr)
+				data = static_cast<const unsigned char*>(::MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0));
+		}
+#else
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd >= 0 && ::fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			bytes = static_cast<size_t>(st.st_size);
+			void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+				data = static_cast<const unsigned char*>(p);
+		}
+		if (fd >= 0)
+			::close(fd);
+#endif
+
+		if (data == nullptr)
+		{
+			std::cerr << "Failed to open " << path << std::endl;
+			close();
+			return false;
+		}
+
+		if (bytes < sizeof(hdr) || std::memcmp(data, SPECTRAL_CUBE_MAGIC, sizeof(SPECTRAL_CUBE_MAGIC)) != 0)
+		{
+			std::cerr << path << " is not a spectral cube file" << std::endl;
+			close();
+			return false;
+		}
+
+		std::memcpy(&hdr, data, sizeof(hdr));
+		if (hdr.version != SPECTRAL_CUBE_VERSION)
+		{
+			std::cerr << path << ": unsupported spectral cube version " << hdr.version << std::endl;
+			close();
+			return false;
+		}
+
+		const uint64_t expected = hdr.data_offset + static_cast<uint64_t>(hdr.num_colors) * hdr.width * hdr.height * sizeof(float);
+		if (hdr.width <= 0 || hdr.height <= 0 || hdr.data_offset % sizeof(float) != 0
+			|| hdr.data_offset < sizeof(hdr) + hdr.num_colors * sizeof(float) || bytes < expected)
+		{
+			std::cerr << path << " is truncated" << std::endl;
+			close();
+			return false;
+		}
+		if (hdr.colours > static_cast<uint32_t>(colour_space::cie) || (hdr.bit_depth != 8 && hdr.bit_depth != 16))
+		{
+			std::cerr << path << ": unknown colour mapping " << hdr.colours << " or bit depth " << hdr.bit_depth << std::endl;
+			close();
+			return false;
+		}
+
+		lambdas.resize(hdr.num_colors);
+		std::memcpy(lambdas.data(), data + sizeof(hdr), lambdas.size() * sizeof(float));
+		return true;
+	}
+
+	const float* plane(size_t c) const
+	{
+		return reinterpret_cast<const float*>(data + hdr.data_offset) + c * hdr.width * static_cast<size_t>(hdr.height);
+	}
+};
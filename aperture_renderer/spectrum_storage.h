@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+//
+// Compact formats for a kept spectrum (--spectrum-storage): the intensities of a pixel are computed in double as
+// always, and only stored narrower, as the render writes them. They are stored normalised - 1 is the full
+// brightness of the output (see exposure_max()) - which is what the ranges below are relative to.
+//
+//	float		4 bytes a wavelength; relative error 2^-24
+//	half		2 bytes (IEEE binary16); relative error 2^-11 (an 8th of an 8 bit level at full brightness, 32
+//				levels of 16 bits), down to 6e-8 of the full brightness, saturating at 65504 times that
+//	bf16		2 bytes (bfloat16, the top half of a float); relative error 2^-9 (half an 8 bit level at full
+//				brightness), the range of a float
+//	shared-exp	2 bytes a wavelength plus one for the pixel: 16 bit mantissas under the exponent of the pixel's
+//				brightest wavelength; absolute error up to 2^-16 of that value, so the dim wavelengths of a bright
+//				pixel are the ones that lose their relative precision
+//
+enum class spectrum_storage
+{
+	float64,
+	float32,
+	float16,
+	bfloat16,
+	shared_exponent,
+};
+
+inline bool parse_spectrum_storage(const std::string& name, spectrum_storage& storage)
+{
+	if (name == "double")
+		storage = spectrum_storage::float64;
+	else if (name == "float")
+		storage = spectrum_storage::float32;
+	else if (name == "half")
+		storage = spectrum_storage::float16;
+	else if (name == "bf16")
+		storage = spectrum_storage::bfloat16;
+	else if (name == "shared-exp")
+		storage = spectrum_storage::shared_exponent;
+	else
+		return false;
+	return true;
+}
+
+namespace spectrum_storage_detail
+{
+	inline uint32_t bits_of(float f)
+	{
+		uint32_t u;
+		std::memcpy(&u, &f, sizeof(u));
+		return u;
+	}
+
+	inline float float_of(uint32_t u)
+	{
+		float f;
+		std::memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+
+	// round to nearest even; NaN is not expected (the intensities are norms)
+	inline uint16_t to_half(float f)
+	{
+		const uint32_t u = bits_of(f);
+		const uint16_t sign = static_cast<uint16_t>((u >> 16) & 0x8000);
+		const float a = std::abs(f);
+
+		if (a >= 65520.0f)		// rounds past the largest half
+			return sign | 0x7bff;
+		if (a < 5.96046448e-8f * 0.5f)
+			return sign;
+
+		if (a < 6.10351562e-5f)	// subnormal: in units of 2^-24
+			return sign | static_cast<uint16_t>(std::nearbyint(a * 16777216.0f));
+
+		// rebias the exponent and drop 13 bits of the mantissa; a carry out of it bumps the exponent, as it should
+		const uint32_t a_bits = u & 0x7fffffff;
+		const uint32_t kept = a_bits >> 13;
+		const uint32_t round_bit = (a_bits >> 12) & 1;
+		const uint32_t sticky = (a_bits & 0xfff) != 0;
+		return sign | static_cast<uint16_t>(kept - ((127 - 15) << 10) + (round_bit & (sticky | (kept & 1))));
+	}
+
+	inline float from_half(uint16_t h)
+	{
+		const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+		const uint32_t exponent = (h >> 10) & 0x1f;
+		const uint32_t mantissa = h & 0x3ff;
+
+		if (exponent == 0)
+			return (sign ? -1.0f : 1.0f) * mantissa * 5.96046448e-8f;
+
+		return float_of(sign | ((exponent + 127 - 15) << 23) | (mantissa << 13));
+	}
+
+	inline uint16_t to_bfloat16(float f)
+	{
+		const uint32_t u = bits_of(f);
+		return static_cast<uint16_t>((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+	}
+
+	inline float from_bfloat16(uint16_t b)
+	{
+		return float_of(static_cast<uint32_t>(b) << 16);
+	}
+}
+
+// The storage of one pixel of N wavelengths: pack() the normalised intensities, unpack() them again
+
+template <size_t N>
+struct float32_pixel
+{
+	std::array<float, N> v;
+
+	void pack(const double* in)
+	{
+		for (size_t i = 0; i < N; ++i)
+			v[i] = static_cast<float>(in[i]);
+	}
+
+	void unpack(double* out) const
+	{
+		for (size_t i = 0; i < N; ++i)
+			out[i] = v[i];
+	}
+};
+
+template <size_t N>
+struct float16_pixel
+{
+	std::array<uint16_t, N> v;
+
+	void pack(const double* in)
+	{
+		for (size_t i = 0; i < N; ++i)
+			v[i] = spectrum_storage_detail::to_half(static_cast<float>(in[i]));
+	}
+
+	void unpack(double* out) const
+	{
+		for (size_t i = 0; i < N; ++i)
+			out[i] = spectrum_storage_detail::from_half(v[i]);
+	}
+};
+
+template <size_t N>
+struct bfloat16_pixel
+{
+	std::array<uint16_t, N> v;
+
+	void pack(const double* in)
+	{
+		for (size_t i = 0; i < N; ++i)
+			v[i] = spectrum_storage_detail::to_bfloat16(static_cast<float>(in[i]));
+	}
+
+	void unpack(double* out) const
+	{
+		for (size_t i = 0; i < N; ++i)
+			out[i] = spectrum_storage_detail::from_bfloat16(v[i]);
+	}
+};
+
+// 2N + 1 bytes, byte aligned: the mantissas are copied in and out, so they are never read from an odd address
+template <size_t N>
+struct shared_exponent_pixel
+{
+	static constexpr int8_t ZERO = -128;	// all of them 0
+
+	uint8_t bytes[2 * N + 1];	// uint16_t mantissa[N], value = mantissa * 2^(exponent - 16); int8_t exponent
+
+	void pack(const double* in)
+	{
+		double max = 0.0;
+		for (size_t i = 0; i < N; ++i)
+			max = std::max(max, in[i]);
+
+		if (!(max > 0.0))
+		{
+			std::memset(bytes, 0, 2 * N);
+			bytes[2 * N] = static_cast<uint8_t>(ZERO);
+			return;
+		}
+
+		// max < 2^e, and the largest mantissa rounds to at most 65535
+		int e;
+		std::frexp(max, &e);
+		if (std::nearbyint(std::ldexp(max, 16 - e)) > 65535.0)
+			++e;
+		e = std::clamp(e, -127, 127);
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			const uint16_t m = static_cast<uint16_t>(std::clamp(std::nearbyint(std::ldexp(std::max(in[i], 0.0), 16 - e)), 0.0, 65535.0));
+			std::memcpy(bytes + 2 * i, &m, sizeof(m));
+		}
+		bytes[2 * N] = static_cast<uint8_t>(static_cast<int8_t>(e));
+	}
+
+	void unpack(double* out) const
+	{
+		const int8_t exponent = static_cast<int8_t>(bytes[2 * N]);
+		for (size_t i = 0; i < N; ++i)
+		{
+			uint16_t m;
+			std::memcpy(&m, bytes + 2 * i, sizeof(m));
+			out[i] = exponent == ZERO ? 0.0 : std::ldexp(static_cast<double>(m), exponent - 16);
+		}
+	}
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <iostream>
+#include <tuple>
+
+#include "ThreadGrid.h"
+#include "output_grid.h"
+#include "tile_scheduler.h"
+#include "kahan.h"
+
+//
+// Split-K rendering for outputs too small to keep every thread busy: besides the output tiles, the sum over
+// the aperture of each pixel is split into chunks of aperture rows, and the wavelengths into groups, each
+// (tile, chunk, group) being a work item of its own. The chunks write their partial fields into a buffer,
+// which is reduced afterwards in the chunk order, so the result does not depend on the number of threads nor
+// on which thread did what.
+//
+struct split_k_plan
+{
+	int num_chunks{ 1 };		// of the aperture rows
+	int num_groups{ 1 };		// of the wavelengths
+	size_t num_tiles{ 0 };
+
+	bool is_split() const
+	{
+		return num_chunks * num_groups > 1;
+	}
+
+	// Fewer than 'units_per_thread' pixels per thread - split the rows into chunks of at least 'min_rows', then the
+	// wavelengths into equal groups; the partial buffer kept under 'max_bytes'
+	template <typename TAperture>
+	static split_k_plan choose(const TAperture& ap, const output_grid& g, int num_threads,
+		int units_per_thread = 4, int min_rows = 8, size_t max_bytes = size_t{ 256 } << 20)
+	{
+		constexpr int N = static_cast<int>(std::tuple_size<typename TAperture::field_pixel>::value);
+
+		split_k_plan plan;
+
+		size_t num_pixels = 0;
+		for (int v = 0; v < g.rep_height; ++v)
+		{
+			for (int u = 0; u < g.rep_width; ++u)
+			{
+				if (g.wanted(u, v))
+					++num_pixels;
+			}
+		}
+
+		const size_t target = static_cast<size_t>(units_per_thread) * num_threads;
+		if (num_pixels == 0 || num_pixels >= target)
+			return plan;
+
+		const int needed = static_cast<int>((target + num_pixels - 1) / num_pixels);
+		const int rows = ap.height - 2 * ap.ap_skip_y;
+		const size_t bytes_per_chunk = static_cast<size_t>(g.rep_width) * g.rep_height * 4 * sizeof(typename TAperture::field_pixel);
+
+		plan.num_chunks = std::max(1, std::min({ needed, rows / min_rows, static_cast<int>(max_bytes / bytes_per_chunk) }));
+
+		const int remaining = (needed + plan.num_chunks - 1) / plan.num_chunks;
+		while (plan.num_groups < N && (plan.num_groups < remaining || N % plan.num_groups != 0))
+			++plan.num_groups;
+
+		return plan;
+	}
+
+	// the aperture rows of chunk k: [begin, end)
+	template <typename TAperture>
+	std::pair<int, int> chunk_rows(const TAperture& ap, int k) const
+	{
+		const int rows = ap.height - 2 * ap.ap_skip_y;
+		return { ap.ap_skip_y + rows * k / num_chunks, ap.ap_skip_y + rows * (k + 1) / num_chunks };
+	}
+
+	// the wavelengths of group j: [begin, end)
+	std::pair<int, int> group_wavelengths(int n, int j) const
+	{
+		return { n * j / num_groups, n * (j + 1) / num_groups };
+	}
+};
+
+// Renders the grid into 'out' as the plan says, see above
+template <typename TAperture>
+void render_split_k(ThreadGrid& grid, TAperture& ap, const output_grid& g, const split_k_plan& plan, typename TAperture::raw& out)
+{
+	using field_pixel = typename TAperture::field_pixel;
+	using pixel = typename TAperture::pixel;
+	constexpr int N = static_cast<int>(std::tuple_size<field_pixel>::value);
+
+	const size_t rep_pixels = static_cast<size_t>(g.rep_width) * g.rep_height;
+	const int num_parts = plan.num_chunks * plan.num_groups;
+
+	// [(pixel * num_chunks + chunk) * 4 + mirrored image]
+	std::vector<field_pixel> partial(rep_pixels * plan.num_chunks * 4);
+
+	std::vector<tile> items;
+	for (const auto& t : tile_scheduler::make_tiles(g, grid.NumThreads()))
+	{
+		for (int p = 0; p < num_parts; ++p)
+		{
+			tile item = t;
+			item.part = p;
+			items.push_back(item);
+		}
+	}
+
+	std::cout << "split-K: " << items.size() / num_parts << " tiles x " << plan.num_chunks << " aperture row chunks x "
+		<< plan.num_groups << " wavelength groups = " << items.size() << " work items" << std::endl;
+
+	tile_scheduler scheduler;
+	scheduler.run(grid, std::move(items),
+		[&](int, const tile& t)
+		{
+			const auto rows = plan.chunk_rows(ap, t.part / plan.num_groups);
+			const auto wavelengths = plan.group_wavelengths(N, t.part % plan.num_groups);
+
+			for (int v = t.v0; v < t.v1; ++v)
+			{
+				for (int u = t.u0; u < t.u1; ++u)
+				{
+					if (!g.wanted(u, v))
+						continue;
+
+					field_pixel* f = &partial[((static_cast<size_t>(v) * g.rep_width + u) * plan.num_chunks + t.part / plan.num_groups) * 4];
+					ap.diff_field_part(g.x_at(u), g.y_at(v), rows.first, rows.second, wavelengths.first, wavelengths.second,
+						f[0], f[1], f[2], f[3]);
+				}
+			}
+		});
+
+	// the reduction, always in the chunk order
+	grid.GridRun(
+		[&](int thread_idx, int num_threads)
+		{
+			pixel scratch[4]{};
+
+			for (size_t p = thread_idx; p < rep_pixels; p += num_threads)
+			{
+				const int u = static_cast<int>(p % g.rep_width);
+				const int v = static_cast<int>(p / g.rep_width);
+
+				if (!g.wanted(u, v))
+					continue;
+
+				field_pixel f[4];
+				for (int m = 0; m < 4; ++m)
+				{
+					for (int i = 0; i < N; ++i)
+					{
+						kahan::acc<typename pixel::value_type> a{ 0 };
+						kahan::acc<typename pixel::value_type> b{ 0 };
+
+						for (int k = 0; k < plan.num_chunks; ++k)
+						{
+							const auto& c = partial[(p * plan.num_chunks + k) * 4 + m][i];
+							a += c.real();
+							b += c.imag();
+						}
+
+						f[m][i] = { a, b };
+					}
+				}
+
+				ap.finish_field(g.x_at(u), g.y_at(v), f[0], f[1], f[2], f[3]);
+
+				for (int m = 0; m < 4; ++m)
+					TAperture::intensity(f[m], g.has_image(u, v, m) ? out[g.image_offs(u, v, m)] : scratch[m]);
+			}
+		});
+
+	scheduler.report(std::cout);
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI       3.14159265358979323846
+#endif
+
+#include "ThreadGrid.h"
+#include "lodepng.h"
+#include "colour_mapping.h"
+#include "png_stream.h"
+
+//
+// Star field: the rendered PSF convolved with a scene of point sources, each with its own brightness and spectrum.
+//
+// The stars are splatted into one source image per spectral plane, so the cost only depends on the scene and PSF
+// sizes, not on the number of stars. Each plane is then convolved with its PSF plane by tiled FFT (overlap-save:
+// every tile produces a disjoint block of the output), and the result is reduced to RGB right away by the
+// colour_matrix of the render - so only one plane of the scene is kept in memory at a time.
+//
+
+struct star
+{
+	double x;	// scene pixels, pixel centres at whole numbers
+	double y;
+	double brightness;	// 1.0 - as bright as the PSF render itself
+	std::vector<float> spectrum; // weight per spectral plane, empty - flat
+};
+
+// Weights of a black body at 'temperature' (K) for the rendered wavelengths, normalised to the mean of 1.
+// The lambdas are at their lambda_to_nm(), as the colour mappings have them.
+inline std::vector<float> black_body_spectrum(const std::vector<float>& lambdas, double temperature)
+{
+	const float wl_min = *std::min_element(lambdas.begin(), lambdas.end());
+	const float wl_max = *std::max_element(lambdas.begin(), lambdas.end());
+
+	constexpr double h = 6.62607015e-34;
+	constexpr double c = 299792458.0;
+	constexpr double k = 1.380649e-23;
+
+	std::vector<float> ret(lambdas.size());
+	double sum = 0.0;
+
+	for (size_t i = 0; i < lambdas.size(); ++i)
+	{
+		double m = lambda_to_nm(lambdas[i], wl_min, wl_max) * 1e-9;
+
+		double b = 1.0 / (std::pow(m, 5.0) * (std::exp(h * c / (m * k * temperature)) - 1.0));
+		ret[i] = static_cast<float>(b);
+		sum += b;
+	}
+
+	for (auto& v : ret)
+		v = static_cast<float>(v * lambdas.size() / sum);
+
+	return ret;
+}
+
+// Text file, a star per line:
+//	x y brightness					- flat spectrum
+//	x y brightness T				- black body at T kelvin
+//	x y brightness w0 w1 ... w(N-1)	- explicit weight per spectral plane
+// empty lines and lines starting with '#' are skipped
+inline bool read_star_list(const std::string& path, const std::vector<float>& lambdas, std::vector<star>& stars)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for (int line_no = 1; std::getline(in, line); ++line_no)
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ls(line);
+
+		star s;
+		if (!(ls >> s.x >> s.y >> s.brightness))
+		{
+			std::cerr << path << ":" << line_no << ": expected 'x y brightness [T | w0 ... w" << lambdas.size() - 1 << "]'" << std::endl;
+			return false;
+		}
+
+		std::vector<float> rest;
+		float v;
+		while (ls >> v)
+			rest.push_back(v);
+
+		if (rest.size() == 1)
+		{
+			s.spectrum = black_body_spectrum(lambdas, rest[0]);
+		}
+		else if (rest.size() == lambdas.size())
+		{
+			s.spectrum = std::move(rest);
+		}
+		else if (!rest.empty())
+		{
+			std::cerr << path << ":" << line_no << ": expected a temperature or " << lambdas.size() << " spectral weights" << std::endl;
+			return false;
+		}
+
+		stars.push_back(std::move(s));
+	}
+
+	return true;
+}
+
+// Image of the scene: every pixel that is not black is a star of its grey level (1.0 for white), flat spectrum
+inline bool read_star_image(const std::string& path, std::vector<star>& stars, unsigned& width, unsigned& height)
+{
+	std::vector<unsigned char> img;
+	if (lodepng::decode(img, width, height, path) != 0)
+	{
+		std::cerr << "Failed to open " << path << std::endl;
+		return false;
+	}
+
+	for (unsigned y = 0; y < height; ++y)
+	{
+		for (unsigned x = 0; x < width; ++x)
+		{
+			size_t offs = 4 * (static_cast<size_t>(y) * width + x);
+			double v = (img[offs] + img[offs + 1] + img[offs + 2]) / 3.0 / 255.0;
+			if (v > 0.0)
+				stars.push_back({ static_cast<double>(x), static_cast<double>(y), v, {} });
+		}
+	}
+
+	return true;
+}
+
+// In-place radix-2 FFT of 'n' (a power of 2) values
+class fft
+{
+	using cpx = std::complex<float>;
+
+	int n;
+	std::vector<cpx> twiddles;	// exp(-2 pi i k / n), k < n / 2
+	std::vector<int> reversed;	// bit reversal permutation
+
+public:
+	explicit fft(int n)
+		: n{ n }
+		, twiddles(n / 2)
+		, reversed(n)
+	{
+		for (int k = 0; k < n / 2; ++k)
+			twiddles[k] = std::polar(1.0f, static_cast<float>(-2.0 * M_PI * k / n));
+
+		int bits = 0;
+		while ((1 << bits) < n)
+			++bits;
+
+		for (int i = 0; i < n; ++i)
+		{
+			int r = 0;
+			for (int b = 0; b < bits; ++b)
+				r |= ((i >> b) & 1) << (bits - 1 - b);
+			reversed[i] = r;
+		}
+	}
+
+	int size() const noexcept
+	{
+		return n;
+	}
+
+	// inverse is not scaled by 1 / n
+	void run(cpx* data, bool inverse) const noexcept
+	{
+		for (int i = 0; i < n; ++i)
+		{
+			if (i < reversed[i])
+				std::swap(data[i], data[reversed[i]]);
+		}
+
+		for (int len = 2; len <= n; len *= 2)
+		{
+			const int half = len / 2;
+			const int step = n / len;
+
+			for (int start = 0; start < n; start += len)
+			{
+				for (int k = 0; k < half; ++k)
+				{
+					cpx w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+					cpx& a = data[start + k];
+					cpx& b = data[start + k + half];
+
+					cpx t = w * b;
+					b = a - t;
+					a = a + t;
+				}
+			}
+		}
+	}
+};
+
+// 2D FFT of a size x size block, the rows and then the columns spread over the grid
+inline void fft_2d(ThreadGrid& grid, const fft& f, std::vector<std::complex<float>>& data, bool inverse)
+{
+	const int size = f.size();
+
+	grid.GridRun(
+		[&](int thread_idx, int num_threads)
+		{
+			for (int row = thread_idx; row < size; row += num_threads)
+				f.run(data.data() + static_cast<size_t>(row) * size, inverse);
+		});
+
+	grid.GridRun(
+		[&](int thread_idx, int num_threads)
+		{
+			// the columns are copied out, strided access over the whole block is too cache hostile
+			std::vector<std::complex<float>> column(size);
+
+			for (int col = thread_idx; col < size; col += num_threads)
+			{
+				for (int i = 0; i < size; ++i)
+					column[i] = data[static_cast<size_t>(i) * size + col];
+
+				f.run(column.data(), inverse);
+
+				for (int i = 0; i < size; ++i)
+					data[static_cast<size_t>(i) * size + col] = column[i];
+			}
+		});
+}
+
+// 'psf' is psf_width x psf_height pixels of num_colors intensities (the layout of aperture::raw, as rendered - the
+// centre at (psf_width / 2 - 0.5, psf_height / 2 - 0.5)), mapped to colours by 'colours' (with its exposure).
+// The result is the linear RGB of every pixel, 3 floats each, as colour_matrix::reduce() has them (see
+// write_star_field()). 'fft_size' is the tile FFT size, 0 - pick one.
+inline std::vector<float> render_star_field(ThreadGrid& grid, const double* psf, size_t num_colors, int psf_width, int psf_height,
+	const colour_matrix& colours, const std::vector<star>& stars, int width, int height, int fft_size = 0)
+{
+	using cpx = std::complex<float>;
+
+	// the FFT block has to hold a PSF worth of overlap plus the output block; twice the PSF keeps the overlap
+	// at half of the work, and there is no point in going much past the scene itself
+	const int kernel = std::max(psf_width, psf_height);
+	if (fft_size <= 0)
+	{
+		fft_size = 64;
+		while (fft_size < 2 * kernel && fft_size < kernel + std::max(width, height))
+			fft_size *= 2;
+	}
+
+	const int block = fft_size - kernel + 1; // of valid output per tile
+	const int tiles_x = (width + block - 1) / block;
+	const int tiles_y = (height + block - 1) / block;
+
+	std::cout << "Star field: " << stars.size() << " stars, " << width << "x" << height << ", FFT " << fft_size << "x" << fft_size
+		<< ", " << tiles_x * tiles_y << " tiles per spectral plane" << std::endl;
+
+	// splat position: the PSF index (kernel / 2) lands on the source pixel, while the PSF centre is at kernel / 2 - 0.5
+	// for even sizes, so the sources go half a pixel further
+	const double offs_x = psf_width / 2 - (psf_width / 2.0 - 0.5);
+	const double offs_y = psf_height / 2 - (psf_height / 2.0 - 0.5);
+	const int centre_x = psf_width / 2;
+	const int centre_y = psf_height / 2;
+
+	fft f{ fft_size };
+	const size_t fft_pixels = static_cast<size_t>(fft_size) * fft_size;
+	const float scale = 1.0f / fft_pixels;
+
+	std::vector<float> rgb(static_cast<size_t>(width) * height * 3);
+	std::vector<float> source(static_cast<size_t>(width) * height);
+	std::vector<cpx> psf_spectrum(fft_pixels);
+	std::vector<cpx> tile(fft_pixels);
+
+	for (size_t i = 0; i < num_colors; ++i)
+	{
+		// sources of this plane, bilinearly splatted for the sub-pixel positions
+		std::fill(source.begin(), source.end(), 0.0f);
+
+		for (const auto& s : stars)
+		{
+			double v = s.brightness * (s.spectrum.empty() ? 1.0 : s.spectrum[i]);
+			double sx = s.x + offs_x;
+			double sy = s.y + offs_y;
+			int x0 = static_cast<int>(std::floor(sx));
+			int y0 = static_cast<int>(std::floor(sy));
+			double tx = sx - x0;
+			double ty = sy - y0;
+
+			const double w[4] = { (1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty };
+
+			for (int k = 0; k < 4; ++k)
+			{
+				int px = x0 + (k & 1);
+				int py = y0 + (k >> 1);
+				if (px >= 0 && px < width && py >= 0 && py < height)
+					source[static_cast<size_t>(py) * width + px] += static_cast<float>(v * w[k]);
+			}
+		}
+
+		std::fill(psf_spectrum.begin(), psf_spectrum.end(), cpx{});
+		for (int y = 0; y < psf_height; ++y)
+		{
+			for (int x = 0; x < psf_width; ++x)
+				psf_spectrum[static_cast<size_t>(y) * fft_size + x] = static_cast<float>(psf[(static_cast<size_t>(y) * psf_width + x) * num_colors + i]);
+		}
+		fft_2d(grid, f, psf_spectrum, false);
+
+		for (int ty = 0; ty < tiles_y; ++ty)
+		{
+			for (int tx = 0; tx < tiles_x; ++tx)
+			{
+				const int ox = tx * block;
+				const int oy = ty * block;
+
+				// tile[j] = source[o + j - (kernel - 1) + centre], so that the outputs o .. o + block - 1 end up
+				// at kernel - 1 .. fft_size - 1 of the circular convolution, clear of the wrap-around
+				grid.GridRun(
+					[&](int thread_idx, int num_threads)
+					{
+						for (int j = thread_idx; j < fft_size; j += num_threads)
+						{
+							int sy = oy + j - (kernel - 1) + centre_y;
+							cpx* row = tile.data() + static_cast<size_t>(j) * fft_size;
+
+							for (int k = 0; k < fft_size; ++k)
+							{
+								int sx = ox + k - (kernel - 1) + centre_x;
+								bool inside = sx >= 0 && sx < width && sy >= 0 && sy < height;
+								row[k] = inside ? source[static_cast<size_t>(sy) * width + sx] : 0.0f;
+							}
+						}
+					});
+
+				fft_2d(grid, f, tile, false);
+
+				grid.GridRun(
+					[&](int thread_idx, int num_threads)
+					{
+						for (size_t k = thread_idx; k < fft_pixels; k += num_threads)
+							tile[k] *= psf_spectrum[k];
+					});
+
+				fft_2d(grid, f, tile, true);
+
+				grid.GridRun(
+					[&](int thread_idx, int num_threads)
+					{
+						for (int j = thread_idx; j < block && oy + j < height; j += num_threads)
+						{
+							const cpx* row = tile.data() + static_cast<size_t>(kernel - 1 + j) * fft_size + (kernel - 1);
+							float* out = rgb.data() + (static_cast<size_t>(oy + j) * width + ox) * 3;
+
+							for (int k = 0; k < block && ox + k < width; ++k)
+								colours.accumulate(i, std::max(0.0f, row[k].real() * scale), out + 3 * k);
+						}
+					});
+			}
+		}
+	}
+
+	return rgb;
+}
+
+// The render_star_field() 'rgb' of width x height pixels to 'output', as 'colours' encodes it at 'bit_depth'
+inline bool write_star_field(ThreadGrid& grid, const std::string& output, const colour_matrix& colours, int bit_depth,
+	const std::vector<float>& rgb, int width, int height)
+{
+	return png_band_writer::write(grid, output, width, height, bit_depth,
+		[&](int y0, int y1)
+		{
+			const size_t num_pixels = static_cast<size_t>(y1 - y0) * width;
+			std::vector<unsigned char> out(num_pixels * 3 * bit_depth / 8);
+			colours.encode(rgb.data() + static_cast<size_t>(y0) * width * 3, num_pixels, bit_depth, 3, out.data());
+			return out;
+		});
+}
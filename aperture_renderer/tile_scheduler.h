@@ -0,0 +1,360 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "ThreadGrid.h"
+#include "output_grid.h"
+#include "numa.h"
+#include "cancellation.h"
+
+//
+// Dynamic scheduling of the representative part of an output grid over the threads of a ThreadGrid.
+//
+// The region is cut into square tiles, each with an estimated cost (the number of pixels it has to render; weighted
+// by the size of the aperture when the tiles of several renders are scheduled together, see batch.h).
+// The tiles are sorted by cost, most expensive first, and dealt round-robin into per-thread deques. Every thread
+// works from the front of its own deque, and once that is empty steals from the back of the others - the cheap
+// tiles, which is what is left to even out the tail with. Per-thread busy / idle time is collected for the report.
+//
+// On a grid pinned over several NUMA nodes, the tiles of each band of rows (see band_node()) are dealt to the threads
+// of that node only, and the threads steal from their own node first.
+//
+// On a background grid (ThreadGrid::SetBackground()) only the first 'active' threads take tiles, the rest wait: every
+// half a second the CPU time the working threads got is compared to the wall time they spent on the tiles, and
+// if they were starved of more than a quarter of it (CPU steal, cgroup throttling, or the services we share the
+// machine with), a quarter of them stop. Once they get nearly all of it again, threads are added back one by one -
+// not before a few seconds have passed since the last cut, so that it does not flip back and forth.
+//
+struct tile
+{
+	int u0;		// [u0, u1) x [v0, v1) of the representative part of the grid
+	int v0;
+	int u1;
+	int v1;
+	size_t cost;
+	int part{ 0 };	// which part of the work of each pixel, when that is split as well, see split_k.h
+	int job{ 0 };	// which of the jobs rendered together, see batch.h
+};
+
+class tile_scheduler
+{
+	struct queue
+	{
+		std::mutex lock;
+		std::deque<tile> tiles;
+	};
+
+	struct thread_stats
+	{
+		size_t tiles{ 0 };
+		size_t stolen{ 0 };
+		size_t pixels{ 0 };
+		double busy{ 0.0 };
+		double idle{ 0.0 };
+	};
+
+	static constexpr double AdaptInterval = 0.5;	// seconds
+	static constexpr double StarvedHigh = 0.25;		// of the wall time: fewer threads
+	static constexpr double StarvedLow = 0.1;		// more threads
+	static constexpr int HoldIntervals = 10;		// after a cut, before adding threads again
+
+	// background mode, see above
+	std::atomic_int active{ 0 };
+	std::mutex window_lock;
+	double window_wall{ 0.0 };
+	double window_cpu{ 0.0 };
+	int hold{ 0 };
+	std::chrono::steady_clock::time_point window_start;
+
+	std::vector<std::unique_ptr<queue>> queues;
+	std::vector<std::vector<int>> victims;	// per thread: the queues to take from, in order - its own first
+	std::vector<int> thread_node;
+	std::vector<thread_stats> stats;
+	std::atomic_size_t remaining{ 0 };
+	double wall{ 0.0 };
+
+public:
+	// If set, the tiles are taken in bands of that many rows, top to bottom (the most expensive first within a band),
+	// so that the output is finished from the top - see png_stream.h
+	int in_bands_of{ 0 };
+
+	// Tiles of the representative part of 'g', at most 'max_size' pixels square - smaller if that gives less than
+	// 4 tiles per thread. Tiles with nothing to render (masked out) are dropped.
+	static std::vector<tile> make_tiles(const output_grid& g, int num_threads, int max_size = 16)
+	{
+		int size = std::max(1, max_size);
+		while (size > 1 && static_cast<size_t>((g.rep_width + size - 1) / size) * ((g.rep_height + size - 1) / size) < 4u * num_threads)
+			size /= 2;
+
+		std::vector<tile> tiles;
+
+		for (int v0 = 0; v0 < g.rep_height; v0 += size)
+		{
+			for (int u0 = 0; u0 < g.rep_width; u0 += size)
+			{
+				tile t{ u0, v0, std::min(u0 + size, g.rep_width), std::min(v0 + size, g.rep_height), 0 };
+
+				for (int v = t.v0; v < t.v1; ++v)
+				{
+					for (int u = t.u0; u < t.u1; ++u)
+					{
+						if (g.wanted(u, v))
+							++t.cost;
+					}
+				}
+
+				if (t.cost != 0)
+					tiles.push_back(t);
+			}
+		}
+
+		return tiles;
+	}
+
+	// Runs fn(thread_idx, tile) for every tile, returns once all are done - or, if 'cancel' is stopped, once the
+	// tiles started by then are. Returns false in that case.
+	template <typename TFunc>
+	bool run(ThreadGrid& grid, std::vector<tile> tiles, TFunc&& fn, const cancel_token* cancel = nullptr)
+	{
+		const int num_threads = grid.NumThreads();
+
+		std::stable_sort(tiles.begin(), tiles.end(), [this](const tile& a, const tile& b)
+			{
+				if (in_bands_of > 0 && a.v0 / in_bands_of != b.v0 / in_bands_of)
+					return a.v0 / in_bands_of < b.v0 / in_bands_of;
+				return a.cost > b.cost;
+			});
+
+		const int num_nodes = grid.NumNodes();
+
+		thread_node.clear();
+		std::vector<std::vector<int>> node_threads(num_nodes);
+		for (int i = 0; i < num_threads; ++i)
+		{
+			thread_node.push_back(grid.NodeOf(i));
+			node_threads[thread_node[i]].push_back(i);
+		}
+
+		queues.clear();
+		for (int i = 0; i < num_threads; ++i)
+			queues.push_back(std::make_unique<queue>());
+
+		int rep_height = 0;
+		for (const auto& t : tiles)
+			rep_height = std::max(rep_height, t.v1);
+
+		std::vector<size_t> dealt(num_nodes);
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			// every node has threads, see ThreadGrid::NumNodes()
+			const int node = band_node(tiles[i].v0, rep_height, grid);
+			const auto& threads = node_threads[node];
+			queues[threads[dealt[node]++ % threads.size()]]->tiles.push_back(tiles[i]);
+		}
+
+		victims.assign(num_threads, {});
+		for (int i = 0; i < num_threads; ++i)
+		{
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				for (int k = 0; k < num_threads; ++k)
+				{
+					const int j = (i + k) % num_threads;
+					if ((thread_node[j] == thread_node[i]) == (pass == 0))
+						victims[i].push_back(j);
+				}
+			}
+		}
+
+		stats.assign(num_threads, thread_stats{});
+		remaining = tiles.size();
+
+		const bool background = grid.IsBackground();
+		active = num_threads;
+		window_wall = 0.0;
+		window_cpu = 0.0;
+		hold = 0;
+
+		const auto start = std::chrono::steady_clock::now();
+		window_start = start;
+
+		grid.GridRun(
+			[&](int thread_idx, int)
+			{
+				auto& s = stats[thread_idx];
+				tile t;
+				bool stolen;
+
+				for (;;)
+				{
+					if (background && thread_idx >= active)
+					{
+						if (remaining == 0 || (cancel != nullptr && cancel->stop_requested()))
+							break;
+						std::this_thread::sleep_for(std::chrono::milliseconds(20));
+						continue;
+					}
+
+					if ((cancel != nullptr && cancel->stop_requested()) || !next(thread_idx, t, stolen))
+						break;
+
+					const auto tile_start = std::chrono::steady_clock::now();
+					const double cpu_start = background ? platform::thread_cpu_seconds() : 0.0;
+
+					fn(thread_idx, t);
+
+					const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
+					if (background)
+						adapt(wall, platform::thread_cpu_seconds() - cpu_start, num_threads);
+
+					s.busy += wall;
+					++s.tiles;
+					s.pixels += t.cost;
+					if (stolen)
+						++s.stolen;
+				}
+			});
+
+		wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// whatever a thread was not rendering for - waking up, stealing, or waiting for the others to finish
+		for (auto& s : stats)
+			s.idle = std::max(0.0, wall - s.busy);
+
+		return remaining == 0;
+	}
+
+	// tiles not rendered, as the run was cancelled
+	size_t num_skipped() const
+	{
+		return remaining;
+	}
+
+	void report(std::ostream& os) const
+	{
+		double busy = 0.0;
+		double idle = 0.0;
+
+		for (size_t i = 0; i < stats.size(); ++i)
+		{
+			const auto& s = stats[i];
+			os << "thread " << i << ": " << s.tiles << " tiles (" << s.stolen << " stolen), busy " << s.busy
+				<< " s, idle " << s.idle << " s" << std::endl;
+
+			busy += s.busy;
+			idle += s.idle;
+		}
+
+		os << "idle: " << 100.0 * idle / std::max(busy + idle, 1e-9) << "% of the thread time" << std::endl;
+
+		int num_nodes = 1;
+		for (int node : thread_node)
+			num_nodes = std::max(num_nodes, node + 1);
+
+		if (num_nodes == 1)
+			return;
+
+		for (int node = 0; node < num_nodes; ++node)
+		{
+			int threads = 0;
+			size_t pixels = 0;
+			double node_busy = 0.0;
+			for (size_t i = 0; i < stats.size(); ++i)
+			{
+				if (thread_node[i] != node)
+					continue;
+				++threads;
+				pixels += stats[i].pixels;
+				node_busy += stats[i].busy;
+			}
+
+			os << "node " << node << ": " << threads << " threads, " << pixels << " pixels, "
+				<< pixels / std::max(node_busy, 1e-9) << " pixels per thread-second" << std::endl;
+		}
+	}
+
+private:
+	// background mode: accounts a tile that took 'wall' seconds and got 'cpu' seconds of CPU, adjusts the number
+	// of active threads at the end of every interval
+	void adapt(double wall, double cpu, int num_threads)
+	{
+		std::lock_guard<std::mutex> l(window_lock);
+
+		window_wall += wall;
+		window_cpu += cpu;
+
+		const auto now = std::chrono::steady_clock::now();
+		if (std::chrono::duration<double>(now - window_start).count() < AdaptInterval || window_wall <= 0.0)
+			return;
+
+		const double starved = std::max(0.0, 1.0 - window_cpu / window_wall);
+		const int current = active;
+
+		if (starved > StarvedHigh && current > 1)
+		{
+			active = std::max(1, current - std::max(1, current / 4));
+			hold = HoldIntervals;
+		}
+		else if (starved < StarvedLow && current < num_threads && hold == 0)
+		{
+			active = current + 1;
+		}
+		else if (hold > 0)
+		{
+			--hold;
+		}
+
+		if (active != current)
+		{
+			std::cout << std::endl << "background: " << 100.0 * starved << "% of the time starved, "
+				<< active << " of " << num_threads << " threads at work" << std::endl;
+		}
+
+		window_wall = 0.0;
+		window_cpu = 0.0;
+		window_start = now;
+	}
+
+	bool next(int thread_idx, tile& t, bool& stolen)
+	{
+		const int num_threads = static_cast<int>(queues.size());
+
+		while (remaining > 0)
+		{
+			for (int i = 0; i < num_threads; ++i)
+			{
+				const bool own = i == 0;
+				auto& q = *queues[victims[thread_idx][i]];
+
+				std::lock_guard<std::mutex> l(q.lock);
+				if (q.tiles.empty())
+					continue;
+
+				if (own)
+				{
+					t = q.tiles.front();
+					q.tiles.pop_front();
+				}
+				else
+				{
+					t = q.tiles.back();
+					q.tiles.pop_back();
+				}
+
+				--remaining;
+				stolen = !own;
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
@@ -0,0 +1,570 @@
+//
+// Offline operations on the files produced by aperture_renderer, so results can be
+// combined / re-graded without re-running the render itself.
+//
+
+#define _USE_MATH_DEFINES // for C++
+#include <cmath>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <sstream>
+#include <functional>
+#include <chrono>
+
+#include "net.h"	// winsock2.h before windows.h (ThreadGrid.h), see net.h
+#include "lodepng.h"
+#include "field_cube.h"
+#include "colour_mapping.h"
+#include "preview.h"
+#include "star_field.h"
+#include "dispatch_bench.h"
+#include "colour_bench.h"
+#include "shard.h"
+#include "spectral_cube.h"
+#include "png_stream.h"
+
+struct cube
+{
+	field_cube_header hdr;
+	std::vector<float> lambdas;
+	std::vector<std::complex<double>> field;
+};
+
+bool load_cube(const std::string& path, cube& c)
+{
+	return read_field_cube(path, c.hdr, c.lambdas, c.field, nullptr);
+}
+
+bool save_cube(const std::string& path, const cube& c)
+{
+	return write_field_cube(path, c.hdr, c.lambdas, c.field.data(), nullptr);
+}
+
+// Fields can only be added up if they were sampled on the same grid with the same wavelengths
+bool check_compatible(const cube& a, const cube& b, const std::string& name_a, const std::string& name_b)
+{
+	if (!field_cube_compatible(a.hdr, b.hdr))
+	{
+		std::cerr << name_a << " and " << name_b << " were rendered with different sizes or parameters" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// out = a + sign * b
+int cmd_add(const std::string& out, const std::string& in_a, const std::string& in_b, double sign)
+{
+	cube a, b;
+	if (!load_cube(in_a, a) || !load_cube(in_b, b) || !check_compatible(a, b, in_a, in_b))
+		return -1;
+
+	for (size_t i = 0; i < a.field.size(); ++i)
+		a.field[i] += sign * b.field[i];
+
+	// the light passing through the combined aperture, i.e. what the exposure is normalised to
+	a.hdr.total_light_per_pixel += sign * b.hdr.total_light_per_pixel;
+	if (a.hdr.total_light_per_pixel <= 0.0)
+		a.hdr.total_light_per_pixel = std::abs(b.hdr.total_light_per_pixel);
+
+	return save_cube(out, a) ? 0 : -1;
+}
+
+int cmd_scale(const std::string& out, const std::string& in, double k)
+{
+	cube a;
+	if (!load_cube(in, a))
+		return -1;
+
+	for (auto& v : a.field)
+		v *= k;
+
+	a.hdr.total_light_per_pixel *= std::abs(k);
+
+	return save_cube(out, a) ? 0 : -1;
+}
+
+// Multiplies the field by exp(i * phase), same phase for all the wavelengths
+int cmd_phase(const std::string& out, const std::string& in, double phase)
+{
+	cube a;
+	if (!load_cube(in, a))
+		return -1;
+
+	const std::complex<double> rot = std::polar(1.0, phase);
+
+	for (auto& v : a.field)
+		v *= rot;
+
+	return save_cube(out, a) ? 0 : -1;
+}
+
+// Phase shift of an extra optical path 'delay' (in the same px units as lambda), i.e. 2 * pi * delay / lambda[i] -
+// e.g. a piston error of one of the segments of a multi-part aperture
+int cmd_delay(const std::string& out, const std::string& in, double delay)
+{
+	cube a;
+	if (!load_cube(in, a))
+		return -1;
+
+	const size_t num_colors = a.hdr.num_colors;
+
+	std::vector<std::complex<double>> rot(num_colors);
+	for (size_t i = 0; i < num_colors; ++i)
+		rot[i] = std::polar(1.0, 2.0 * M_PI * delay / a.lambdas[i]);
+
+	for (size_t p = 0; p < a.field.size(); p += num_colors)
+	{
+		for (size_t i = 0; i < num_colors; ++i)
+			a.field[p + i] *= rot[i];
+	}
+
+	return save_cube(out, a) ? 0 : -1;
+}
+
+// How the spectrum of a render becomes the PNG: the settings of png, stars, merge and tonemap
+struct grading
+{
+	float gain{ 1.0f };
+	colour_space colours{ colour_space::spectrum };
+	double gamma{ 0.0 };	// 0 - none (sRGB for cie), see colour_matrix::set_gamma()
+	int bit_depth{ 8 };
+	int num_threads{ static_cast<int>(std::max(1u, std::thread::hardware_concurrency())) };
+};
+
+// gain=<g> colours=<spectrum|cie> gamma=<g> bits=<8|16> threads=<n>, over what 'g' has already
+bool parse_grading(const std::string& cmd, const std::vector<std::string>& settings, grading& g)
+{
+	for (const auto& setting : settings)
+	{
+		const size_t eq = setting.find('=');
+		const std::string key = setting.substr(0, eq);
+		const std::string value = eq != std::string::npos ? setting.substr(eq + 1) : "";
+
+		bool ok = eq != std::string::npos;
+		if (key == "gain")
+			ok &= (g.gain = static_cast<float>(std::atof(value.c_str()))) > 0.0f;
+		else if (key == "colours")
+			ok &= parse_colour_space(value, g.colours);
+		else if (key == "gamma")
+			ok &= (g.gamma = std::atof(value.c_str())) > 0.0;
+		else if (key == "bits")
+			ok &= (g.bit_depth = std::atoi(value.c_str())) == 8 || g.bit_depth == 16;
+		else if (key == "threads")
+			ok &= (g.num_threads = std::atoi(value.c_str())) > 0;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			std::cerr << cmd << ": bad setting " << setting << ", see the usage" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// The PNG of width x height pixels graded as 'g' says, 'max' the raw intensity of the full brightness at gain 1.
+// 'spectra' fills in 'n' pixels of lambdas.size() intensities each, from pixel 'first' on; each band of rows is
+// colour mapped and deflated on a thread of its own.
+bool write_graded_png(const std::string& out, const grading& g, const std::vector<float>& lambdas, float max, int width, int height,
+	const std::function<void(size_t first, size_t n, double* raw)>& spectra)
+{
+	colour_matrix matrix{ g.colours, lambdas, max / g.gain };
+	matrix.set_gamma(g.gamma);
+
+	const size_t num_colors = lambdas.size();
+	const int bit_depth = g.bit_depth;
+
+	ThreadGrid grid{ g.num_threads };
+	return png_band_writer::write(grid, out, width, height, bit_depth,
+		[&](int y0, int y1)
+		{
+			constexpr size_t CHUNK = 1024;	// pixels at a time
+			const size_t first = static_cast<size_t>(y0) * width;
+			const size_t num_pixels = static_cast<size_t>(y1 - y0) * width;
+
+			std::vector<unsigned char> rgb(num_pixels * 3 * bit_depth / 8);
+			std::vector<double> raw(CHUNK * num_colors);
+
+			for (size_t i = 0; i < num_pixels; i += CHUNK)
+			{
+				const size_t n = std::min(CHUNK, num_pixels - i);
+				spectra(first + i, n, raw.data());
+				matrix.map(raw.data(), n, bit_depth, 3, rgb.data() + i * 3 * bit_depth / 8);
+			}
+			return rgb;
+		});
+}
+
+// 'words' split into the settings of parse_grading() (those with a '=') and the rest
+void split_settings(const std::vector<std::string>& words, std::vector<std::string>& rest, std::vector<std::string>& settings)
+{
+	for (const auto& word : words)
+		(word.find('=') != std::string::npos ? settings : rest).push_back(word);
+}
+
+// Squares the field into the intensity and maps it to colours exactly the way aperture_renderer does, with the
+// grading 'settings' given
+int cmd_png(const std::string& in, const std::string& out, const std::vector<std::string>& settings)
+{
+	grading g;
+	if (!parse_grading("png", settings, g))
+		return -1;
+
+	cube a;
+	if (!load_cube(in, a))
+		return -1;
+
+	return write_graded_png(out, g, a.lambdas, exposure_max(a.hdr.total_light_per_pixel), a.hdr.width, a.hdr.height,
+		[&](size_t first, size_t n, double* raw)
+		{
+			const auto* field = a.field.data() + first * a.hdr.num_colors;
+			for (size_t i = 0; i < n * a.hdr.num_colors; ++i)
+				raw[i] = M_PI * std::norm(field[i]);
+		}) ? 0 : -1;
+}
+
+// Difference between two renders, e.g. of an --adaptive one against the full render of the same aperture
+int cmd_compare(const std::string& in_a, const std::string& in_b)
+{
+	std::vector<unsigned char> a, b;
+	unsigned width_a, height_a, width_b, height_b;
+
+	if (lodepng::decode(a, width_a, height_a, in_a) != 0 || lodepng::decode(b, width_b, height_b, in_b) != 0)
+	{
+		std::cerr << "Failed to open " << in_a << " or " << in_b << std::endl;
+		return -1;
+	}
+	if (width_a != width_b || height_a != height_b)
+	{
+		std::cerr << "Image sizes differ: " << width_a << "x" << height_a << " vs " << width_b << "x" << height_b << std::endl;
+		return -1;
+	}
+
+	int max_diff = 0;
+	double sum_sqr = 0.0;
+	size_t num_different = 0;
+
+	for (size_t p = 0; p < a.size(); p += 4)
+	{
+		bool different = false;
+		for (size_t c = 0; c < 3; ++c)
+		{
+			int d = std::abs(static_cast<int>(a[p + c]) - static_cast<int>(b[p + c]));
+			max_diff = std::max(max_diff, d);
+			sum_sqr += static_cast<double>(d) * d;
+			different |= d != 0;
+		}
+		if (different)
+			++num_different;
+	}
+
+	const size_t num_pixels = a.size() / 4;
+	const double rms = std::sqrt(sum_sqr / (3.0 * num_pixels));
+
+	std::cout << "max difference: " << max_diff << ", rms: " << rms;
+	if (rms > 0.0)
+		std::cout << ", psnr: " << 20.0 * std::log10(255.0 / rms) << " dB";
+	std::cout << ", pixels differing: " << num_different << " of " << num_pixels << std::endl;
+	return 0;
+}
+
+// Area-averages an aperture image by 'factor' - thresholded first, the way aperture_renderer reads it - keeping the 
+// partial coverage of the pixels as grey levels (what 'aperture_renderer --edges' integrates over). The size is padded to stay even, the same way --preview does it; 
+// the --roi / --zoom printed select the matching output pixels of a render of the original image.
+int cmd_downsample(const std::string& in, const std::string& out, int factor)
+{
+	std::vector<unsigned char> img;
+	unsigned width, height;
+
+	if (lodepng::decode(img, width, height, in) != 0)
+	{
+		std::cerr << "Failed to open " << in << std::endl;
+		return -1;
+	}
+	if (factor < 1)
+	{
+		std::cerr << "The factor must be positive" << std::endl;
+		return -1;
+	}
+
+	std::vector<double> coverage(static_cast<size_t>(width) * height);
+	for (size_t i = 0; i < coverage.size(); ++i)
+		coverage[i] = (img[4 * i] + img[4 * i + 1] + img[4 * i + 2]) / 3.0 / 255.0 > 0.5 ? 1.0 : 0.0;
+
+	auto g = make_preview_geometry(width, height, factor);
+	auto sum = downsample_mask(coverage, width, height, g);
+
+	std::vector<unsigned char> rgba(sum.size() * 4);
+	for (size_t i = 0; i < sum.size(); ++i)
+	{
+		auto v = static_cast<unsigned char>(std::lround(std::min(1.0, sum[i] / (factor * factor)) * 255.0));
+		rgba[4 * i + 0] = rgba[4 * i + 1] = rgba[4 * i + 2] = v;
+		rgba[4 * i + 3] = 255;
+	}
+
+	if (lodepng::encode(out, rgba, g.width, g.height) != 0)
+	{
+		std::cerr << "Failed to write " << out << std::endl;
+		return -1;
+	}
+
+	std::cout << "--roi " << -g.pad_x << "," << -g.pad_y << "," << g.width * factor << "," << g.height * factor
+		<< " --zoom " << 1.0 / factor << std::endl;
+	return 0;
+}
+
+// The star field of 'stars' (a list or an image, see aperture_renderer --stars) with the PSF of the cube; 'words'
+// are the scene size (<w> <h>, optional) and the grading settings
+int cmd_stars(const std::string& in, const std::string& stars_file, const std::string& out, const std::vector<std::string>& words)
+{
+	std::vector<std::string> size;
+	std::vector<std::string> settings;
+	split_settings(words, size, settings);
+
+	grading g;
+	if (!parse_grading("stars", settings, g))
+		return -1;
+	if (!size.empty() && size.size() != 2)
+	{
+		std::cerr << "stars: expected <w> <h> for the scene size" << std::endl;
+		return -1;
+	}
+	const int width = size.empty() ? 0 : std::atoi(size[0].c_str());
+	const int height = size.empty() ? 0 : std::atoi(size[1].c_str());
+
+	cube a;
+	if (!load_cube(in, a))
+		return -1;
+
+	std::vector<double> psf(a.field.size());
+	for (size_t i = 0; i < a.field.size(); ++i)
+		psf[i] = M_PI * std::norm(a.field[i]);
+
+	std::vector<star> stars;
+	unsigned scene_width = width > 0 ? width : a.hdr.width;
+	unsigned scene_height = height > 0 ? height : a.hdr.height;
+
+	const bool is_image = stars_file.size() > 4 && stars_file.substr(stars_file.size() - 4) == ".png";
+
+	if (is_image ? !read_star_image(stars_file, stars, scene_width, scene_height) : !read_star_list(stars_file, a.lambdas, stars))
+		return -1;
+
+	colour_matrix colours{ g.colours, a.lambdas, exposure_max(a.hdr.total_light_per_pixel) / g.gain };
+	colours.set_gamma(g.gamma);
+
+	ThreadGrid grid{ g.num_threads };
+	auto rgb = render_star_field(grid, psf.data(), a.hdr.num_colors, a.hdr.width, a.hdr.height, colours, stars, scene_width, scene_height);
+	return write_star_field(grid, out, colours, g.bit_depth, rgb, scene_width, scene_height) ? 0 : -1;
+}
+
+// Puts the shards of a render (aperture_renderer --shard i/n) together, colour mapped as by aperture_renderer
+// with the grading settings among 'words' (the --gain, --colour-mapping and --bit-depth of the render, say)
+int cmd_merge(const std::string& out, const std::vector<std::string>& words)
+{
+	std::vector<std::string> shards;
+	std::vector<std::string> settings;
+	split_settings(words, shards, settings);
+
+	grading g;
+	if (!parse_grading("merge", settings, g))
+		return -1;
+
+	checkpoint_header hdr;
+	std::vector<float> lambdas;
+	std::vector<double> raw;
+	if (!merge_shards(shards, hdr, lambdas, raw))
+		return -1;
+
+	return write_graded_png(out, g, lambdas, exposure_max(hdr.total_light_per_pixel), hdr.width, hdr.height,
+		[&](size_t first, size_t n, double* spectra)
+		{
+			std::copy_n(raw.data() + first * hdr.num_colors, n * hdr.num_colors, spectra);
+		}) ? 0 : -1;
+}
+
+// Sends a request to the render daemon (aperture_renderer --daemon) on 'socket_path', the image of the reply to 'out'
+int cmd_ask(const std::string& socket_path, const std::string& out, const std::vector<std::string>& words)
+{
+	net::connection c = net::connect_local(socket_path);
+	if (!c.is_open())
+	{
+		std::cerr << "Failed to connect to " << socket_path << std::endl;
+		return -1;
+	}
+
+	std::string request;
+	for (const auto& word : words)
+		request += (request.empty() ? "" : " ") + (word.find(' ') != std::string::npos ? "\"" + word + "\"" : word);
+	request += "\n";
+
+	std::string reply;
+	if (!c.send_all(request.data(), request.size()) || !c.recv_line(reply))
+	{
+		std::cerr << "No reply from " << socket_path << std::endl;
+		return -1;
+	}
+
+	std::cout << reply << std::endl;
+	if (reply.rfind("ok", 0) != 0)
+		return -1;
+
+	// a render: "ok <png|raw> <width> <height> <bytes> ..."
+	std::istringstream ss(reply);
+	std::string ok;
+	std::string format;
+	int width;
+	int height;
+	size_t bytes;
+	if (!(ss >> ok >> format >> width >> height >> bytes))
+		return 0;
+
+	std::vector<unsigned char> image(bytes);
+	if (!c.recv_all(image.data(), image.size()))
+	{
+		std::cerr << "Lost the connection to " << socket_path << std::endl;
+		return -1;
+	}
+
+	if (lodepng::save_file(image, out) != 0)
+	{
+		std::cerr << "Failed to write " << out << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+int cmd_bench_dispatch(int num_threads, int runs)
+{
+	if (num_threads < 1 || runs < 1)
+	{
+		std::cerr << "bench-dispatch needs a positive number of threads and runs" << std::endl;
+		return -1;
+	}
+	return dispatch_bench::run(num_threads, runs, std::cout) ? 0 : -1;
+}
+
+int cmd_bench_colours(int size, int num_threads)
+{
+	if (size < 1 || num_threads < 1)
+	{
+		std::cerr << "bench-colours needs a positive size and number of threads" << std::endl;
+		return -1;
+	}
+	return colour_bench::run(size, num_threads, std::cout) ? 0 : -1;
+}
+
+// Colour maps a spectral cube (aperture_renderer --spectral-cube) to a PNG again, with the grading 'settings'
+// given, and the gain, colour mapping and bit depth of the render (from the header) otherwise. The cube is mapped,
+// the pixels of each band of rows gathered from the planes.
+int cmd_tonemap(const std::string& in, const std::string& out, const std::vector<std::string>& settings)
+{
+	spectral_cube_view cube;
+	if (!cube.open(in))
+		return -1;
+
+	grading g;
+	g.gain = cube.hdr.gain;
+	g.colours = static_cast<colour_space>(cube.hdr.colours);
+	g.bit_depth = cube.hdr.bit_depth;
+	if (!parse_grading("tonemap", settings, g))
+		return -1;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	const size_t num_colors = cube.hdr.num_colors;
+	const bool ok = write_graded_png(out, g, cube.lambdas, cube.hdr.full_scale, cube.hdr.width, cube.hdr.height,
+		[&](size_t first, size_t n, double* raw)
+		{
+			for (size_t c = 0; c < num_colors; ++c)
+			{
+				const float* plane = cube.plane(c) + first;
+				for (size_t j = 0; j < n; ++j)
+					raw[j * num_colors + c] = plane[j];
+			}
+		});
+
+	if (!ok)
+		return -1;
+
+	std::cout << out << ": " << cube.hdr.width << "x" << cube.hdr.height << " in "
+		<< std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+	return 0;
+}
+
+void usage()
+{
+	std::cerr << "Usage:" << std::endl;
+	std::cerr << "aperture_tools add <out.cube> <a.cube> <b.cube>      out = a + b" << std::endl;
+	std::cerr << "aperture_tools sub <out.cube> <a.cube> <b.cube>      out = a - b" << std::endl;
+	std::cerr << "aperture_tools scale <out.cube> <a.cube> <k>         out = k * a" << std::endl;
+	std::cerr << "aperture_tools phase <out.cube> <a.cube> <radians>   out = exp(i * radians) * a" << std::endl;
+	std::cerr << "aperture_tools delay <out.cube> <a.cube> <d>         out = exp(i * 2 * pi * d / lambda) * a, d in px" << std::endl;
+	std::cerr << "aperture_tools png <a.cube> <out.png> [<setting>...] intensity of a, colour mapped as by aperture_renderer" << std::endl;
+	std::cerr << "aperture_tools compare <a.png> <b.png>              max / rms difference between two renders" << std::endl;
+	std::cerr << "aperture_tools downsample <in.png> <out.png> <f>     area-average an aperture by f, partial coverage as grey" << std::endl;
+	std::cerr << "aperture_tools stars <psf.cube> <stars> <out.png> [<w> <h>] [<setting>...]  the PSF of the cube convolved with" << std::endl;
+	std::cerr << "                                                    a list / image of stars, see aperture_renderer --stars" << std::endl;
+	std::cerr << "aperture_tools merge <out.png> <shard>... [<setting>...]  the shards of 'aperture_renderer --shard i/n', all n" << std::endl;
+	std::cerr << "                                                    of them" << std::endl;
+	std::cerr << "aperture_tools tonemap <in.scube> <out.png> [<setting>...]  the PNG of 'aperture_renderer --spectral-cube' again" << std::endl;
+	std::cerr << "aperture_tools ask <socket> <out> <request>...       send a request to 'aperture_renderer --daemon <socket>', e.g." << std::endl;
+	std::cerr << "                                                    render in.png R=2000 zoom=4 roi=100,100,32,32; the image" << std::endl;
+	std::cerr << "                                                    (png, or raw with format=raw) goes to <out>" << std::endl;
+	std::cerr << "aperture_tools bench-dispatch [<threads> [<runs>]]   ThreadGrid round trip of an empty run, against the" << std::endl;
+	std::cerr << "                                                    previous implementation; all cores, 10000 runs by default" << std::endl;
+	std::cerr << "aperture_tools bench-colours [<size> [<threads>]]    colour mapping of a size x size render (2048 by default)," << std::endl;
+	std::cerr << "                                                    against the previous loop; all cores by default" << std::endl;
+	std::cerr << "The <setting>s of png, stars, merge and tonemap: gain=<g>, colours=<spectrum|cie>, bits=<8|16> (1, spectrum and 8 by" << std::endl;
+	std::cerr << "default, those of the render for tonemap), gamma=<g> (none / sRGB for cie by default), threads=<n> (all cores)" << std::endl;
+	std::cerr << "Cubes are written by 'aperture_renderer --cube <file.cube> ...'; fields are only combinable if they were" << std::endl;
+	std::cerr << "rendered at the same size with the same R, lambda and unfocus factor" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		usage();
+		return -1;
+	}
+
+	std::string cmd = argv[1];
+
+	if ((cmd == "add" || cmd == "sub") && argc == 5)
+		return cmd_add(argv[2], argv[3], argv[4], cmd == "add" ? 1.0 : -1.0);
+	if (cmd == "scale" && argc == 5)
+		return cmd_scale(argv[2], argv[3], std::atof(argv[4]));
+	if (cmd == "phase" && argc == 5)
+		return cmd_phase(argv[2], argv[3], std::atof(argv[4]));
+	if (cmd == "delay" && argc == 5)
+		return cmd_delay(argv[2], argv[3], std::atof(argv[4]));
+	if (cmd == "png" && argc >= 4)
+		return cmd_png(argv[2], argv[3], std::vector<std::string>(argv + 4, argv + argc));
+	if (cmd == "compare" && argc == 4)
+		return cmd_compare(argv[2], argv[3]);
+	if (cmd == "stars" && argc >= 5)
+		return cmd_stars(argv[2], argv[3], argv[4], std::vector<std::string>(argv + 5, argv + argc));
+	if (cmd == "downsample" && argc == 5)
+		return cmd_downsample(argv[2], argv[3], std::atoi(argv[4]));
+	if (cmd == "merge" && argc >= 4)
+		return cmd_merge(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	if (cmd == "tonemap" && argc >= 4)
+		return cmd_tonemap(argv[2], argv[3], std::vector<std::string>(argv + 4, argv + argc));
+	if (cmd == "ask" && argc >= 5)
+		return cmd_ask(argv[2], argv[3], std::vector<std::string>(argv + 4, argv + argc));
+	if (cmd == "bench-dispatch" && argc <= 4)
+		return cmd_bench_dispatch(argc >= 3 ? std::atoi(argv[2]) : static_cast<int>(std::max(1u, std::thread::hardware_concurrency())),
+			argc >= 4 ? std::atoi(argv[3]) : 10000);
+
+	if (cmd == "bench-colours" && argc <= 4)
+		return cmd_bench_colours(argc >= 3 ? std::atoi(argv[2]) : 2048,
+			argc >= 4 ? std::atoi(argv[3]) : static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+
+	usage();
+	return -1;
+}
@@ -0,0 +1,29 @@
+
+$exe = "x64\Release\aperture_renderer.exe"
+$tools = "x64\Release\aperture_tools.exe"
+$apertures = (gci bench)
+
+# Accuracy of --adaptive against the full render of the same aperture, for a few error thresholds
+$thresholds = @(0.25, 1.0, 4.0)
+
+foreach ($ap in $apertures)
+{
+	if ($ap.Name.Contains( "out.png") -or -not $ap.Name.EndsWith(".png"))
+	{
+		continue
+	}
+
+	$full_file = $ap -replace '\.png', ("-out.png")
+
+	echo $ap.Name $full_file
+
+	& $exe bench\$ap bench\$full_file 1000 0.75 1.0
+
+	foreach ($t in $thresholds)
+	{
+		$adaptive_file = $ap -replace '\.png', ("-adaptive-" + $t + "-out.png")
+
+		& $exe --adaptive $t bench\$ap bench\$adaptive_file 1000 0.75 1.0
+		& $tools compare bench\$full_file bench\$adaptive_file
+	}
+}
@@ -3,9 +3,13 @@
 $exe = "x64\Release\aperture_renderer.exe"
 $apertures = (gci bench)
 
+# one process for all of them, see --batch; the manifest goes to a temporary file, not among the apertures
+$manifest = [System.IO.Path]::GetTempFileName()
+$jobs = @()
+
 foreach ($ap in $apertures)
 {
-	if ($ap.Name.Contains( "out.png"))
+	if ($ap.Name.Contains( "out.png") -or -not $ap.Name.EndsWith(".png"))
 	{
 		continue
 	}
@@ -14,5 +18,9 @@ foreach ($ap in $apertures)
 
 	echo $ap.Name $out_file	
 	
-	& $exe bench\$ap bench\$out_file 1000 0.75 1.0
+	$jobs += "`"bench\$ap`" `"bench\$out_file`" 1000 0.75 1.0"
 }
+
+Set-Content $manifest $jobs
+& $exe --batch $manifest
+Remove-Item $manifest
@@ -0,0 +1,70 @@
+
+$exe = "x64\Release\aperture_renderer.exe"
+$tools = "x64\Release\aperture_tools.exe"
+$apertures = (gci bench)
+$dir = "bench_edges"
+
+New-Item -ItemType Directory -Force $dir | Out-Null
+
+# Convergence of --edges with the aperture raster: every aperture is area-averaged by f = 2, 4, 8 and rendered
+# (R, lambda and the unfocus factor scaled down to match) with the plain point samples and with 2x2 / 3x3 edge
+# quadrature; the reference is the original raster rendered on the same output grid. Each level is also compared
+# against the plain render of the twice finer raster (f / 2) on that grid, which --edges is supposed to match.
+$factors = @(2, 4, 8)
+$orders = @(1, 2, 3)
+
+$R = 1000
+$lambda = 0.75
+$unfocus = 1.0
+
+foreach ($ap in $apertures)
+{
+	if ($ap.Name.Contains( "out.png") -or -not $ap.Name.EndsWith(".png"))
+	{
+		continue
+	}
+
+	echo $ap.Name
+
+	$pads = @{}
+	$sizes = @{}
+
+	foreach ($f in $factors)
+	{
+		$small_file = $ap -replace '\.png', ("-edges-1_" + $f + ".png")
+		$ref_file = $ap -replace '\.png', ("-edges-ref-1_" + $f + "-out.png")
+
+		# prints the --roi / --zoom of the original that samples the output at the pixels of the downsampled one
+		$roi = (& $tools downsample bench\$ap $dir\$small_file $f) -split ' '
+		$rect = $roi[1] -split ','
+		$pads[$f] = @(- [double]$rect[0], - [double]$rect[1])
+		$sizes[$f] = @(([double]$rect[2] / $f), ([double]$rect[3] / $f))
+
+		& $exe @roi bench\$ap $dir\$ref_file $R $lambda $unfocus | Out-Null
+
+		foreach ($q in $orders)
+		{
+			$out_file = $ap -replace '\.png', ("-edges-1_" + $f + "-q" + $q + "-out.png")
+
+			$t = Measure-Command { & $exe --edges $q --gain ($f * $f) $dir\$small_file $dir\$out_file ($R / $f) ($lambda / $f) ($unfocus / $f) | Out-Null }
+			echo ("1/" + $f + ", edges " + $q + ", " + [math]::Round($t.TotalSeconds, 2) + " s")
+			& $tools compare $dir\$ref_file $dir\$out_file
+		}
+
+		$h = $f / 2
+		if ($h -gt 1)
+		{
+			$finer_file = $ap -replace '\.png', ("-edges-1_" + $h + ".png")
+			$out_file = $ap -replace '\.png', ("-edges-1_" + $h + "-on-1_" + $f + "-out.png")
+
+			$x = ($pads[$h][0] - $pads[$f][0]) / $h
+			$y = ($pads[$h][1] - $pads[$f][1]) / $h
+			$w = 2 * $sizes[$f][0]
+			$hh = 2 * $sizes[$f][1]
+
+			$t = Measure-Command { & $exe --roi "$x,$y,$w,$hh" --zoom 0.5 --gain ($h * $h) $dir\$finer_file $dir\$out_file ($R / $h) ($lambda / $h) ($unfocus / $h) | Out-Null }
+			echo ("1/" + $h + " plain, on the 1/" + $f + " grid, " + [math]::Round($t.TotalSeconds, 2) + " s")
+			& $tools compare $dir\$ref_file $dir\$out_file
+		}
+	}
+}
@@ -0,0 +1,44 @@
+
+$exe = "x64\Release\aperture_renderer.exe"
+$tools = "x64\Release\aperture_tools.exe"
+$apertures = (gci bench)
+$dir = "bench_shards"
+
+New-Item -ItemType Directory -Force $dir | Out-Null
+
+# --shard on one machine: every aperture is rendered as n shards by n processes at once (the cores split between them),
+# merged, and compared against the render of a single process - they are supposed to be identical
+$n = 4
+$threads = [math]::Max(1, [math]::Floor([Environment]::ProcessorCount / $n))
+
+foreach ($ap in $apertures)
+{
+	if ($ap.Name.Contains( "out.png") -or -not $ap.Name.EndsWith(".png"))
+	{
+		continue
+	}
+
+	echo $ap.Name
+
+	$full_file = $ap -replace '\.png', ("-out.png")
+	$merged_file = $ap -replace '\.png', ("-merged-out.png")
+
+	& $exe bench\$ap $dir\$full_file 1000 0.75 1.0 | Out-Null
+
+	$shards = @()
+	$t = Measure-Command {
+		$procs = @()
+		for ($i = 0; $i -lt $n; $i++)
+		{
+			$shard_file = $ap -replace '\.png', ("-" + $i + "_" + $n + ".shard")
+			$shards += "$dir\$shard_file"
+			$procs += Start-Process -FilePath $exe -NoNewWindow -PassThru -RedirectStandardOutput "$dir\$shard_file.log" `
+				-ArgumentList "--threads", $threads, "--shard", "$i/$n", "bench\$ap", "$dir\$shard_file", 1000, 0.75, 1.0
+		}
+		$procs | Wait-Process
+	}
+	echo ($n.ToString() + " shards, " + [math]::Round($t.TotalSeconds, 2) + " s")
+
+	& $tools merge $dir\$merged_file @shards
+	& $tools compare $dir\$full_file $dir\$merged_file
+}
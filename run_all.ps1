@@ -6,6 +6,10 @@ $apertures = (gci sample_apertures)
 $R = 1000
 $wl = 0.75
 
+# one process for all of them, see --batch; the manifest goes to a temporary file, not among the results
+$manifest = [System.IO.Path]::GetTempFileName()
+$jobs = @()
+
 foreach ($ap in $apertures)
 {
 	$out_file = "sample_results\" + $ap.Name 
@@ -15,17 +19,20 @@ foreach ($ap in $apertures)
         Write-Host "Skipping" $ap.Name 
         continue
     }
-		
-	Write-Host "Runniing $ap"
 
     if ($ap.Name.Contains('huge'))
     {
-    	& $exe sample_apertures\$ap $out_file 2000 0.75
+    	$jobs += "`"sample_apertures\$ap`" `"$out_file`" 2000 0.75"
     }
     else
     {        
-    	& $exe sample_apertures\$ap $out_file $R $wv
+    	$jobs += "`"sample_apertures\$ap`" `"$out_file`" $R $wl"
     }
-		
-	Write-Host "Done $ap"
+}
+
+if ($jobs.Count -gt 0)
+{
+	Set-Content $manifest $jobs
+	& $exe --batch $manifest
+	Remove-Item $manifest
 }